@@ -0,0 +1,67 @@
+// Matches request paths against 10,000 registered routes.
+//
+//   bench-router [lookups]
+#include <clask/core.hpp>
+
+int main(int argc, char* argv[]) {
+  const size_t route_count = 10000;
+  size_t lookups = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2000000;
+
+  clask::route_trie trie;
+  // Paths of static routes, and paths that need a placeholder.
+  std::vector<std::string> static_uris, dynamic_uris;
+  auto fn = [] { return clask::func_t([](clask::request&) { return std::string(); }); };
+  for (size_t i = 0; i < route_count; i++) {
+    auto n = std::to_string(i);
+    switch (i % 4) {
+      case 0:
+        trie.insert(clask::route_method::get, "/api/v1/resource" + n, fn());
+        static_uris.push_back("/api/v1/resource" + n);
+        break;
+      case 1:
+        trie.insert(clask::route_method::get, "/api/v1/resource" + n + "/:id", fn());
+        dynamic_uris.push_back("/api/v1/resource" + n + "/12345");
+        break;
+      case 2:
+        trie.insert(clask::route_method::get, "/api/v2/:tenant/items" + n + "/:id/detail", fn());
+        dynamic_uris.push_back("/api/v2/acme/items" + n + "/678/detail");
+        break;
+      default:
+        trie.insert(clask::route_method::get, "/static/" + n + "/index.html", fn());
+        static_uris.push_back("/static/" + n + "/index.html");
+        break;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto table = trie.compile();
+  auto compiled = std::chrono::steady_clock::now();
+
+  auto compile_ms = std::chrono::duration<double, std::milli>(compiled - start).count();
+  std::cout << route_count << " routes (" << table.static_route_count() << " static), "
+            << table.node_count() << " nodes, compiled in " << compile_ms << " ms" << std::endl;
+
+  std::mt19937 rng(42);
+  auto run = [&](const char* name, const std::vector<std::string>& uris) {
+    std::vector<const std::string*> order;
+    order.reserve(4096);
+    for (size_t i = 0; i < 4096; i++) {
+      order.push_back(&uris[rng() % uris.size()]);
+    }
+    size_t matched = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; i++) {
+      clask::route_args args;
+      if (table.match(clask::route_method::get, *order[i & 4095], args) != nullptr) {
+        matched += args.size() + 1;
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    auto ns = std::chrono::duration<double, std::nano>(end - begin).count();
+    std::cout << name << ": " << lookups << " lookups, " << ns / (double) lookups << " ns/lookup"
+              << " (checksum " << matched << ")" << std::endl;
+  };
+  run("static", static_uris);
+  run("placeholder", dynamic_uris);
+  return 0;
+}
@@ -10,6 +10,9 @@
 #include <vector>
 #include <string>
 #include <optional>
+#include <memory>
+#include <string_view>
+#include <cstring>
 #include <unordered_map>
 #include <exception>
 #include <iostream>
@@ -23,9 +26,25 @@
 #include <atomic>
 #include <filesystem>
 #include <chrono>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <tuple>
+#include <random>
+#include <list>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
 
 #ifdef _WIN32
 # include <ws2tcpip.h>
+# include <io.h>
+# include <fcntl.h>
+# include <sys/stat.h>
 inline static void socket_perror(const char *s) {
   char buf[512];
   FormatMessageA(
@@ -42,13 +61,23 @@ typedef char sockopt_t;
 # ifndef SHUT_WR
 #  define SHUT_WR SD_SEND
 # endif
+// winnt.h defines DELETE, which would break server_t::DELETE.
+# ifdef DELETE
+#  undef DELETE
+# endif
 #else
 # include <unistd.h>
 # include <sys/fcntl.h>
+# include <sys/stat.h>
 # include <sys/types.h>
 # include <sys/socket.h>
+# include <sys/mman.h>
 # include <poll.h>
 # include <netinet/in.h>
+# include <netinet/tcp.h>
+# ifdef __linux__
+#  include <sys/sendfile.h>
+# endif
 # include <arpa/inet.h>
 # include <netdb.h>
 #define closesocket(fd) close(fd)
@@ -59,6 +88,10 @@ typedef int sockopt_t;
 #include "picohttpparser.h"
 #include "picohttpparser.c"
 
+#ifdef CLASK_USE_ZLIB
+# include <zlib.h>
+#endif
+
 #ifndef MSG_NOSIGNAL
 #  define MSG_NOSIGNAL 0
 #endif
@@ -68,6 +101,20 @@ namespace clask {
 constexpr int keep_alive_timeout_ms = 5000;
 constexpr size_t accept_queue_factor = 64;
 constexpr unsigned int default_worker_count = 4;
+constexpr size_t default_max_header_size = 16384;
+constexpr size_t default_max_header_count = 100;
+constexpr size_t initial_header_buffer_size = 1024;
+constexpr size_t body_scratch_buffer_size = 16384;
+constexpr size_t default_max_decompression_ratio = 100;
+// Bodies that inflate to less than this are never rejected for their ratio.
+constexpr size_t decompression_ratio_floor = 65536;
+constexpr size_t default_output_buffer_size = 16384;
+constexpr size_t default_static_cache_max_file_size = 65536;
+constexpr int default_compression_level = 6;
+// Below this, compressed bodies rarely save a packet.
+constexpr size_t default_compression_min_size = 1024;
+// Records per thread in the access log's ring.
+constexpr size_t default_access_log_ring_size = 1024;
 
 struct socket_wait_event {
   int fd;
@@ -83,6 +130,10 @@ struct socket_wait_result {
 struct connection_state {
   int fd;
   std::string remote;
+  // The rest of a response the reactor answered but could not send
+  // without blocking; a worker sends it instead of reading a request.
+  std::string pending_output{};
+  bool pending_keep_alive = false;
 };
 
 struct completed_connection {
@@ -90,7 +141,27 @@ struct completed_connection {
   bool keep_alive;
 };
 
+// What the reactor did with a readable connection it tried to serve
+// itself.
+enum class reactor_result {
+  // Left for a worker: the request is incomplete, has a body or its
+  // route is not reactor-inline.
+  deferred,
+  // Answered; the connection goes back to idle.
+  keep_alive,
+  // Answered and closed.
+  closed,
+  // Answered, but the socket buffer filled up; a worker sends the rest
+  // of the response, from the connection's pending_output.
+  partial,
+};
+
 struct server_runtime_state {
+  // Called on the reactor thread for each readable idle connection
+  // before it is handed to a worker, while inline_routes is set.
+  std::function<reactor_result(connection_state&)> serve_inline;
+  // Set once some route is reactor-inline; may change while running.
+  const std::atomic<bool>* inline_routes = nullptr;
   std::mutex ready_queue_mu;
   std::condition_variable ready_queue_cv;
   std::deque<connection_state> ready_queue;
@@ -117,19 +188,26 @@ struct static_path_resolution {
   std::string path;
 };
 
-struct path_segment {
-  std::string value;
-  size_t next_offset;
-  bool placeholder;
-  bool has_more;
-};
-
+// HEAD is routed as GET.
 enum class route_method {
   get,
   post,
   query,
+  put,
+  patch,
+  delete_,
+  options,
 };
 
+constexpr size_t route_method_count = 7;
+
+// A set of route_method, one bit each.
+typedef std::uint32_t route_method_set;
+
+constexpr route_method_set route_method_bit(route_method method) {
+  return (route_method_set) 1 << (int) method;
+}
+
 inline void drain_completed_connections(server_runtime_state& runtime);
 inline void accept_ready_connection(
     int server_fd,
@@ -138,6 +216,7 @@ inline void accept_ready_connection(
 inline void requeue_readable_idle_connections(
     const std::vector<socket_wait_event>& events,
     server_runtime_state& runtime);
+inline bool send_pending_output(connection_state& conn);
 
 inline bool set_socket_timeout(int s, int optname, int timeout_ms) {
 #ifdef _WIN32
@@ -229,14 +308,274 @@ inline socket_wait_result wait_socket_events(
   return result;
 }
 
+struct status_line_entry {
+  int code;
+  std::string_view line;
+};
+
+// Preformatted status lines, so serializing a response head never hashes or
+// formats the status.
+constexpr status_line_entry status_line_entries[] = {
+  { 100, "HTTP/1.1 100 Continue\r\n" },
+  { 101, "HTTP/1.1 101 Switching Protocols\r\n" },
+  { 102, "HTTP/1.1 102 Processing\r\n" },
+  { 200, "HTTP/1.1 200 OK\r\n" },
+  { 201, "HTTP/1.1 201 Created\r\n" },
+  { 202, "HTTP/1.1 202 Accepted\r\n" },
+  { 203, "HTTP/1.1 203 Non-Authoritative Information\r\n" },
+  { 204, "HTTP/1.1 204 No Content\r\n" },
+  { 205, "HTTP/1.1 205 Reset Content\r\n" },
+  { 206, "HTTP/1.1 206 Partial Content\r\n" },
+  { 207, "HTTP/1.1 207 Multi-Status\r\n" },
+  { 208, "HTTP/1.1 208 Already Reported\r\n" },
+  { 300, "HTTP/1.1 300 Multiple Choices\r\n" },
+  { 301, "HTTP/1.1 301 Moved Permanently\r\n" },
+  { 302, "HTTP/1.1 302 Found\r\n" },
+  { 303, "HTTP/1.1 303 See Other\r\n" },
+  { 304, "HTTP/1.1 304 Not Modified\r\n" },
+  { 305, "HTTP/1.1 305 Use Proxy\r\n" },
+  { 307, "HTTP/1.1 307 Temporary Redirect\r\n" },
+  { 400, "HTTP/1.1 400 Bad Request\r\n" },
+  { 401, "HTTP/1.1 401 Unauthorized\r\n" },
+  { 402, "HTTP/1.1 402 Payment Required\r\n" },
+  { 403, "HTTP/1.1 403 Forbidden\r\n" },
+  { 404, "HTTP/1.1 404 Not Found\r\n" },
+  { 405, "HTTP/1.1 405 Method Not Allowed\r\n" },
+  { 406, "HTTP/1.1 406 Not Acceptable\r\n" },
+  { 407, "HTTP/1.1 407 Proxy Authentication Required\r\n" },
+  { 408, "HTTP/1.1 408 Request Timeout\r\n" },
+  { 409, "HTTP/1.1 409 Conflict\r\n" },
+  { 410, "HTTP/1.1 410 Gone\r\n" },
+  { 411, "HTTP/1.1 411 Length Required\r\n" },
+  { 412, "HTTP/1.1 412 Precondition Failed\r\n" },
+  { 413, "HTTP/1.1 413 Request Entity Too Large\r\n" },
+  { 414, "HTTP/1.1 414 Request-URI Too Large\r\n" },
+  { 415, "HTTP/1.1 415 Unsupported Media Type\r\n" },
+  { 416, "HTTP/1.1 416 Request Range Not Satisfiable\r\n" },
+  { 417, "HTTP/1.1 417 Expectation Failed\r\n" },
+  { 418, "HTTP/1.1 418 I'm a teapot\r\n" },
+  { 422, "HTTP/1.1 422 Unprocessable Entity\r\n" },
+  { 423, "HTTP/1.1 423 Locked\r\n" },
+  { 424, "HTTP/1.1 424 Failed Dependency\r\n" },
+  { 425, "HTTP/1.1 425 No code\r\n" },
+  { 426, "HTTP/1.1 426 Upgrade Required\r\n" },
+  { 428, "HTTP/1.1 428 Precondition Required\r\n" },
+  { 429, "HTTP/1.1 429 Too Many Requests\r\n" },
+  { 431, "HTTP/1.1 431 Request Header Fields Too Large\r\n" },
+  { 449, "HTTP/1.1 449 Retry with\r\n" },
+  { 500, "HTTP/1.1 500 Internal Server Error\r\n" },
+  { 501, "HTTP/1.1 501 Not Implemented\r\n" },
+  { 502, "HTTP/1.1 502 Bad Gateway\r\n" },
+  { 503, "HTTP/1.1 503 Service Unavailable\r\n" },
+  { 504, "HTTP/1.1 504 Gateway Timeout\r\n" },
+  { 505, "HTTP/1.1 505 HTTP Version Not Supported\r\n" },
+  { 506, "HTTP/1.1 506 Variant Also Negotiates\r\n" },
+  { 507, "HTTP/1.1 507 Insufficient Storage\r\n" },
+  { 509, "HTTP/1.1 509 Bandwidth Limit Exceeded\r\n" },
+  { 510, "HTTP/1.1 510 Not Extended\r\n" },
+  { 511, "HTTP/1.1 511 Network Authentication Required\r\n" },
+};
+
+constexpr int min_status_code = 100;
+constexpr int max_status_code = 599;
+
+constexpr auto status_line_table = [] {
+  std::array<std::string_view, max_status_code - min_status_code + 1> table{};
+  for (auto& e : status_line_entries) {
+    table[(size_t) (e.code - min_status_code)] = e.line;
+  }
+  return table;
+}();
+
+// Returns "HTTP/1.1 NNN Reason\r\n", or an empty view for unknown codes.
+constexpr std::string_view status_line(int code) {
+  if (code < min_status_code || code > max_status_code) {
+    return {};
+  }
+  return status_line_table[(size_t) (code - min_status_code)];
+}
+
+constexpr std::string_view status_reason(int code) {
+  auto line = status_line(code);
+  if (line.empty()) {
+    return {};
+  }
+  constexpr size_t prefix = sizeof("HTTP/1.1 NNN ") - 1;
+  return line.substr(prefix, line.size() - prefix - 2);
+}
+
+// Kept for code written against the old reason-phrase map; new code should
+// use status_reason(), which does not allocate.
+inline std::unordered_map<int, std::string> status_codes = [] {
+  std::unordered_map<int, std::string> m;
+  for (auto& e : status_line_entries) {
+    m.emplace(e.code, std::string(status_reason(e.code)));
+  }
+  return m;
+}();
+
+template <typename T>
+inline void append_number(std::string& out, T v, int base = 10) {
+  char buf[24];
+  auto r = std::to_chars(buf, buf + sizeof(buf), v, base);
+  out.append(buf, (size_t) (r.ptr - buf));
+}
+
+inline void append_status_line(std::string& out, int code) {
+  auto line = status_line(code);
+  if (!line.empty()) {
+    out += line;
+    return;
+  }
+  out += "HTTP/1.1 ";
+  append_number(out, code);
+  out += " \r\n";
+}
+
+inline void append_header(std::string& out, std::string_view key, std::string_view val) {
+  out += key;
+  out += ": ";
+  out += val;
+  out += "\r\n";
+}
+
+inline std::tm to_localtime(std::time_t t) {
+  std::tm local{};
+#ifdef _WIN32
+  localtime_s(&local, &t);
+#else
+  localtime_r(&t, &local);
+#endif
+  return local;
+}
+
+inline std::tm to_gmtime(std::time_t t) {
+  std::tm gmt{};
+#ifdef _WIN32
+  gmtime_s(&gmt, &t);
+#else
+  gmtime_r(&t, &gmt);
+#endif
+  return gmt;
+}
+
+constexpr size_t http_date_size = sizeof("Sun, 06 Nov 1994 08:49:37 GMT") - 1;
+
+// Writes the IMF-fixdate of gmt to out (http_date_size bytes). The day and
+// month names come from fixed tables because strftime's %a and %b follow
+// the C locale.
+inline void write_http_date(char* out, const std::tm& gmt) {
+  constexpr std::string_view days = "SunMonTueWedThuFriSat";
+  constexpr std::string_view months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  auto put2 = [&](size_t pos, int v) {
+    out[pos] = (char) ('0' + v / 10 % 10);
+    out[pos + 1] = (char) ('0' + v % 10);
+  };
+  std::memcpy(out, "Sun, 00 Jan 0000 00:00:00 GMT", http_date_size);
+  std::memcpy(out, days.data() + (gmt.tm_wday % 7) * 3, 3);
+  put2(5, gmt.tm_mday);
+  std::memcpy(out + 8, months.data() + (gmt.tm_mon % 12) * 3, 3);
+  int year = gmt.tm_year + 1900;
+  put2(12, year / 100);
+  put2(14, year % 100);
+  put2(17, gmt.tm_hour);
+  put2(20, gmt.tm_min);
+  put2(23, gmt.tm_sec);
+}
+
+// Formats t as an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+inline std::string format_http_date(std::time_t t) {
+  std::string out(http_date_size, ' ');
+  write_http_date(out.data(), to_gmtime(t));
+  return out;
+}
+
+// Parses an IMF-fixdate without going through the C locale or the local
+// time zone. The obsolete RFC 850 and asctime forms yield nullopt.
+inline std::optional<std::time_t> parse_http_date(std::string_view s) {
+  if (s.size() != 29 || s[3] != ',' || s.substr(25) != " GMT") {
+    return std::nullopt;
+  }
+  auto num = [&](size_t pos, size_t len) -> int {
+    int v = 0;
+    for (size_t i = pos; i < pos + len; i++) {
+      if (s[i] < '0' || s[i] > '9') return -1;
+      v = v * 10 + (s[i] - '0');
+    }
+    return v;
+  };
+  if (s[4] != ' ' || s[7] != ' ' || s[11] != ' ' || s[16] != ' ' || s[19] != ':' || s[22] != ':') {
+    return std::nullopt;
+  }
+  constexpr std::string_view months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  auto m = months.find(s.substr(8, 3));
+  int day = num(5, 2), year = num(12, 4), hour = num(17, 2), min = num(20, 2), sec = num(23, 2);
+  if (m == std::string_view::npos || m % 3 != 0 || year < 0 || hour < 0 || min < 0 || sec < 0) {
+    return std::nullopt;
+  }
+  int month = (int) m / 3 + 1;
+  constexpr int month_days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  auto leap = month == 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+  // An invalid date is ignored (RFC 9110, 13.1.3), so out-of-range fields
+  // must not be normalized into some other instant.
+  if (day < 1 || day > month_days[month - 1] + (leap ? 1 : 0) || hour > 23 || min > 59 || sec > 60) {
+    return std::nullopt;
+  }
+  // Days since the epoch from a civil date (Howard Hinnant's algorithm).
+  int y = year - (month <= 2);
+  int era = y / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  auto days = (std::int64_t) era * 146097 + doe - 719468;
+  return (std::time_t) (days * 86400 + hour * 3600 + min * 60 + sec);
+}
+
+// The reactor publishes the current second; each worker re-formats its own
+// copy of the Date header only when that second changes.
+class http_date {
+private:
+  static std::atomic<std::time_t>& clock() {
+    static std::atomic<std::time_t> now{0};
+    return now;
+  }
+public:
+  static void tick() {
+    clock().store(std::time(nullptr), std::memory_order_relaxed);
+  }
+  // The second last published by the reactor, or the wall clock when no
+  // reactor is running.
+  static std::time_t now() {
+    auto t = clock().load(std::memory_order_relaxed);
+    return t != 0 ? t : std::time(nullptr);
+  }
+  // Returns "Date: <IMF-fixdate>\r\n".
+  static std::string_view header() {
+    thread_local std::time_t cached = -1;
+    thread_local char buf[sizeof("Date: \r\n") - 1 + http_date_size] = "Date: ";
+    auto now = http_date::now();
+    if (now != cached) {
+      write_http_date(buf + 6, to_gmtime(now));
+      std::memcpy(buf + 6 + http_date_size, "\r\n", 2);
+      cached = now;
+    }
+    return std::string_view(buf, sizeof(buf));
+  }
+};
+
 inline void send_service_unavailable_response(int s) {
-  static const std::string busy_response =
-      "HTTP/1.1 503 Service Unavailable\r\n"
+  constexpr std::string_view status = "HTTP/1.1 503 Service Unavailable\r\n";
+  constexpr std::string_view rest =
       "Content-Type: text/plain\r\n"
       "Connection: Close\r\n"
       "Content-Length: 19\r\n\r\n"
       "Service Unavailable";
-  send(s, busy_response.data(), (int) busy_response.size(), MSG_NOSIGNAL);
+  std::string out;
+  out.reserve(status.size() + 64 + rest.size());
+  out += status;
+  out += http_date::header();
+  out += rest;
+  send(s, out.data(), (int) out.size(), MSG_NOSIGNAL);
 }
 
 inline bool accept_connection(
@@ -248,6 +587,9 @@ inline bool accept_connection(
   if (s < 0) {
     return false;
   }
+  // Responses are coalesced in user space, so Nagle only adds latency.
+  sockopt_t nodelay = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &nodelay, (int) sizeof(nodelay));
   char addr_buf[INET_ADDRSTRLEN];
   inet_ntop(AF_INET, &client_address.sin_addr, addr_buf, INET_ADDRSTRLEN);
   conn = connection_state {
@@ -316,27 +658,6 @@ inline bool contains_parent_reference(const std::string& path) {
   return path.find("..") != std::string::npos;
 }
 
-inline path_segment parse_path_segment(const std::string& path, size_t offset) {
-  auto pos = path.find('/', offset + 1);
-  auto has_more = pos != std::string::npos;
-  if (!has_more) {
-    pos = path.size();
-  }
-
-  auto raw = path.substr(offset + 1, pos - offset - 1);
-  auto placeholder = !raw.empty() && raw[0] == ':';
-  if (placeholder) {
-    raw = raw.substr(1);
-  }
-
-  return path_segment{
-    .value = std::move(raw),
-    .next_offset = pos,
-    .placeholder = placeholder,
-    .has_more = has_more,
-  };
-}
-
 inline std::optional<route_method> parse_route_method(const std::string& method) {
   if (method == "GET" || method == "HEAD") {
     return route_method::get;
@@ -347,9 +668,43 @@ inline std::optional<route_method> parse_route_method(const std::string& method)
   if (method == "QUERY") {
     return route_method::query;
   }
+  if (method == "PUT") {
+    return route_method::put;
+  }
+  if (method == "PATCH") {
+    return route_method::patch;
+  }
+  if (method == "DELETE") {
+    return route_method::delete_;
+  }
+  if (method == "OPTIONS") {
+    return route_method::options;
+  }
   return std::nullopt;
 }
 
+// The value of an Allow header for the methods in set. OPTIONS is always
+// allowed, since it is answered automatically.
+inline std::string allow_header_value(route_method_set set) {
+  static const std::pair<route_method, const char*> names[] = {
+    { route_method::get, "GET, HEAD" },
+    { route_method::post, "POST" },
+    { route_method::put, "PUT" },
+    { route_method::patch, "PATCH" },
+    { route_method::delete_, "DELETE" },
+    { route_method::query, "QUERY" },
+  };
+  std::string out;
+  for (auto& n : names) {
+    if (set & route_method_bit(n.first)) {
+      out += n.second;
+      out += ", ";
+    }
+  }
+  out += "OPTIONS";
+  return out;
+}
+
 inline void initialize_network_runtime() {
 #ifdef _WIN32
   WSADATA wsa;
@@ -408,7 +763,9 @@ inline void start_worker_pool(
           conn = std::move(runtime.ready_queue.front());
           runtime.ready_queue.pop_front();
         }
-        auto keep_alive = handle_connection(conn.fd, conn.remote);
+        auto keep_alive = conn.pending_output.empty()
+            ? handle_connection(conn.fd, conn.remote)
+            : send_pending_output(conn);
         {
           std::lock_guard<std::mutex> lk(runtime.completed_queue_mu);
           runtime.completed_queue.push_back(completed_connection{
@@ -434,6 +791,7 @@ inline void run_server_event_loop(
       std::forward<HandleConnectionFn>(handle_connection));
 
   while (true) {
+    http_date::tick();
     drain_completed_connections(runtime);
     auto wait_result = wait_socket_events(server_fd, runtime.idle_connections, 100);
     if (!wait_result.server_readable && wait_result.events.empty()) {
@@ -474,6 +832,12 @@ inline void drain_completed_connections(
   }
 }
 
+inline bool serves_inline(const server_runtime_state& runtime) {
+  return runtime.serve_inline
+      && runtime.inline_routes != nullptr
+      && runtime.inline_routes->load(std::memory_order_relaxed);
+}
+
 inline void accept_ready_connection(
     int server_fd,
     size_t accept_queue_limit,
@@ -493,6 +857,11 @@ inline void accept_ready_connection(
     return;
   }
   runtime.tracked_connections++;
+  if (serves_inline(runtime)) {
+    // Wait for the request on the reactor, which may answer it itself.
+    runtime.idle_connections.emplace(conn.fd, std::move(conn));
+    return;
+  }
   enqueue_ready_connection(runtime, std::move(conn));
 }
 
@@ -510,30 +879,291 @@ inline void requeue_readable_idle_connections(
       runtime.idle_connections.erase(it);
       continue;
     }
-    if (event.readable) {
-      enqueue_ready_connection(runtime, std::move(it->second));
-      runtime.idle_connections.erase(it);
+    if (!event.readable) {
+      continue;
+    }
+    if (serves_inline(runtime)) {
+      auto result = runtime.serve_inline(it->second);
+      if (result == reactor_result::keep_alive) {
+        continue;
+      }
+      if (result == reactor_result::closed) {
+        closesocket(it->first);
+        runtime.tracked_connections--;
+        runtime.idle_connections.erase(it);
+        continue;
+      }
+    }
+    enqueue_ready_connection(runtime, std::move(it->second));
+    runtime.idle_connections.erase(it);
+  }
+}
+
+// Per-thread free list of byte buffers, so that steady-state requests do
+// not allocate. Buffers that grew past retain_limit are freed on release
+// instead of being kept around for the thread's lifetime.
+class buffer_pool {
+private:
+  std::vector<std::string> free_list;
+public:
+  static buffer_pool& local() {
+    thread_local buffer_pool pool;
+    return pool;
+  }
+  std::string acquire() {
+    if (free_list.empty()) {
+      return std::string();
+    }
+    auto buf = std::move(free_list.back());
+    free_list.pop_back();
+    return buf;
+  }
+  void release(std::string buf, size_t retain_limit) {
+    if (buf.capacity() > retain_limit) {
+      return;
+    }
+    buf.clear();
+    free_list.emplace_back(std::move(buf));
+  }
+};
+
+class pooled_buffer {
+private:
+  size_t retain_limit;
+  pooled_buffer(const pooled_buffer&) = delete;
+  pooled_buffer& operator =(const pooled_buffer&) = delete;
+public:
+  std::string buf;
+  pooled_buffer(size_t retain_limit) : retain_limit(retain_limit), buf(buffer_pool::local().acquire()) { }
+  ~pooled_buffer() {
+    buffer_pool::local().release(std::move(buf), retain_limit);
+  }
+};
+
+struct io_slice {
+  const char* data;
+  size_t size;
+};
+
+// Bytes this thread has written to sockets. The access log takes the
+// difference across a request.
+inline std::uint64_t& socket_bytes_sent() {
+  thread_local std::uint64_t n = 0;
+  return n;
+}
+
+// While set, socket writes on this thread append here instead, so the
+// reactor can run a handler and then send its response without blocking.
+inline std::string*& socket_capture() {
+  thread_local std::string* capture = nullptr;
+  return capture;
+}
+
+class socket_capture_guard {
+public:
+  explicit socket_capture_guard(std::string& out) {
+    socket_capture() = &out;
+  }
+  ~socket_capture_guard() {
+    socket_capture() = nullptr;
+  }
+  socket_capture_guard(const socket_capture_guard&) = delete;
+  socket_capture_guard& operator =(const socket_capture_guard&) = delete;
+};
+
+// Sends every slice, in order, with as few syscalls as the kernel allows.
+// more hints that further data follows immediately (MSG_MORE), so the tail
+// of these slices is not pushed out as a short segment.
+inline bool send_slices(int s, io_slice* slices, size_t count, bool more = false) {
+  constexpr size_t max_batch = 16;
+  if (auto capture = socket_capture()) {
+    for (size_t i = 0; i < count; i++) {
+      capture->append(slices[i].data, slices[i].size);
+      socket_bytes_sent() += slices[i].size;
+    }
+    return true;
+  }
+  while (count > 0 && slices->size == 0) {
+    slices++;
+    count--;
+  }
+  while (count > 0) {
+    auto batch = std::min(count, max_batch);
+#ifdef _WIN32
+    WSABUF bufs[max_batch];
+    for (size_t i = 0; i < batch; i++) {
+      bufs[i].buf = const_cast<char*>(slices[i].data);
+      bufs[i].len = (ULONG) slices[i].size;
+    }
+    (void) more;
+    DWORD written = 0;
+    if (WSASend((SOCKET) s, bufs, (DWORD) batch, &written, 0, nullptr, nullptr) != 0) {
+      return false;
+    }
+    size_t sent = written;
+#else
+    struct iovec iov[max_batch];
+    for (size_t i = 0; i < batch; i++) {
+      iov[i].iov_base = const_cast<char*>(slices[i].data);
+      iov[i].iov_len = slices[i].size;
+    }
+    struct msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = batch;
+    int flags = MSG_NOSIGNAL;
+#ifdef MSG_MORE
+    if (more) flags |= MSG_MORE;
+#else
+    (void) more;
+#endif
+    auto written = sendmsg(s, &msg, flags);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    size_t sent = (size_t) written;
+#endif
+    socket_bytes_sent() += sent;
+    while (count > 0 && sent >= slices->size) {
+      sent -= slices->size;
+      slices++;
+      count--;
+    }
+    if (count > 0) {
+      slices->data += sent;
+      slices->size -= sent;
+    }
+  }
+  return true;
+}
+
+inline bool send_all(int s, const char* data, size_t len, bool more = false) {
+  io_slice slice{data, len};
+  return send_slices(s, &slice, 1, more);
+}
+
+// Sends as much of data as fits in the socket buffer. Returns the bytes
+// sent, or -1 on an error.
+inline long long send_nonblocking(int s, const char* data, size_t len) {
+#ifdef _WIN32
+  u_long on = 1, off = 0;
+  ioctlsocket((SOCKET) s, FIONBIO, &on);
+  auto n = send((SOCKET) s, data, (int) len, 0);
+  auto err = WSAGetLastError();
+  ioctlsocket((SOCKET) s, FIONBIO, &off);
+  if (n == SOCKET_ERROR) {
+    return err == WSAEWOULDBLOCK ? 0 : -1;
+  }
+  socket_bytes_sent() += (size_t) n;
+  return n;
+#else
+  while (true) {
+    auto n = send(s, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n >= 0) {
+      socket_bytes_sent() += (size_t) n;
+      return n;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+  }
+#endif
+}
+
+// Sends the rest of a response the reactor started, on a worker. Closes
+// the connection unless it stays open.
+inline bool send_pending_output(connection_state& conn) {
+  auto ok = send_all(conn.fd, conn.pending_output.data(), conn.pending_output.size());
+  conn.pending_output.clear();
+  if (!ok || !conn.pending_keep_alive) {
+    closesocket(conn.fd);
+    return false;
+  }
+  return true;
+}
+
+// Reads up to len bytes at offset without moving the file position, so one
+// descriptor can be shared by concurrent responses.
+inline long long read_file_at(int fd, char* buf, size_t len, std::uint64_t offset) {
+#ifdef _WIN32
+  HANDLE h = (HANDLE) _get_osfhandle(fd);
+  OVERLAPPED ov{};
+  ov.Offset = (DWORD) (offset & 0xffffffff);
+  ov.OffsetHigh = (DWORD) (offset >> 32);
+  DWORD n = 0;
+  if (!ReadFile(h, buf, (DWORD) len, &n, &ov)) {
+    return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+  }
+  return (long long) n;
+#else
+  ssize_t n;
+  do {
+    n = pread(fd, buf, len, (off_t) offset);
+  } while (n < 0 && errno == EINTR);
+  return (long long) n;
+#endif
+}
+
+// Sends len bytes of fd starting at offset; sendfile(2) where available,
+// a read/send loop otherwise.
+inline bool send_file_range(int s, int fd, std::uint64_t offset, size_t len) {
+#ifdef __linux__
+  auto off = (off_t) offset;
+  while (len > 0 && socket_capture() == nullptr) {
+    auto n = sendfile(s, fd, &off, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      // Descriptors sendfile cannot handle take the copying path below.
+      if ((errno == EINVAL || errno == ENOSYS) && off == (off_t) offset) break;
+      return false;
     }
+    if (n == 0) {
+      return false;
+    }
+    socket_bytes_sent() += (size_t) n;
+    len -= (size_t) n;
+  }
+  if (len == 0) {
+    return true;
+  }
+#endif
+  char buf[body_scratch_buffer_size];
+  while (len > 0) {
+    auto n = read_file_at(fd, buf, std::min(len, sizeof(buf)), offset);
+    if (n <= 0 || !send_all(s, buf, (size_t) n)) {
+      return false;
+    }
+    offset += (std::uint64_t) n;
+    len -= (size_t) n;
   }
+  return true;
 }
 
 inline void send_text_response(
     int s,
     int code,
-    const std::string& reason,
-    const std::string& body,
+    std::string_view reason,
+    std::string_view body,
     bool keep_alive,
     bool head_only = false) {
-  std::ostringstream os;
-  os << "HTTP/1.1 " << code << " " << reason
-     << "\r\nContent-Type: text/plain\r\nConnection: "
-     << (keep_alive ? "Keep-Alive" : "Close")
-     << "\r\nContent-Length: " << body.size()
-     << "\r\n\r\n";
+  std::string out;
+  out.reserve(192 + (head_only ? 0 : body.size()));
+  out += "HTTP/1.1 ";
+  append_number(out, code);
+  out += " ";
+  out += reason;
+  out += "\r\nContent-Type: text/plain\r\nConnection: ";
+  out += keep_alive ? "Keep-Alive" : "Close";
+  out += "\r\nContent-Length: ";
+  append_number(out, body.size());
+  out += "\r\n";
+  out += http_date::header();
+  out += "\r\n";
   if (!head_only) {
-    os << body;
+    out += body;
   }
-  send(s, os.str().data(), (int) os.str().size(), MSG_NOSIGNAL);
+  send_all(s, out.data(), out.size());
 }
 
 typedef enum class _log_level {ERR, WARN, INFO, DEBUG} log_level;
@@ -562,8 +1192,7 @@ inline std::ostringstream& logger::get(log_level level) {
   lv = level;
   enabled = (lv >= logger::level());
   if (enabled) {
-    auto t = std::time(nullptr);
-    auto tm = *std::localtime(&t);
+    auto tm = to_localtime(std::time(nullptr));
     os << std::put_time(&tm, "%Y/%m/%d %H:%M:%S ");
     switch (level) {
       case log_level::ERR: os << "ERR: "; break;
@@ -587,75 +1216,400 @@ inline logger::~logger() {
   if (lvl < clask::logger::level()) ; \
   else clask::logger().get(lvl)
 
-template <typename TP>
-std::time_t to_time_t(TP tp) {
-  using namespace std::chrono;
-  auto sctp = time_point_cast<system_clock::duration>(tp - TP::clock::now() + system_clock::now());
-  return system_clock::to_time_t(sctp);
-}
+// What a thread does when its access log ring is full.
+enum class log_overflow {
+  // Discard the record; the number discarded is logged later.
+  drop,
+  // Wait for the flusher to make room. The reactor thread never waits and
+  // drops instead.
+  block,
+};
 
-inline std::wstring to_wstring(const std::string& input) {
-  std::wstring result;
-  result.reserve(input.length());
-  size_t i = 0;
-  while (i < input.length()) {
-    unsigned char c = input[i];
-    if (c < 0x80) {
-      result.push_back(c);
-      i++;
-    } else if ((c & 0xE0) == 0xC0 && i + 1 < input.length()) {
-      wchar_t wc = ((c & 0x1F) << 6) | (input[i + 1] & 0x3F);
-      result.push_back(wc);
-      i += 2;
-    } else if ((c & 0xF0) == 0xE0 && i + 2 < input.length()) {
-      wchar_t wc = ((c & 0x0F) << 12) | ((input[i + 1] & 0x3F) << 6) | (input[i + 2] & 0x3F);
-      result.push_back(wc);
-      i += 3;
-    } else if ((c & 0xF8) == 0xF0 && i + 3 < input.length()) {
-      char32_t cp = ((c & 0x07) << 18)
-          | ((input[i + 1] & 0x3F) << 12)
-          | ((input[i + 2] & 0x3F) << 6)
-          | (input[i + 3] & 0x3F);
-      if constexpr (sizeof(wchar_t) >= 4) {
-        result.push_back((wchar_t) cp);
-      } else {
-        cp -= 0x10000;
-        result.push_back((wchar_t) (0xD800 + (cp >> 10)));
-        result.push_back((wchar_t) (0xDC00 + (cp & 0x3FF)));
-      }
-      i += 4;
-    } else {
-      result.push_back(c);
-      i++;
+// One access log line, stored in binary until the flusher formats it.
+// Fixed size, so logging a request copies into the ring without
+// allocating; longer values are truncated.
+struct access_record {
+  std::time_t time;
+  log_level level;
+  int code;
+  std::uint32_t latency_us;
+  std::uint64_t bytes;
+  std::uint8_t remote_len;
+  std::uint8_t method_len;
+  std::uint16_t uri_len;
+  char remote[46];
+  char method[16];
+  char uri[200];
+};
+
+// A single-producer, single-consumer ring of access records. The owning
+// thread fills it; the flusher drains it.
+class access_ring {
+private:
+  std::unique_ptr<access_record[]> records_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+public:
+  std::atomic<bool> in_use{true};
+  access_ring* next = nullptr;
+  // capacity is rounded up to a power of two.
+  explicit access_ring(size_t capacity) {
+    size_t n = 1;
+    while (n < capacity) {
+      n <<= 1;
     }
+    records_.reset(new access_record[n]);
+    mask_ = n - 1;
   }
-  return result;
-}
-
-inline std::string camelize(std::string& s) {
-  auto n = s.length();
-  for (size_t i = 0; i < n; i++) {
-    auto uc = static_cast<unsigned char>(s[i]);
-    if (i == 0 || s[i - 1] == ' ' || s[i - 1] == '-') {
-      s[i] = (char) std::toupper(uc);
-    } else {
-      s[i] = (char) std::tolower(uc);
+  // The slot for the next record, or nullptr when the ring is full.
+  access_record* reserve() {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) {
+      return nullptr;
     }
+    return &records_[tail & mask_];
   }
-  return s.substr(0, n);
-}
-
-inline void trim_string(std::string& s, const std::string& cutsel = " \t\v\r\n") {
-  auto left = s.find_first_not_of(cutsel);
-  if (left == std::string::npos) {
-    s.clear();
-    return;
+  void commit() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
   }
-  auto right = s.find_last_not_of(cutsel);
-  s = s.substr(left, right - left + 1);
-}
-
-inline std::vector<std::string> split_string(const std::string& s, char delim, size_t max_elems = -1) {
+  template <typename F>
+  size_t drain(F&& f) {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto tail = tail_.load(std::memory_order_acquire);
+    for (auto n = head; n != tail; n++) {
+      f(records_[n & mask_]);
+    }
+    head_.store(tail, std::memory_order_release);
+    return tail - head;
+  }
+};
+
+// The access log. Each thread appends binary records to its own ring
+// without locks; a background thread formats them in batches and writes
+// each batch with one call, reformatting the timestamp prefix only when
+// the second changes. The flusher sleeps on a condition variable and is
+// woken once per batch by the first record written after it drained.
+class access_log {
+private:
+  // Rings are reused by later threads and never freed.
+  std::atomic<access_ring*> rings_{nullptr};
+  std::atomic<size_t> ring_size_{default_access_log_ring_size};
+  std::atomic<log_overflow> overflow_{log_overflow::drop};
+  std::atomic<std::uint64_t> dropped_{0};
+  // Serializes start() and stop().
+  std::mutex state_mu_;
+  std::atomic<bool> started_{false};
+  std::thread flusher_;
+  std::once_flag exit_hook_;
+  // wake_cv_ wakes the flusher; space_cv_ wakes writers blocked on a full
+  // ring. Both wait on wake_mu_, which also guards stopping_.
+  std::mutex wake_mu_;
+  std::condition_variable wake_cv_;
+  std::condition_variable space_cv_;
+  bool stopping_ = false;
+  std::atomic<bool> signaled_{false};
+  std::atomic<size_t> waiters_{0};
+  // Held while draining, so there is one consumer at a time.
+  std::mutex flush_mu_;
+  std::function<void(std::string_view)> sink_;
+  std::string batch_;
+  std::time_t prefix_time_ = -1;
+  char prefix_[24];
+  size_t prefix_len_ = 0;
+  access_ring* acquire_ring() {
+    for (auto p = rings_.load(); p != nullptr; p = p->next) {
+      bool expected = false;
+      if (p->in_use.compare_exchange_strong(expected, true)) {
+        return p;
+      }
+    }
+    auto p = new access_ring(ring_size_.load(std::memory_order_relaxed));
+    p->next = rings_.load();
+    while (!rings_.compare_exchange_weak(p->next, p)) {
+    }
+    return p;
+  }
+  access_ring& local() {
+    struct holder {
+      access_ring* p;
+      ~holder() {
+        p->in_use.store(false);
+      }
+    };
+    thread_local holder h{instance().acquire_ring()};
+    return *h.p;
+  }
+  void append_prefix(std::time_t t, log_level level) {
+    if (t != prefix_time_) {
+      auto tm = to_localtime(t);
+      prefix_len_ = std::strftime(prefix_, sizeof(prefix_), "%Y/%m/%d %H:%M:%S ", &tm);
+      prefix_time_ = t;
+    }
+    batch_.append(prefix_, prefix_len_);
+    switch (level) {
+      case log_level::ERR: batch_ += "ERR: "; break;
+      case log_level::WARN: batch_ += "WARN: "; break;
+      case log_level::INFO: batch_ += "INFO: "; break;
+      case log_level::DEBUG: batch_ += "DEBUG: "; break;
+      default: break;
+    }
+  }
+  void format(const access_record& r) {
+    append_prefix(r.time, r.level);
+    batch_.append(r.remote, r.remote_len);
+    batch_ += ' ';
+    append_number(batch_, (size_t) r.code);
+    batch_ += ' ';
+    batch_.append(r.method, r.method_len);
+    batch_ += ' ';
+    batch_.append(r.uri, r.uri_len);
+    batch_ += ' ';
+    append_number(batch_, (size_t) r.bytes);
+    batch_ += ' ';
+    append_number(batch_, (size_t) r.latency_us);
+    batch_ += "us\n";
+  }
+  static size_t copy_field(char* dst, size_t cap, std::string_view src) {
+    auto n = std::min(cap, src.size());
+    std::memcpy(dst, src.data(), n);
+    return n;
+  }
+  void start() {
+    if (started_.load(std::memory_order_acquire)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lk(state_mu_);
+    if (started_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    flusher_ = std::thread([this] { run_flusher(); });
+    started_.store(true, std::memory_order_release);
+    std::call_once(exit_hook_, [] {
+      std::atexit([] { instance().stop(); });
+    });
+  }
+  // Called after a record is committed. The fence orders the commit before
+  // the flag check, pairing with the one in run_flusher(), so a record is
+  // either drained by the current pass or wakes the next one.
+  void wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (signaled_.load(std::memory_order_relaxed) || signaled_.exchange(true)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lk(wake_mu_);
+    wake_cv_.notify_one();
+  }
+  void run_flusher() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lk(wake_mu_);
+        wake_cv_.wait(lk, [this] { return stopping_ || signaled_.load(std::memory_order_relaxed); });
+        if (stopping_) {
+          return;
+        }
+      }
+      signaled_.store(false, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      flush();
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (waiters_.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lk(wake_mu_);
+        space_cv_.notify_all();
+      }
+    }
+  }
+public:
+  // Never destroyed, so threads still logging during exit find it; an
+  // exit hook stops the flusher and writes the last records.
+  static access_log& instance() {
+    static access_log* log = new access_log;
+    return *log;
+  }
+  ~access_log() {
+    stop();
+  }
+  // Marks the calling thread as one that must never wait on the log, so
+  // its records are dropped on a full ring under log_overflow::block too.
+  // Set on the reactor thread.
+  static bool& never_wait() {
+    thread_local bool v = false;
+    return v;
+  }
+  // Stops and joins the flusher, then writes whatever is still pending.
+  // Writers blocked on a full ring drop their record. A later write
+  // starts a new flusher.
+  void stop() {
+    std::lock_guard<std::mutex> lk(state_mu_);
+    if (flusher_.joinable()) {
+      {
+        std::lock_guard<std::mutex> wk(wake_mu_);
+        stopping_ = true;
+      }
+      wake_cv_.notify_all();
+      space_cv_.notify_all();
+      flusher_.join();
+    }
+    flush();
+    {
+      std::lock_guard<std::mutex> wk(wake_mu_);
+      stopping_ = false;
+    }
+    started_.store(false, std::memory_order_release);
+  }
+  // ring_size applies to threads that log for the first time afterwards.
+  void configure(size_t ring_size, log_overflow overflow) {
+    ring_size_.store(ring_size > 0 ? ring_size : default_access_log_ring_size);
+    overflow_.store(overflow);
+  }
+  // Where formatted batches go; stderr by default.
+  void sink(std::function<void(std::string_view)> fn) {
+    std::lock_guard<std::mutex> lk(flush_mu_);
+    sink_ = std::move(fn);
+  }
+  void write(
+      log_level level,
+      std::string_view remote,
+      int code,
+      std::string_view method,
+      std::string_view uri,
+      std::uint32_t latency_us,
+      std::uint64_t bytes) {
+    if (level < logger::level()) {
+      return;
+    }
+    start();
+    auto& ring = local();
+    auto r = ring.reserve();
+    if (r == nullptr) {
+      if (overflow_.load(std::memory_order_relaxed) == log_overflow::drop || never_wait()) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      waiters_.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      wake();
+      {
+        std::unique_lock<std::mutex> lk(wake_mu_);
+        space_cv_.wait(lk, [&] {
+          r = ring.reserve();
+          return r != nullptr || stopping_;
+        });
+      }
+      waiters_.fetch_sub(1);
+      if (r == nullptr) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+    r->time = http_date::now();
+    r->level = level;
+    r->code = code;
+    r->latency_us = latency_us;
+    r->bytes = bytes;
+    r->remote_len = (std::uint8_t) copy_field(r->remote, sizeof(r->remote), remote);
+    r->method_len = (std::uint8_t) copy_field(r->method, sizeof(r->method), method);
+    r->uri_len = (std::uint16_t) copy_field(r->uri, sizeof(r->uri), uri);
+    ring.commit();
+    wake();
+  }
+  // Formats and writes every pending record; returns how many there were.
+  size_t flush() {
+    std::lock_guard<std::mutex> lk(flush_mu_);
+    batch_.clear();
+    size_t count = 0;
+    for (auto p = rings_.load(); p != nullptr; p = p->next) {
+      count += p->drain([this](const access_record& r) { format(r); });
+    }
+    auto dropped = dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      append_prefix(http_date::now(), log_level::WARN);
+      append_number(batch_, (size_t) dropped);
+      batch_ += " access log records dropped\n";
+    }
+    if (!batch_.empty()) {
+      if (sink_) {
+        sink_(batch_);
+      } else {
+        std::fwrite(batch_.data(), 1, batch_.size(), stderr);
+      }
+    }
+    return count;
+  }
+  std::uint64_t dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+};
+
+template <typename TP>
+std::time_t to_time_t(TP tp) {
+  using namespace std::chrono;
+  auto sctp = time_point_cast<system_clock::duration>(tp - TP::clock::now() + system_clock::now());
+  return system_clock::to_time_t(sctp);
+}
+
+inline std::wstring to_wstring(const std::string& input) {
+  std::wstring result;
+  result.reserve(input.length());
+  size_t i = 0;
+  while (i < input.length()) {
+    unsigned char c = input[i];
+    if (c < 0x80) {
+      result.push_back(c);
+      i++;
+    } else if ((c & 0xE0) == 0xC0 && i + 1 < input.length()) {
+      wchar_t wc = ((c & 0x1F) << 6) | (input[i + 1] & 0x3F);
+      result.push_back(wc);
+      i += 2;
+    } else if ((c & 0xF0) == 0xE0 && i + 2 < input.length()) {
+      wchar_t wc = ((c & 0x0F) << 12) | ((input[i + 1] & 0x3F) << 6) | (input[i + 2] & 0x3F);
+      result.push_back(wc);
+      i += 3;
+    } else if ((c & 0xF8) == 0xF0 && i + 3 < input.length()) {
+      char32_t cp = ((c & 0x07) << 18)
+          | ((input[i + 1] & 0x3F) << 12)
+          | ((input[i + 2] & 0x3F) << 6)
+          | (input[i + 3] & 0x3F);
+      if constexpr (sizeof(wchar_t) >= 4) {
+        result.push_back((wchar_t) cp);
+      } else {
+        cp -= 0x10000;
+        result.push_back((wchar_t) (0xD800 + (cp >> 10)));
+        result.push_back((wchar_t) (0xDC00 + (cp & 0x3FF)));
+      }
+      i += 4;
+    } else {
+      result.push_back(c);
+      i++;
+    }
+  }
+  return result;
+}
+
+inline std::string camelize(std::string& s) {
+  auto n = s.length();
+  for (size_t i = 0; i < n; i++) {
+    auto uc = static_cast<unsigned char>(s[i]);
+    if (i == 0 || s[i - 1] == ' ' || s[i - 1] == '-') {
+      s[i] = (char) std::toupper(uc);
+    } else {
+      s[i] = (char) std::tolower(uc);
+    }
+  }
+  return s.substr(0, n);
+}
+
+inline void trim_string(std::string& s, const std::string& cutsel = " \t\v\r\n") {
+  auto left = s.find_first_not_of(cutsel);
+  if (left == std::string::npos) {
+    s.clear();
+    return;
+  }
+  auto right = s.find_last_not_of(cutsel);
+  s = s.substr(left, right - left + 1);
+}
+
+inline std::vector<std::string> split_string(const std::string& s, char delim, size_t max_elems = -1) {
   std::vector<std::string> elems;
   std::stringstream ss(s);
   std::string item;
@@ -704,20 +1658,22 @@ inline std::string url_encode(const std::string &value, bool escape_slash = true
   return os.str();
 }
 
-inline std::string url_decode(const std::string &s) {
+inline std::string url_decode(std::string_view s) {
   std::string ret;
-  const char* p = s.c_str();
-  while (*p) {
-    auto hi_char = static_cast<unsigned char>(p[1]);
-    auto lo_char = static_cast<unsigned char>(p[2]);
-    if (*p == '%' && p[1] && p[2] && std::isxdigit(hi_char) && std::isxdigit(lo_char)) {
-      const int hi = p[1] - (p[1] <= '9' ? '0' : (p[1] <= 'F' ? 'A' : 'a') - 10);
-      const int lo = p[2] - (p[2] <= '9' ? '0' : (p[2] <= 'F' ? 'A' : 'a') - 10);
+  ret.reserve(s.size());
+  size_t i = 0;
+  while (i < s.size()) {
+    if (s[i] == '%' && i + 2 < s.size()
+        && std::isxdigit(static_cast<unsigned char>(s[i + 1]))
+        && std::isxdigit(static_cast<unsigned char>(s[i + 2]))) {
+      const char h = s[i + 1], l = s[i + 2];
+      const int hi = h - (h <= '9' ? '0' : (h <= 'F' ? 'A' : 'a') - 10);
+      const int lo = l - (l <= '9' ? '0' : (l <= 'F' ? 'A' : 'a') - 10);
       ret += static_cast<char>(16 * hi + lo);
-      p += 3;
+      i += 3;
       continue;
     }
-    ret += *p++;
+    ret += s[i++];
   }
   return ret;
 }
@@ -732,17 +1688,16 @@ typedef struct _part {
   std::string name();
 } part;
 
-inline std::string part::name() {
-  auto cd = header_value("content-disposition");
+inline std::string header_param(std::string_view cd, std::string_view key) {
   while (!cd.empty()) {
     auto pos = cd.find(';');
-    if (pos == std::string::npos) {
+    if (pos == std::string_view::npos) {
       pos = cd.size();
     }
-    auto sub = cd.substr(0, pos);
+    std::string sub(cd.substr(0, pos));
     trim_string(sub, " \t");
-    if (sub.size() >= 5 && sub.substr(0, 5) == "name=") {
-      sub = sub.substr(5);
+    if (sub.size() > key.size() && sub.compare(0, key.size(), key) == 0 && sub[key.size()] == '=') {
+      sub = sub.substr(key.size() + 1);
       trim_string(sub, "\"");
       return sub;
     }
@@ -754,14 +1709,13 @@ inline std::string part::name() {
   return "";
 }
 
-inline std::string part::filename() {
-  auto cd = header_value("content-disposition");
+inline std::string content_disposition_filename(std::string_view cd) {
   while (!cd.empty()) {
     auto pos = cd.find(';');
-    if (pos == std::string::npos) {
+    if (pos == std::string_view::npos) {
       pos = cd.size();
     }
-    auto sub = cd.substr(0, pos);
+    std::string sub(cd.substr(0, pos));
     trim_string(sub, " \t");
     if (sub.size() >= 9 && sub.substr(0, 9) == "filename=") {
       sub = sub.substr(9);
@@ -786,6 +1740,14 @@ inline std::string part::filename() {
   return "";
 }
 
+inline std::string part::name() {
+  return header_param(header_value("content-disposition"), "name");
+}
+
+inline std::string part::filename() {
+  return content_disposition_filename(header_value("content-disposition"));
+}
+
 inline std::string part::header_value(const std::string& name) {
   std::string key = name;
   camelize(key);
@@ -795,6 +1757,369 @@ inline std::string part::header_value(const std::string& name) {
   return "";
 }
 
+typedef std::pair<std::string_view, std::string_view> header_view;
+
+inline bool header_name_equals(std::string_view x, std::string_view y) {
+  if (x.size() != y.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < x.size(); i++) {
+    if (std::tolower(static_cast<unsigned char>(x[i])) != std::tolower(static_cast<unsigned char>(y[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Quality, in thousandths, that an Accept-Encoding header gives coding;
+// -1 when the header neither lists it nor has a "*".
+inline int accept_encoding_quality(std::string_view accept, std::string_view coding) {
+  int wildcard = -1;
+  while (!accept.empty()) {
+    auto comma = accept.find(',');
+    auto item = accept.substr(0, comma);
+    accept = comma == std::string_view::npos ? std::string_view() : accept.substr(comma + 1);
+    auto semi = item.find(';');
+    auto name = item.substr(0, semi);
+    while (!name.empty() && (name.front() == ' ' || name.front() == '\t')) name.remove_prefix(1);
+    while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) name.remove_suffix(1);
+    int q = 1000;
+    if (semi != std::string_view::npos) {
+      auto param = item.substr(semi + 1);
+      auto eq = param.find("q=");
+      if (eq != std::string_view::npos) {
+        auto v = param.substr(eq + 2);
+        q = (v.empty() || v[0] != '1') ? 0 : 1000;
+        auto dot = v.find('.');
+        if (q == 0 && dot != std::string_view::npos) {
+          int scale = 100;
+          for (size_t i = dot + 1; i < v.size() && i <= dot + 3 && v[i] >= '0' && v[i] <= '9'; i++, scale /= 10) {
+            q += (v[i] - '0') * scale;
+          }
+        }
+      }
+    }
+    if (header_name_equals(name, coding)) {
+      return q;
+    }
+    if (name == "*") {
+      wildcard = q;
+    }
+  }
+  return wildcard;
+}
+
+// Headers of a multipart part as views into the parser's header buffer.
+// They are only valid until the sink's begin() returns.
+struct part_header_views {
+  std::vector<header_view> headers;
+
+  std::string_view header_value(std::string_view name) const {
+    for (const auto& h : headers) {
+      if (header_name_equals(h.first, name)) return h.second;
+    }
+    return {};
+  }
+  std::string name() const {
+    return header_param(header_value("content-disposition"), "name");
+  }
+  std::string filename() const {
+    return content_disposition_filename(header_value("content-disposition"));
+  }
+};
+
+// Receives the parts found by multipart_parser. Returning false from any
+// callback aborts parsing.
+class part_sink {
+public:
+  virtual ~part_sink() = default;
+  virtual bool begin(const part_header_views& headers) = 0;
+  virtual bool write(const char* data, size_t len) = 0;
+  virtual bool end() = 0;
+};
+
+// Collects every part into memory, as request::parse_multipart always did.
+class parts_sink : public part_sink {
+private:
+  std::vector<part>& parts;
+public:
+  parts_sink(std::vector<part>& parts) : parts(parts) { }
+  bool begin(const part_header_views& hv) override {
+    part p;
+    p.headers.reserve(hv.headers.size());
+    for (const auto& h : hv.headers) {
+      p.headers.emplace_back(std::string(h.first), std::string(h.second));
+    }
+    parts.emplace_back(std::move(p));
+    return true;
+  }
+  bool write(const char* data, size_t len) override {
+    parts.back().body.append(data, len);
+    return true;
+  }
+  bool end() override {
+    return true;
+  }
+};
+
+// Streams each part body to a file descriptor chosen by the callback.
+// The callback returns -1 to skip a part; descriptors it returns are
+// closed by the sink when the part ends.
+class fd_part_sink : public part_sink {
+private:
+  std::function<int(const part_header_views&)> open_fn;
+  int fd = -1;
+public:
+  fd_part_sink(std::function<int(const part_header_views&)> open_fn) : open_fn(std::move(open_fn)) { }
+  ~fd_part_sink() override {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+  bool begin(const part_header_views& hv) override {
+    fd = open_fn(hv);
+    return true;
+  }
+  bool write(const char* data, size_t len) override {
+    while (fd >= 0 && len > 0) {
+      auto n = ::write(fd, data, (unsigned int) len);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      data += n;
+      len -= (size_t) n;
+    }
+    return true;
+  }
+  bool end() override {
+    auto ok = true;
+    if (fd >= 0) {
+      ok = ::close(fd) == 0;
+      fd = -1;
+    }
+    return ok;
+  }
+};
+
+// Boyer-Moore-Horspool search for a fixed pattern.
+class horspool_searcher {
+private:
+  std::string pattern;
+  size_t skip[256];
+public:
+  horspool_searcher(std::string p) : pattern(std::move(p)) {
+    for (auto& v : skip) v = pattern.size();
+    for (size_t i = 0; i + 1 < pattern.size(); i++) {
+      skip[static_cast<unsigned char>(pattern[i])] = pattern.size() - 1 - i;
+    }
+  }
+  const std::string& needle() const { return pattern; }
+  size_t find(const char* data, size_t len) const {
+    const auto m = pattern.size();
+    if (m == 0 || len < m) {
+      return std::string::npos;
+    }
+    const auto last = m - 1;
+    const auto tail = pattern[last];
+    size_t i = 0;
+    while (i <= len - m) {
+      auto c = data[i + last];
+      if (c == tail && std::memcmp(data + i, pattern.data(), last) == 0) {
+        return i;
+      }
+      i += skip[static_cast<unsigned char>(c)];
+    }
+    return std::string::npos;
+  }
+};
+
+// Incremental multipart/form-data parser. Input may be fed in chunks of
+// any size; part bodies are handed to the sink straight from the input
+// except for the few bytes held back at a chunk edge that could be the
+// start of the next delimiter.
+class multipart_parser {
+private:
+  enum class state { preamble, delimiter_end, headers, body, done, error };
+  horspool_searcher delimiter;
+  part_sink& sink;
+  state st = state::preamble;
+  std::string tail;
+  std::string header_buf;
+  part_header_views views;
+  size_t max_header_size;
+
+  bool emit(const char* data, size_t len) {
+    if (st != state::body || len == 0) {
+      return true;
+    }
+    return sink.write(data, len);
+  }
+  size_t scan(const char* data, size_t len);
+  size_t read_delimiter_end(const char* data, size_t len);
+  size_t read_headers(const char* data, size_t len);
+  void fail() {
+    st = state::error;
+  }
+  void close_delimiter() {
+    if (st == state::body && !sink.end()) {
+      fail();
+      return;
+    }
+    st = state::delimiter_end;
+  }
+
+public:
+  multipart_parser(const std::string& boundary, part_sink& sink, size_t max_header_size = 16384)
+    : delimiter("\r\n--" + boundary), sink(sink), max_header_size(max_header_size) {
+    // The first delimiter may start the body without a preceding CRLF.
+    tail = "\r\n";
+  }
+  multipart_parser(const multipart_parser&) = delete;
+  multipart_parser& operator =(const multipart_parser&) = delete;
+  bool feed(const char* data, size_t len);
+  bool finish() const { return st == state::done; }
+  bool failed() const { return st == state::error; }
+};
+
+inline size_t multipart_parser::scan(const char* data, size_t len) {
+  const auto& needle = delimiter.needle();
+  const auto keep = needle.size() - 1;
+  if (!tail.empty()) {
+    auto take = std::min(len, keep);
+    auto junction = tail;
+    junction.append(data, take);
+    auto pos = delimiter.find(junction.data(), junction.size());
+    if (pos != std::string::npos) {
+      if (!emit(junction.data(), pos)) {
+        fail();
+        return len;
+      }
+      auto consumed = pos + needle.size() - tail.size();
+      tail.clear();
+      close_delimiter();
+      return consumed;
+    }
+    if (take == len) {
+      auto flushed = junction.size() > keep ? junction.size() - keep : 0;
+      if (!emit(junction.data(), flushed)) {
+        fail();
+        return len;
+      }
+      tail = junction.substr(flushed);
+      return len;
+    }
+    if (!emit(tail.data(), tail.size())) {
+      fail();
+      return len;
+    }
+    tail.clear();
+  }
+  auto pos = delimiter.find(data, len);
+  if (pos != std::string::npos) {
+    if (!emit(data, pos)) {
+      fail();
+      return len;
+    }
+    close_delimiter();
+    return pos + needle.size();
+  }
+  auto held = std::min(len, keep);
+  if (!emit(data, len - held)) {
+    fail();
+    return len;
+  }
+  tail.assign(data + len - held, held);
+  return len;
+}
+
+inline size_t multipart_parser::read_delimiter_end(const char* data, size_t len) {
+  auto take = std::min(len, 2 - tail.size());
+  tail.append(data, take);
+  if (tail.size() < 2) {
+    return take;
+  }
+  if (tail == "--") {
+    st = state::done;
+  } else if (tail == "\r\n") {
+    st = state::headers;
+    // Seeding the buffer with CRLF lets a part without headers be
+    // detected by the same CRLFCRLF search.
+    header_buf = "\r\n";
+  } else {
+    st = state::error;
+  }
+  tail.clear();
+  return take;
+}
+
+inline size_t multipart_parser::read_headers(const char* data, size_t len) {
+  auto old = header_buf.size();
+  auto take = std::min(len, max_header_size + 4 - old);
+  header_buf.append(data, take);
+  auto eoh = header_buf.find("\r\n\r\n", old > 3 ? old - 3 : 0);
+  if (eoh == std::string::npos) {
+    if (header_buf.size() >= max_header_size + 4) {
+      fail();
+      return len;
+    }
+    return take;
+  }
+  header_buf.resize(eoh + 4);
+
+  views.headers.clear();
+  if (eoh > 0) {
+    struct phr_header hdrs[100];
+    size_t num_headers = sizeof(hdrs) / sizeof(hdrs[0]);
+    auto pret = phr_parse_headers(
+        header_buf.data() + 2, header_buf.size() - 2, hdrs, &num_headers, 0);
+    if (pret <= 0) {
+      fail();
+      return len;
+    }
+    for (size_t n = 0; n < num_headers; n++) {
+      if (hdrs[n].name == nullptr) {
+        continue;
+      }
+      views.headers.emplace_back(
+          std::string_view(hdrs[n].name, hdrs[n].name_len),
+          std::string_view(hdrs[n].value, hdrs[n].value_len));
+    }
+  }
+  if (!sink.begin(views)) {
+    fail();
+    return len;
+  }
+  st = state::body;
+  return eoh + 4 - old;
+}
+
+inline bool multipart_parser::feed(const char* data, size_t len) {
+  while (len > 0) {
+    size_t consumed = 0;
+    switch (st) {
+      case state::preamble:
+      case state::body:
+        consumed = scan(data, len);
+        break;
+      case state::delimiter_end:
+        consumed = read_delimiter_end(data, len);
+        break;
+      case state::headers:
+        consumed = read_headers(data, len);
+        break;
+      case state::done:
+        // Anything after the close delimiter is epilogue.
+        return true;
+      case state::error:
+        return false;
+    }
+    data += consumed;
+    len -= consumed;
+  }
+  return st != state::error;
+}
+
 inline static_path_resolution resolve_static_path(
     const std::string& request_uri,
     const std::string& mount_path,
@@ -832,73 +2157,43 @@ inline static_path_resolution resolve_static_path(
   };
 }
 
-static std::unordered_map<int, std::string> status_codes = {
-  { 100, "Continue" },
-  { 101, "Switching Protocols" },
-  { 102, "Processing" },
-  { 200, "OK" },
-  { 201, "Created" },
-  { 202, "Accepted" },
-  { 203, "Non-Authoritative Information" },
-  { 204, "No Content" },
-  { 205, "Reset Content" },
-  { 206, "Partial Content" },
-  { 207, "Multi-Status" },
-  { 208, "Already Reported" },
-  { 300, "Multiple Choices" },
-  { 301, "Moved Permanently" },
-  { 302, "Found" },
-  { 303, "See Other" },
-  { 304, "Not Modified" },
-  { 305, "Use Proxy" },
-  { 307, "Temporary Redirect" },
-  { 400, "Bad Request" },
-  { 401, "Unauthorized" },
-  { 402, "Payment Required" },
-  { 403, "Forbidden" },
-  { 404, "Not Found" },
-  { 405, "Method Not Allowed" },
-  { 406, "Not Acceptable" },
-  { 407, "Proxy Authentication Required" },
-  { 408, "Request Timeout" },
-  { 409, "Conflict" },
-  { 410, "Gone" },
-  { 411, "Length Required" },
-  { 412, "Precondition Failed" },
-  { 413, "Request Entity Too Large" },
-  { 414, "Request-URI Too Large" },
-  { 415, "Unsupported Media Type" },
-  { 416, "Request Range Not Satisfiable" },
-  { 417, "Expectation Failed" },
-  { 418, "I'm a teapot" },
-  { 422, "Unprocessable Entity" },
-  { 423, "Locked" },
-  { 424, "Failed Dependency" },
-  { 425, "No code" },
-  { 426, "Upgrade Required" },
-  { 428, "Precondition Required" },
-  { 429, "Too Many Requests" },
-  { 431, "Request Header Fields Too Large" },
-  { 449, "Retry with" },
-  { 500, "Internal Server Error" },
-  { 501, "Not Implemented" },
-  { 502, "Bad Gateway" },
-  { 503, "Service Unavailable" },
-  { 504, "Gateway Timeout" },
-  { 505, "HTTP Version Not Supported" },
-  { 506, "Variant Also Negotiates" },
-  { 507, "Insufficient Storage" },
-  { 509, "Bandwidth Limit Exceeded" },
-  { 510, "Not Extended" },
-  { 511, "Network Authentication Required" },
-};
-
 inline void send_status_text_response(
     int s,
     int code,
     bool keep_alive,
     bool head_only = false) {
-  send_text_response(s, code, status_codes[code], status_codes[code], keep_alive, head_only);
+  send_text_response(s, code, status_reason(code), status_reason(code), keep_alive, head_only);
+}
+
+// Answers a request for a path that has routes, but none for the request's
+// method: 204 to OPTIONS and 405 otherwise, listing the methods in Allow.
+inline int send_allow_response(
+    int s,
+    const std::string& method,
+    route_method_set allowed,
+    bool keep_alive) {
+  const auto code = method == "OPTIONS" ? 204 : 405;
+  std::string out;
+  out.reserve(192);
+  append_status_line(out, code);
+  append_header(out, "Allow", allow_header_value(allowed));
+  append_header(out, "Connection", keep_alive ? "Keep-Alive" : "Close");
+  if (code == 405) {
+    auto body = status_reason(code);
+    out += "Content-Type: text/plain\r\nContent-Length: ";
+    append_number(out, body.size());
+    out += "\r\n";
+    out += http_date::header();
+    out += "\r\n";
+    if (method != "HEAD") {
+      out += body;
+    }
+  } else {
+    out += http_date::header();
+    out += "\r\n";
+  }
+  send_all(s, out.data(), out.size());
+  return code;
 }
 
 static std::unordered_map<std::string, std::string> content_types = {
@@ -915,14 +2210,188 @@ static std::unordered_map<std::string, std::string> content_types = {
   { ".css",  "text/css" },
 };
 
+// Content types worth compressing on the fly. Event streams are left alone
+// so that every event reaches the client as soon as it is flushed.
+inline bool is_compressible_type(std::string_view content_type) {
+  auto type = content_type.substr(0, content_type.find(';'));
+  while (!type.empty() && (type.back() == ' ' || type.back() == '\t')) type.remove_suffix(1);
+  auto starts_with = [&](std::string_view prefix) {
+    return type.size() >= prefix.size() && header_name_equals(type.substr(0, prefix.size()), prefix);
+  };
+  auto ends_with = [&](std::string_view suffix) {
+    return type.size() >= suffix.size() && header_name_equals(type.substr(type.size() - suffix.size()), suffix);
+  };
+  if (starts_with("text/")) {
+    return !header_name_equals(type, "text/event-stream");
+  }
+  return header_name_equals(type, "application/json")
+      || header_name_equals(type, "application/javascript")
+      || header_name_equals(type, "application/xml")
+      || ends_with("+json")
+      || ends_with("+xml");
+}
+
+// Coding to compress a response with, or nullptr when the client accepts
+// neither gzip nor deflate. Ties prefer gzip.
+inline const char* negotiate_response_encoding(std::string_view accept) {
+  auto gzip = accept_encoding_quality(accept, "gzip");
+  auto deflate = accept_encoding_quality(accept, "deflate");
+  if (gzip > 0 && gzip >= deflate) {
+    return "gzip";
+  }
+  if (deflate > 0) {
+    return "deflate";
+  }
+  return nullptr;
+}
+
+// A compressed body is a different representation, so a strong validator
+// of the identity body can only be kept as a weak one.
+inline void weaken_etag(std::vector<header>& headers) {
+  for (auto& h : headers) {
+    if (header_name_equals(h.first, "ETag") && !h.second.empty() && h.second[0] == '"') {
+      h.second.insert(0, "W/");
+    }
+  }
+}
+
+// Adds Accept-Encoding to Vary, keeping whatever the handler listed.
+inline void vary_on_accept_encoding(std::vector<header>& headers) {
+  for (auto& h : headers) {
+    if (header_name_equals(h.first, "Vary")) {
+      if (h.second.find("Accept-Encoding") == std::string::npos) {
+        h.second += ", Accept-Encoding";
+      }
+      return;
+    }
+  }
+  headers.emplace_back("Vary", "Accept-Encoding");
+}
+
+#ifdef CLASK_USE_ZLIB
+// Streaming deflate for response bodies. Like body_inflater, each thread
+// keeps one instance and reuses its state through deflateReset.
+class response_deflater {
+private:
+  z_stream zs{};
+  bool initialized = false;
+  int window_bits = 0;
+  int level = 0;
+  response_deflater(const response_deflater&) = delete;
+  response_deflater& operator =(const response_deflater&) = delete;
+public:
+  response_deflater() = default;
+  ~response_deflater() {
+    if (initialized) {
+      deflateEnd(&zs);
+    }
+  }
+  static response_deflater& local() {
+    thread_local response_deflater deflater;
+    return deflater;
+  }
+  // Starts a gzip or zlib-wrapped ("deflate") stream.
+  bool reset(std::string_view coding, int level) {
+    auto bits = coding == "gzip" ? 15 + 16 : 15;
+    if (initialized && bits == window_bits) {
+      if (deflateReset(&zs) != Z_OK) {
+        return false;
+      }
+      if (level != this->level && deflateParams(&zs, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+      }
+      this->level = level;
+      return true;
+    }
+    if (initialized) {
+      deflateEnd(&zs);
+    }
+    zs = z_stream{};
+    initialized = deflateInit2(&zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    window_bits = bits;
+    this->level = level;
+    return initialized;
+  }
+  // Compresses len bytes and passes the output to out in pieces. flush is
+  // Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH.
+  template <typename Out>
+  void feed(const char* data, size_t len, int flush, Out&& out) {
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs.avail_in = (uInt) len;
+    char chunk[16384];
+    do {
+      zs.next_out = reinterpret_cast<Bytef*>(chunk);
+      zs.avail_out = sizeof(chunk);
+      auto ret = ::deflate(&zs, flush);
+      if (ret == Z_STREAM_ERROR) {
+        return;
+      }
+      auto produced = sizeof(chunk) - zs.avail_out;
+      if (produced > 0) {
+        out(chunk, produced);
+      }
+    } while (zs.avail_out == 0);
+  }
+};
+
+// Compresses a complete body. Returns false if the deflate state could not
+// be set up.
+inline bool deflate_body(std::string_view coding, int level, std::string_view body, std::string& compressed) {
+  auto& deflater = response_deflater::local();
+  if (!deflater.reset(coding, level)) {
+    return false;
+  }
+  compressed.clear();
+  compressed.reserve(body.size() / 2 + 64);
+  deflater.feed(body.data(), body.size(), Z_FINISH, [&](const char* data, size_t n) {
+    compressed.append(data, n);
+  });
+  return true;
+}
+#endif
+
 
+// Buffers headers and small writes so that a response normally leaves in a
+// single sendmsg. A flush_threshold of 0 keeps the historical write-through
+// behaviour: every write() goes to the socket immediately, still coalesced
+// with any pending headers.
 class response_writer {
 private:
   std::vector<header> headers;
   int s;
   bool header_out;
+  size_t flush_threshold;
+  bool corked = false;
+  bool ended = false;
+  // Framing state for writers that keep the connection alive; see
+  // auto_frame().
+  bool framing = false;
+  bool keep_alive = false;
+  bool allow_chunked = false;
+  bool chunked = false;
+  std::optional<size_t> declared_length;
+  size_t body_bytes = 0;
+  // Set when a send to the socket fails; the connection is then closed.
+  bool send_failed = false;
+  // Before the headers are committed this holds raw body bytes; after,
+  // bytes ready for the wire.
+  pooled_buffer out;
+  // On-the-fly compression; see compress().
+  bool compress_enabled = false;
+  bool deflating = false;
+  std::string accept_encoding;
+  int compression_level = 0;
+  size_t compression_min_size = 0;
+  void commit_headers(bool final);
+  void begin_compression(bool final);
+  void end_compression();
+  void emit(const char*, size_t);
+  void emit_frame(const char*, size_t);
+  bool discards_body() const;
 public:
-  response_writer(int s, int code) : s(s), header_out(false), code(code) { }
+  response_writer(int s, int code, size_t flush_threshold = 0)
+    : s(s), header_out(false), flush_threshold(flush_threshold),
+      out(std::max(flush_threshold, default_output_buffer_size) * 2), code(code) { }
   int code;
   // HEAD requests send the same headers as GET but no body.
   bool head_only = false;
@@ -931,12 +2400,36 @@ public:
   virtual void write(const std::string&);
   virtual void write(char*, size_t);
   virtual void write_headers();
+  // Streams len bytes of fd from offset. Goes straight from the page cache
+  // to the socket with sendfile(2) unless the range fits in the output
+  // buffer. Writers that wrap the socket (e.g. TLS) must override this.
+  virtual void write_file(int fd, std::uint64_t offset, size_t len);
+  // Sends a complete response whose header lines (including
+  // Content-Length) were serialized ahead of time, in a single write.
+  // Headers set on the writer are not sent.
+  virtual void write_prepared(int code, std::string_view header_lines, std::string_view body);
+  virtual void flush();
   virtual void end();
+  // Holds back partial frames until uncork(); useful around a burst of
+  // writes that should leave in as few packets as possible.
+  void cork();
+  void uncork();
+  // Frames the response so the connection can be reused: an exact
+  // Content-Length when the whole body is still buffered when headers are
+  // committed, chunked encoding otherwise (or close, for HTTP/1.0).
+  void auto_frame(bool keep_alive, bool allow_chunked);
+  // Completes the response after the handler returns and reports whether
+  // the connection can carry another request.
+  bool finish();
+  // Compresses a compressible body with the best of gzip and deflate that
+  // accept_encoding allows. Whole bodies under min_size are sent as they
+  // are; longer ones are compressed as they stream. Needs auto_frame().
+  void compress(std::string accept_encoding, int level, size_t min_size);
 };
 
 class server_sent_event_writer {
 private:
-  response_writer w;
+  response_writer& w;
 public:
   server_sent_event_writer(response_writer& w) : w(w) {
   };
@@ -944,6 +2437,8 @@ public:
     w.write("event: " + event + "\r\n");
     w.write("data: " + data + "\r\n");
     w.write("\r\n");
+    // Events must reach the client as soon as they are produced.
+    w.flush();
   }
   void end() {
     w.end();
@@ -951,26 +2446,25 @@ public:
 };
 class chunked_writer {
 private:
-  response_writer w;
+  response_writer& w;
 public:
   chunked_writer(response_writer& w) : w(w) {
     w.set_header("Transfer-Encoding", "chunked");
   };
   void write(const std::string& s) {
-    std::stringstream shex;
-    shex << std::hex << s.size();
-    w.write(shex.str() + "\r\n");
-    w.write(s + "\r\n");
+    write(const_cast<char*>(s.data()), s.size());
   }
   void write(char* ptr, size_t len) {
-    std::stringstream shex;
-    shex << std::hex << len;
-    w.write(shex.str() + "\r\n");
+    char hex[20];
+    auto n = (size_t) (std::to_chars(hex, hex + sizeof(hex) - 2, len, 16).ptr - hex);
+    hex[n++] = '\r';
+    hex[n++] = '\n';
+    w.write(hex, n);
     w.write(ptr, len);
-    w.write("\r\n");
+    w.write(const_cast<char*>("\r\n"), 2);
   }
   void end() {
-    w.write("0\r\n\r\n");
+    w.write(const_cast<char*>("0\r\n\r\n"), 5);
     w.end();
   }
 };
@@ -993,7 +2487,7 @@ inline void write_status_text_response(
     response_writer& resp,
     int code,
     const std::vector<header>& extra_headers = {}) {
-  write_plain_text_response(resp, code, status_codes[code], extra_headers);
+  write_plain_text_response(resp, code, std::string(status_reason(code)), extra_headers);
 }
 
 inline std::string form_url_decode(std::string s) {
@@ -1029,168 +2523,777 @@ inline void response_writer::set_header(std::string key, const std::string& val)
   headers.emplace_back(h, val);
 }
 
-inline void response_writer::write(char* buf, size_t n) {
-  if (!header_out) {
-    write_headers();
+inline bool has_response_body(int code) {
+  return code >= 200 && code != 204 && code != 304;
+}
+
+// 1xx, 204 and 304 responses go out without a Content-Length line.
+inline void append_content_length(std::string& out, int code, size_t size) {
+  if (!has_response_body(code)) {
+    return;
   }
-  if (head_only) {
+  out += "Content-Length: ";
+  append_number(out, size);
+  out += "\r\n";
+}
+
+inline void response_writer::auto_frame(bool keep_alive, bool allow_chunked) {
+  framing = true;
+  this->keep_alive = keep_alive;
+  this->allow_chunked = allow_chunked;
+}
+
+inline void response_writer::compress(std::string accept_encoding, int level, size_t min_size) {
+  compress_enabled = true;
+  this->accept_encoding = std::move(accept_encoding);
+  compression_level = level;
+  compression_min_size = min_size;
+}
+
+// Decides on compression once the handler's headers are known and
+// compresses whatever body is already buffered. A final body is compressed
+// whole so it still gets a Content-Length; otherwise the stream stays open
+// and later writes go through the deflater.
+inline void response_writer::begin_compression(bool final) {
+#ifdef CLASK_USE_ZLIB
+  if (!has_response_body(code)) {
+    return;
+  }
+  std::string_view content_type;
+  for (auto& h : headers) {
+    if (h.first == "Content-Length" || h.first == "Content-Encoding" || h.first == "Transfer-Encoding") {
+      return;
+    }
+    if (h.first == "Content-Type") {
+      content_type = h.second;
+    }
+  }
+  if (!is_compressible_type(content_type)) {
+    return;
+  }
+  vary_on_accept_encoding(headers);
+  auto coding = negotiate_response_encoding(accept_encoding);
+  if (coding == nullptr || (final && body_bytes < compression_min_size)) {
+    return;
+  }
+  auto& deflater = response_deflater::local();
+  if (!deflater.reset(coding, compression_level)) {
+    return;
+  }
+  set_header("Content-Encoding", coding);
+  weaken_etag(headers);
+  // A streamed HEAD sends no body, so only its headers need to match GET.
+  if (head_only && !final) {
     return;
   }
-  send(s, buf, (int) n, MSG_NOSIGNAL);
+  std::string compressed;
+  deflater.feed(out.buf.data(), out.buf.size(), final ? Z_FINISH : Z_NO_FLUSH, [&](const char* data, size_t n) {
+    compressed.append(data, n);
+  });
+  out.buf.assign(compressed);
+  if (final) {
+    body_bytes = compressed.size();
+  } else {
+    deflating = true;
+  }
+#else
+  (void) final;
+#endif
 }
 
-inline void response_writer::write_headers() {
+inline void response_writer::end_compression() {
+#ifdef CLASK_USE_ZLIB
+  if (deflating) {
+    deflating = false;
+    response_deflater::local().feed(nullptr, 0, Z_FINISH, [&](const char* data, size_t n) {
+      emit_frame(data, n);
+    });
+  }
+#endif
+}
+
+inline void response_writer::commit_headers(bool final) {
   header_out = true;
-  std::string buf;
-  buf.reserve(256);
-  buf += "HTTP/1.1 ";
-  buf += std::to_string(code);
-  buf += " ";
-  buf += status_codes[code];
-  buf += "\r\n";
+  if (framing && compress_enabled) {
+    begin_compression(final);
+  }
+  if (framing) {
+    auto has_transfer_encoding = false, has_connection = false;
+    for (auto& h : headers) {
+      if (h.first == "Content-Length") {
+        declared_length = (size_t) std::strtoull(h.second.c_str(), nullptr, 10);
+      } else if (h.first == "Transfer-Encoding") {
+        has_transfer_encoding = true;
+      } else if (h.first == "Connection") {
+        has_connection = true;
+        if (header_name_equals(h.second, "close")) {
+          keep_alive = false;
+        }
+      }
+    }
+    // A handler that frames the body itself (e.g. chunked_writer) cannot
+    // tell us when it is done, so the connection closes after it.
+    if (has_transfer_encoding) {
+      keep_alive = false;
+    } else if (has_response_body(code) && !declared_length) {
+      if (final) {
+        declared_length = body_bytes;
+        set_header("Content-Length", std::to_string(body_bytes));
+      } else if (allow_chunked) {
+        chunked = true;
+        set_header("Transfer-Encoding", "chunked");
+      } else {
+        keep_alive = false;
+      }
+    }
+    if (!has_connection) {
+      set_header("Connection", keep_alive ? "Keep-Alive" : "Close");
+    }
+  }
+
+  std::string head;
+  head.reserve(256);
+  append_status_line(head, code);
+  auto has_date = false;
   for (auto& h : headers) {
-    buf += h.first;
-    buf += ": ";
-    buf += h.second;
-    buf += "\r\n";
+    append_header(head, h.first, h.second);
+    has_date = has_date || h.first == "Date";
+  }
+  if (!has_date) {
+    head += http_date::header();
   }
-  buf += "\r\n";
-  send(s, buf.data(), (int) buf.size(), MSG_NOSIGNAL);
+  head += "\r\n";
+  if (head_only) {
+    out.buf.clear();
+  }
+  if (chunked && !out.buf.empty()) {
+    append_number(head, out.buf.size(), 16);
+    head += "\r\n";
+    out.buf += "\r\n";
+  }
+  out.buf.insert(0, head);
 }
 
-inline void response_writer::write(const std::string& content) {
+inline void response_writer::emit(const char* data, size_t n) {
+#ifdef CLASK_USE_ZLIB
+  if (deflating) {
+    response_deflater::local().feed(data, n, Z_NO_FLUSH, [&](const char* out, size_t len) {
+      emit_frame(out, len);
+    });
+    return;
+  }
+#endif
+  emit_frame(data, n);
+}
+
+// Appends wire bytes to the output buffer, or sends the buffer and the new
+// data together with one vectored write once the threshold would be
+// exceeded.
+inline void response_writer::emit_frame(const char* data, size_t n) {
+  if (n == 0) {
+    if (flush_threshold == 0) {
+      flush();
+    }
+    return;
+  }
+  char hex[20];
+  size_t hex_len = 0;
+  if (chunked) {
+    hex_len = (size_t) (std::to_chars(hex, hex + sizeof(hex) - 2, n, 16).ptr - hex);
+    hex[hex_len++] = '\r';
+    hex[hex_len++] = '\n';
+  }
+  size_t trailer_len = chunked ? 2 : 0;
+  auto& buf = out.buf;
+  if (buf.size() + hex_len + n + trailer_len <= flush_threshold) {
+    buf.append(hex, hex_len);
+    buf.append(data, n);
+    buf.append("\r\n", trailer_len);
+    return;
+  }
+  io_slice slices[4] = {{buf.data(), buf.size()}, {hex, hex_len}, {data, n}, {"\r\n", trailer_len}};
+  if (!send_slices(s, slices, 4)) {
+    send_failed = true;
+  }
+  buf.clear();
+}
+
+// Whether a HEAD response can skip buffering the body. With compression
+// on, the body decides Content-Encoding and Content-Length, so HEAD
+// buffers and compresses it exactly like GET and drops it when sending.
+inline bool response_writer::discards_body() const {
+  return head_only && !(framing && compress_enabled);
+}
+
+inline void response_writer::write(char* buf, size_t n) {
+  body_bytes += n;
+  if (discards_body()) {
+    if (!header_out && flush_threshold == 0) {
+      write_headers();
+    }
+    return;
+  }
   if (!header_out) {
-    write_headers();
+    if (flush_threshold > 0 && out.buf.size() + n <= flush_threshold) {
+      out.buf.append(buf, n);
+      return;
+    }
+    commit_headers(false);
   }
   if (head_only) {
     return;
   }
-  send(s, content.data(), (int) content.size(), MSG_NOSIGNAL);
+  emit(buf, n);
 }
 
-inline void response_writer::end() {
+inline void response_writer::write_file(int fd, std::uint64_t offset, size_t len) {
+  if (discards_body()) {
+    body_bytes += len;
+    if (!header_out && flush_threshold == 0) {
+      write_headers();
+    }
+    return;
+  }
+  auto& buf = out.buf;
+  if (!header_out && flush_threshold > 0 && buf.size() + len <= flush_threshold) {
+    auto pos = buf.size();
+    buf.resize(pos + len);
+    auto n = read_file_at(fd, &buf[pos], len, offset);
+    buf.resize(pos + (size_t) std::max(n, 0LL));
+    body_bytes += buf.size() - pos;
+    return;
+  }
   if (!header_out) {
-    write_headers();
+    commit_headers(false);
+  }
+  if (len == 0) {
+    return;
+  }
+  body_bytes += len;
+  if (head_only) {
+    return;
+  }
+#ifdef CLASK_USE_ZLIB
+  if (deflating) {
+    char chunk[16384];
+    while (len > 0) {
+      auto n = read_file_at(fd, chunk, std::min(len, sizeof(chunk)), offset);
+      if (n <= 0) {
+        break;
+      }
+      emit(chunk, (size_t) n);
+      offset += (std::uint64_t) n;
+      len -= (size_t) n;
+    }
+    return;
+  }
+#endif
+  if (chunked) {
+    append_number(buf, len, 16);
+    buf += "\r\n";
+  }
+  if (!buf.empty()) {
+    if (!send_all(s, buf.data(), buf.size(), true)) {
+      send_failed = true;
+    }
+    buf.clear();
+  }
+  if (send_failed || !send_file_range(s, fd, offset, len)) {
+    send_failed = true;
+    return;
+  }
+  if (chunked) {
+    buf += "\r\n";
+    if (flush_threshold == 0) {
+      flush();
+    }
   }
-  // The connection handler owns the socket and closes it exactly once
-  // after the request handler returns; closing here as well could close
-  // an unrelated connection that reused the same descriptor.
-  shutdown(s, SHUT_WR);
 }
 
-struct response {
-  int code;
-  std::string content;
-  std::vector<header> headers;
-};
-
-struct request {
-  std::string method;
-  std::string raw_uri;
-  std::string uri;
-  std::unordered_map<std::string, std::string> uri_params;
-  std::vector<header> headers;
-  std::string body;
-  std::vector<std::string> args;
-
-  request(
-      std::string method, std::string raw_uri, std::string uri,
-      std::unordered_map<std::string, std::string> uri_params,
-      std::vector<header> headers, std::string body)
-    : method(std::move(method)), raw_uri(std::move(raw_uri)),
-      uri(std::move(uri)), uri_params(std::move(uri_params)),
-      headers(std::move(headers)), body(std::move(body)) { }
+inline void response_writer::write_prepared(int code, std::string_view header_lines, std::string_view body) {
+  this->code = code;
+  header_out = true;
+  body_bytes = body.size();
+  if (has_response_body(code)) {
+    declared_length = body.size();
+  }
+  auto& head = out.buf;
+  head.clear();
+  append_status_line(head, code);
+  head += header_lines;
+  if (framing) {
+    append_header(head, "Connection", keep_alive ? "Keep-Alive" : "Close");
+  }
+  head += http_date::header();
+  head += "\r\n";
+  io_slice slices[2] = {{head.data(), head.size()}, {body.data(), head_only ? 0 : body.size()}};
+  if (!send_slices(s, slices, 2)) {
+    send_failed = true;
+  }
+  head.clear();
+}
 
-  bool parse_multipart(std::vector<part>& parts);
-  std::string header_value(const std::string&);
-  std::string cookie_value(const std::string&);
-};
+inline void response_writer::write_headers() {
+  commit_headers(false);
+  if (flush_threshold == 0) {
+    flush();
+  }
+}
 
-inline bool request::parse_multipart(std::vector<part>& parts) {
-  parts.clear();
+inline void response_writer::write(const std::string& content) {
+  write(const_cast<char*>(content.data()), content.size());
+}
 
-  auto ct = header_value("content-type");
-  std::string boundary;
-  while (!ct.empty()) {
-    auto pos = ct.find(';');
-    if (pos == std::string::npos) {
-      pos = ct.size();
-    }
-    auto sub = ct.substr(0, pos);
-    trim_string(sub, " \t");
-    if (sub.size() >= 9 && sub.substr(0, 9) == "boundary=") {
-      sub = sub.substr(9);
-      trim_string(sub, "\"");
-      boundary = sub;
-      break;
-    }
-    if (pos >= ct.size()) {
-      break;
+inline void response_writer::flush() {
+  if (!header_out) {
+    commit_headers(false);
+  }
+#ifdef CLASK_USE_ZLIB
+  if (deflating) {
+    response_deflater::local().feed(nullptr, 0, Z_SYNC_FLUSH, [&](const char* data, size_t n) {
+      emit_frame(data, n);
+    });
+  }
+#endif
+  if (!out.buf.empty()) {
+    if (!send_all(s, out.buf.data(), out.buf.size())) {
+      send_failed = true;
     }
-    ct = ct.substr(pos + 1);
+    out.buf.clear();
   }
-  if (boundary.empty()) {
+}
+
+inline bool response_writer::finish() {
+  if (ended) {
     return false;
   }
-  const auto delimiter = "--" + boundary;
-
-  size_t pos = body.find(delimiter);
-  while (pos != std::string::npos) {
-    auto part_start = pos + delimiter.size();
-    if (body.compare(part_start, 2, "--") == 0) {
-      break;
-    }
-    if (body.compare(part_start, 2, "\r\n") != 0) {
-      return false;
+  if (!header_out) {
+    commit_headers(true);
+  } else {
+    end_compression();
+    if (chunked && !head_only) {
+      out.buf += "0\r\n\r\n";
     }
-    part_start += 2;
-
-    auto next = body.find("\r\n" + delimiter, part_start);
-    if (next == std::string::npos) {
+  }
+  flush();
+  if (send_failed) {
+    return false;
+  }
+  if (!head_only) {
+    if (declared_length && *declared_length != body_bytes) {
       return false;
     }
-
-    auto data = body.substr(part_start, next - part_start);
-
-    auto eos = data.find("\r\n\r\n");
-    if (eos == std::string::npos) {
+    if (!has_response_body(code) && body_bytes > 0) {
       return false;
     }
-    auto lines = data.substr(0, eos + 4);
-
-    struct phr_header hdrs[100];
-    size_t prevbuflen = 0, num_headers;
+  }
+  return keep_alive;
+}
 
-    num_headers = sizeof(hdrs) / sizeof(hdrs[0]);
-    prevbuflen = 0;
-    auto pret = phr_parse_headers(
-        lines.data(), lines.size(), hdrs, &num_headers, prevbuflen);
-    if (pret <= 0) {
-      return false;
-    }
+inline void response_writer::cork() {
+  if (corked) return;
+  corked = true;
+#if defined(TCP_CORK)
+  sockopt_t on = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_CORK, &on, (int) sizeof(on));
+#elif defined(TCP_NOPUSH)
+  sockopt_t on = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_NOPUSH, &on, (int) sizeof(on));
+#endif
+}
 
-    std::vector<header> req_headers;
+inline void response_writer::uncork() {
+  flush();
+  if (!corked) return;
+  corked = false;
+#if defined(TCP_CORK)
+  sockopt_t off = 0;
+  setsockopt(s, IPPROTO_TCP, TCP_CORK, &off, (int) sizeof(off));
+#elif defined(TCP_NOPUSH)
+  sockopt_t off = 0;
+  setsockopt(s, IPPROTO_TCP, TCP_NOPUSH, &off, (int) sizeof(off));
+#endif
+}
 
-    for (size_t n = 0; n < num_headers; n++) {
-      auto key = std::string(hdrs[n].name, hdrs[n].name_len);
-      auto val = std::string(hdrs[n].value, hdrs[n].value_len);
-      key = url_decode(key);
-      val = url_decode(val);
-      req_headers.emplace_back(std::move(key), std::move(val));
+inline void response_writer::end() {
+  if (ended) {
+    return;
+  }
+  keep_alive = false;
+  if (!header_out) {
+    commit_headers(true);
+  } else {
+    end_compression();
+    if (chunked && !head_only) {
+      out.buf += "0\r\n\r\n";
     }
-
-    part p = {
-      .headers = std::move(req_headers),
-      .body = data = data.substr(eos + 4)
-    };
-    parts.emplace_back(std::move(p));
-    pos = next + 2;
   }
-  return true;
+  ended = true;
+  uncork();
+  // The connection handler owns the socket and closes it exactly once
+  // after the request handler returns; closing here as well could close
+  // an unrelated connection that reused the same descriptor. A captured
+  // response is still to be sent, and the connection closes after it.
+  if (socket_capture() == nullptr) {
+    shutdown(s, SHUT_WR);
+  }
 }
 
-inline std::string request::header_value(const std::string& name) {
-  std::string key = name;
+// Owns an open file descriptor and closes it with the last reference.
+class file_handle {
+private:
+  int fd_;
+  file_handle(const file_handle&) = delete;
+  file_handle& operator =(const file_handle&) = delete;
+public:
+  explicit file_handle(int fd) : fd_(fd) { }
+  ~file_handle() {
+    if (fd_ >= 0) {
+#ifdef _WIN32
+      _close(fd_);
+#else
+      close(fd_);
+#endif
+    }
+  }
+  int fd() const { return fd_; }
+};
+
+struct file_info {
+  std::uint64_t size;
+  std::time_t mtime;
+  long mtime_nsec;
+  std::uint64_t inode;
+};
+
+template <typename Stat>
+inline file_info make_file_info(const Stat& st) {
+  return file_info {
+    .size = (std::uint64_t) st.st_size,
+    .mtime = (std::time_t) st.st_mtime,
+#if defined(_WIN32)
+    .mtime_nsec = 0,
+#elif defined(__APPLE__)
+    .mtime_nsec = (long) st.st_mtimespec.tv_nsec,
+#else
+    .mtime_nsec = (long) st.st_mtim.tv_nsec,
+#endif
+    .inode = (std::uint64_t) st.st_ino,
+  };
+}
+
+// Opens a regular file for reading and stats it through the same
+// descriptor. Returns nullptr for missing files and non-regular files.
+inline std::shared_ptr<file_handle> open_regular_file(const std::string& path, file_info& info) {
+#ifdef _WIN32
+  auto fd = _wopen(to_wstring(path).c_str(), _O_RDONLY | _O_BINARY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  auto handle = std::make_shared<file_handle>(fd);
+  struct _stat64 st{};
+  if (_fstat64(fd, &st) != 0 || (st.st_mode & _S_IFREG) == 0) {
+    return nullptr;
+  }
+#else
+  auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  auto handle = std::make_shared<file_handle>(fd);
+  struct stat st{};
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return nullptr;
+  }
+#endif
+  info = make_file_info(st);
+  return handle;
+}
+
+inline bool stat_regular_file(const std::string& path, file_info& info) {
+#ifdef _WIN32
+  struct _stat64 st{};
+  if (_wstat64(to_wstring(path).c_str(), &st) != 0 || (st.st_mode & _S_IFREG) == 0) {
+    return false;
+  }
+#else
+  struct stat st{};
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+#endif
+  info = make_file_info(st);
+  return true;
+}
+
+inline bool same_file_version(const file_info& x, const file_info& y) {
+  return x.size == y.size && x.mtime == y.mtime && x.mtime_nsec == y.mtime_nsec && x.inode == y.inode;
+}
+
+// Strong validator for a file: changes whenever the file is replaced
+// (inode), resized or touched, with sub-second precision where the
+// filesystem has it.
+inline std::string file_etag(const file_info& info) {
+  std::string etag = "\"";
+  append_number(etag, info.inode, 16);
+  etag += '-';
+  append_number(etag, info.size, 16);
+  etag += '-';
+  append_number(etag, (std::uint64_t) info.mtime * 1000000000ULL + (std::uint64_t) info.mtime_nsec, 16);
+  etag += '"';
+  return etag;
+}
+
+// 64-bit hash of a response body for content-derived ETags; not
+// cryptographic, only meant to tell versions of one resource apart.
+inline std::uint64_t content_hash(std::string_view data, std::uint64_t seed = 0) {
+  constexpr std::uint64_t prime = 0x9e3779b97f4a7c15ULL;
+  std::uint64_t h = 0xcbf29ce484222325ULL ^ (data.size() * prime) ^ (seed * prime);
+  size_t i = 0;
+  for (; i + 8 <= data.size(); i += 8) {
+    std::uint64_t w;
+    std::memcpy(&w, data.data() + i, 8);
+    h = (h ^ w) * prime;
+    h ^= h >> 29;
+  }
+  for (; i < data.size(); i++) {
+    h = (h ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+  }
+  h ^= h >> 32;
+  return h;
+}
+
+inline std::string content_etag(std::string_view data) {
+  std::string etag = "W/\"";
+  append_number(etag, content_hash(data), 16);
+  etag += '"';
+  return etag;
+}
+
+// If-None-Match uses the weak comparison: W/ prefixes are ignored.
+inline bool etag_matches(std::string_view if_none_match, std::string_view etag) {
+  auto opaque = [](std::string_view v) {
+    return v.substr(0, 2) == "W/" ? v.substr(2) : v;
+  };
+  auto target = opaque(etag);
+  while (!if_none_match.empty()) {
+    auto comma = if_none_match.find(',');
+    auto tag = if_none_match.substr(0, comma);
+    if_none_match = comma == std::string_view::npos ? std::string_view() : if_none_match.substr(comma + 1);
+    while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) tag.remove_prefix(1);
+    while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) tag.remove_suffix(1);
+    if (tag == "*" || (!tag.empty() && opaque(tag) == target)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Response body that is sent as-is, never copied into the header buffer:
+// an owned string, a view of data that outlives the response (e.g. a
+// static), a refcounted immutable buffer, or a byte range of an open file.
+class response_body {
+public:
+  enum class kind { owned, view, shared, file };
+private:
+  kind kind_ = kind::owned;
+  std::string owned_;
+  std::string_view view_;
+  std::shared_ptr<const std::string> shared_;
+  std::shared_ptr<file_handle> file_;
+  std::uint64_t offset_ = 0;
+  size_t length_ = 0;
+public:
+  response_body() = default;
+  response_body(std::string s) : owned_(std::move(s)) { }
+  response_body(const char* s) : owned_(s) { }
+  response_body(std::string_view v) : kind_(kind::view), view_(v) { }
+  response_body(std::shared_ptr<const std::string> buf) : kind_(kind::shared), shared_(std::move(buf)) { }
+  static response_body file(std::shared_ptr<file_handle> f, std::uint64_t offset, size_t length) {
+    response_body b;
+    b.kind_ = kind::file;
+    b.file_ = std::move(f);
+    b.offset_ = offset;
+    b.length_ = length;
+    return b;
+  }
+  kind type() const { return kind_; }
+  // Bytes of in-memory bodies; empty for file ranges.
+  std::string_view view() const {
+    switch (kind_) {
+      case kind::owned: return owned_;
+      case kind::view: return view_;
+      case kind::shared: return shared_ ? std::string_view(*shared_) : std::string_view();
+      default: return {};
+    }
+  }
+  size_t size() const { return kind_ == kind::file ? length_ : view().size(); }
+  bool empty() const { return size() == 0; }
+  int fd() const { return file_ ? file_->fd() : -1; }
+  std::uint64_t offset() const { return offset_; }
+};
+
+// File ranges up to this size are read into the head buffer and sent with
+// one write instead of a separate sendfile call.
+constexpr size_t inline_file_body_size = 16384;
+
+// Sends a serialized head followed by body without concatenating them.
+inline bool send_head_and_body(int s, std::string& head, const response_body& body, bool head_only) {
+  if (head_only || body.empty()) {
+    return send_all(s, head.data(), head.size());
+  }
+  if (body.type() != response_body::kind::file) {
+    auto v = body.view();
+    io_slice slices[2] = {{head.data(), head.size()}, {v.data(), v.size()}};
+    return send_slices(s, slices, 2);
+  }
+  if (body.size() <= inline_file_body_size) {
+    auto head_size = head.size();
+    head.resize(head_size + body.size());
+    auto n = read_file_at(body.fd(), &head[head_size], body.size(), body.offset());
+    if (n != (long long) body.size()) {
+      return false;
+    }
+    return send_all(s, head.data(), head.size());
+  }
+  return send_all(s, head.data(), head.size(), true)
+      && send_file_range(s, body.fd(), body.offset(), body.size());
+}
+
+struct response {
+  int code;
+  response_body content;
+  std::vector<header> headers;
+};
+
+// Server-wide accounting of request body bytes held in memory, shared by
+// every worker. A limit of 0 means unbounded.
+class body_budget {
+private:
+  std::atomic<size_t> in_use{0};
+  size_t limit;
+public:
+  body_budget(size_t limit = 0) : limit(limit) { }
+  bool try_acquire(size_t n) {
+    auto cur = in_use.load(std::memory_order_relaxed);
+    do {
+      if (limit > 0 && (n > limit || cur > limit - n)) {
+        return false;
+      }
+    } while (!in_use.compare_exchange_weak(cur, cur + n, std::memory_order_relaxed));
+    return true;
+  }
+  void release(size_t n) {
+    in_use.fetch_sub(n, std::memory_order_relaxed);
+  }
+  size_t used() const {
+    return in_use.load(std::memory_order_relaxed);
+  }
+};
+
+// Keeps the resources behind a request body alive: its share of the body
+// budget and, for spilled bodies, the mapped temporary file.
+class request_body_storage {
+private:
+  request_body_storage(const request_body_storage&) = delete;
+  request_body_storage& operator =(const request_body_storage&) = delete;
+public:
+  body_budget* budget = nullptr;
+  size_t reserved = 0;
+  int fd = -1;
+  void* map = nullptr;
+  size_t size = 0;
+  request_body_storage() = default;
+  ~request_body_storage() {
+#ifndef _WIN32
+    if (map != nullptr) {
+      munmap(map, size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+#endif
+    if (budget != nullptr) {
+      budget->release(reserved);
+    }
+  }
+};
+
+struct request {
+  std::string method;
+  std::string raw_uri;
+  std::string uri;
+  std::unordered_map<std::string, std::string> uri_params;
+  std::vector<header> headers;
+  std::string body;
+  std::vector<std::string> args;
+  // Set when the body was spilled to disk; body is empty then and
+  // body_view() returns the mapped file.
+  std::shared_ptr<request_body_storage> body_storage;
+  // HTTP/1.x minor version of the request line.
+  int minor_version = 1;
+  // For routes wrapped in stream_body(): the socket the rest of the body
+  // is read from and how much of it is unread. body holds only what
+  // arrived with the headers.
+  int body_socket = -1;
+  size_t body_unread = 0;
+
+  request(
+      std::string method, std::string raw_uri, std::string uri,
+      std::unordered_map<std::string, std::string> uri_params,
+      std::vector<header> headers, std::string body)
+    : method(std::move(method)), raw_uri(std::move(raw_uri)),
+      uri(std::move(uri)), uri_params(std::move(uri_params)),
+      headers(std::move(headers)), body(std::move(body)) { }
+
+  bool parse_multipart(std::vector<part>& parts);
+  bool parse_multipart(part_sink& sink);
+  std::string_view body_view() const;
+  std::string header_value(const std::string&);
+  std::string cookie_value(const std::string&);
+};
+
+inline bool request::parse_multipart(part_sink& sink) {
+  auto boundary = header_param(header_value("content-type"), "boundary");
+  if (boundary.empty()) {
+    return false;
+  }
+  multipart_parser parser(boundary, sink);
+  auto data = body_view();
+  if (!parser.feed(data.data(), data.size())) {
+    return false;
+  }
+  // A streamed body is fed straight from the socket.
+  char buf[body_scratch_buffer_size];
+  while (body_unread > 0) {
+    ssize_t rret;
+    while ((rret = recv(body_socket, buf, (int) std::min(body_unread, sizeof(buf)), MSG_NOSIGNAL)) == -1 && errno == EINTR);
+    if (rret <= 0) {
+      return false;
+    }
+    body_unread -= (size_t) rret;
+    if (!parser.feed(buf, (size_t) rret)) {
+      return false;
+    }
+  }
+  return parser.finish();
+}
+
+inline bool request::parse_multipart(std::vector<part>& parts) {
+  parts.clear();
+  parts_sink sink(parts);
+  return parse_multipart(sink);
+}
+
+inline std::string_view request::body_view() const {
+  if (body_storage && body_storage->map != nullptr) {
+    return std::string_view(static_cast<const char*>(body_storage->map), body_storage->size);
+  }
+  return body;
+}
+
+inline std::string request::header_value(const std::string& name) {
+  std::string key = name;
   camelize(key);
   for (auto&& h : headers) {
     if (h.first == key) return h.second;
@@ -1283,534 +3386,3055 @@ inline std::optional<size_t> parse_content_length(const std::string& value) {
   }
 }
 
-inline request_read_result read_request_from_socket(int s) {
-  char buf[16384];
+struct request_read_config {
+  // 0 disables each limit.
+  size_t max_body_size;
+  size_t body_spill_threshold;
+  body_budget* budget;
+  // 0 selects default_max_header_size / default_max_header_count.
+  size_t max_header_size;
+  size_t max_header_count;
+  // Inflate gzip/deflate bodies before they reach the handler. A zero
+  // max_decompressed_size falls back to max_body_size; a zero
+  // max_decompression_ratio disables the ratio check.
+  bool decompress;
+  size_t max_decompressed_size;
+  size_t max_decompression_ratio;
+  // Called with the method and path of a request with an unencoded body
+  // and a Content-Length; returning true leaves the body on the socket
+  // for the handler (see stream_body).
+  std::function<bool(const std::string&, const std::string&)> stream_body;
+};
+
+// A request that picohttpparser rejects may only have run out of header
+// slots; reparse with room for every possible line to tell 431 from 400.
+inline bool exceeds_header_count(const char* buf, size_t buflen, size_t max_header_count) {
   const char *method, *path;
-  int pret, minor_version;
-  struct phr_header headers[100];
-  size_t buflen = 0, prevbuflen = 0, method_len, path_len, num_headers;
-  ssize_t rret;
+  size_t method_len, path_len;
+  int minor_version;
+  std::vector<phr_header> headers(buflen / 3 + 1);
+  auto num_headers = headers.size();
+  auto pret = phr_parse_request(
+      buf, buflen, &method, &method_len, &path, &path_len,
+      &minor_version, headers.data(), &num_headers, 0);
+  return pret != -1 && num_headers > max_header_count;
+}
 
-  while (true) {
-    while ((rret = recv(s, buf + buflen, (int) (sizeof(buf) - buflen), MSG_NOSIGNAL)) == -1 && errno == EINTR);
-    if (rret <= 0) {
-      return make_request_read_error(0, "", "");
-    }
+#ifndef _WIN32
+inline int create_spill_file() {
+  const char* dir = std::getenv("TMPDIR");
+  std::string tmpl = std::string(dir != nullptr && *dir ? dir : "/tmp") + "/clask-body-XXXXXX";
+  int fd = mkstemp(&tmpl[0]);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(tmpl.c_str());
+  return fd;
+}
 
-    prevbuflen = buflen;
-    buflen += rret;
-    num_headers = sizeof(headers) / sizeof(headers[0]);
-    pret = phr_parse_request(
-        buf, buflen, &method, &method_len, &path, &path_len,
-        &minor_version, headers, &num_headers, prevbuflen);
-    if (pret > 0) {
-      break;
+inline bool write_all(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    auto n = ::write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
     }
-    if (pret == -1) {
-      return make_request_read_error(400, "Bad Request", "Invalid Request");
+    data += n;
+    len -= (size_t) n;
+  }
+  return true;
+}
+#endif
+
+// Collects decoded request body bytes, charging them against the body
+// budget as they arrive and moving to a spill file once the body outgrows
+// the spill threshold.
+class decoded_body_collector {
+private:
+  std::string& body;
+  std::shared_ptr<request_body_storage>& storage;
+  const request_read_config& config;
+  size_t total = 0;
+
+  bool spill() {
+#ifdef _WIN32
+    return true;
+#else
+    auto fd = create_spill_file();
+    if (fd < 0 || !write_all(fd, body.data(), body.size())) {
+      if (fd >= 0) close(fd);
+      error = 500;
+      return false;
     }
-    if (buflen == sizeof(buf)) {
-      return make_request_read_error(413, "Payload Too Large", "Request Too Large");
+    if (storage && storage->budget != nullptr) {
+      storage->budget->release(storage->reserved);
+      storage->reserved = 0;
     }
+    storage = std::make_shared<request_body_storage>();
+    storage->fd = fd;
+    std::string().swap(body);
+    return true;
+#endif
   }
 
-  const std::string req_method(method, method_len);
-  std::string req_path(path, path_len);
-  std::string req_body(buf + pret, buflen - pret);
-  const std::string req_raw_path = req_path;
-  std::unordered_map<std::string, std::string> req_uri_params;
-  std::vector<header> req_headers;
-
-  auto pos = req_path.find('?');
-  if (pos != std::string::npos) {
-    req_path.resize(pos);
-    std::istringstream iss(req_raw_path.substr(pos + 1));
-    std::string keyval, key, val;
-    while (std::getline(iss, keyval, '&')) {
-      std::istringstream isk(keyval);
-      if(std::getline(std::getline(isk, key, '='), val)) {
-        req_uri_params[form_url_decode(key)] = form_url_decode(val);
+public:
+  int error = 0;
+  decoded_body_collector(
+      std::string& body,
+      std::shared_ptr<request_body_storage>& storage,
+      const request_read_config& config)
+    : body(body), storage(storage), config(config) { }
+
+  size_t size() const { return total; }
+  bool spilled() const { return storage && storage->fd >= 0; }
+
+  bool append(const char* data, size_t len) {
+    total += len;
+    auto max_size = config.max_decompressed_size > 0 ? config.max_decompressed_size : config.max_body_size;
+    if (max_size > 0 && total > max_size) {
+      error = 413;
+      return false;
+    }
+    if (!spilled() && config.body_spill_threshold > 0 && total > config.body_spill_threshold) {
+      if (!spill()) {
+        return false;
+      }
+    }
+#ifndef _WIN32
+    if (spilled()) {
+      if (!write_all(storage->fd, data, len)) {
+        error = 500;
+        return false;
+      }
+      return true;
+    }
+#endif
+    if (config.budget != nullptr) {
+      if (!config.budget->try_acquire(len)) {
+        error = 503;
+        return false;
+      }
+      if (!storage) {
+        storage = std::make_shared<request_body_storage>();
+        storage->budget = config.budget;
       }
+      storage->reserved += len;
     }
+    body.append(data, len);
+    return true;
   }
 
-  bool keep_alive = minor_version == 1;
-  bool has_content_length = false;
-  size_t content_length = 0;
-  for (size_t n = 0; n < num_headers; n++) {
-    auto key = std::string(headers[n].name, headers[n].name_len);
-    auto val = std::string(headers[n].value, headers[n].value_len);
-    camelize(key);
-    if (key == "Content-Length") {
-      auto parsed_content_length = parse_content_length(val);
-      if (!parsed_content_length.has_value()
-          || (has_content_length && *parsed_content_length != content_length)) {
-        return make_request_read_error(400, "Bad Request", "Invalid Content-Length");
+  bool finish() {
+#ifndef _WIN32
+    if (storage && storage->fd >= 0 && total > 0) {
+      storage->map = mmap(nullptr, total, PROT_READ, MAP_PRIVATE, storage->fd, 0);
+      if (storage->map == MAP_FAILED) {
+        storage->map = nullptr;
+        error = 500;
+        return false;
       }
-      content_length = *parsed_content_length;
-      has_content_length = true;
-    } else if (key == "Connection") {
-      for (auto& c : val) c = (char) std::tolower(static_cast<unsigned char>(c));
-      if (val == "keep-alive")
-        keep_alive = true;
-      else if (val == "close")
-        keep_alive = false;
+      storage->size = total;
     }
-    req_headers.emplace_back(std::move(key), std::move(val));
+#endif
+    return true;
   }
+};
 
-  if (has_content_length && buflen - pret < content_length) {
-    auto rest = content_length - (buflen - pret);
-    buflen = 0;
-    while (rest > 0) {
-      auto chunk_size = std::min(rest, sizeof(buf));
-      while ((rret = recv(s, buf + buflen, (int) chunk_size, MSG_NOSIGNAL)) == -1 && errno == EINTR);
-      if (rret <= 0) {
-        return make_request_read_error(0, "", "");
-      }
-      req_body.append(buf, rret);
-      rest -= (size_t) rret;
+#ifdef CLASK_USE_ZLIB
+// Streaming inflate for gzip and deflate request bodies. Each thread keeps
+// one instance and reuses its state through inflateReset.
+class body_inflater {
+private:
+  z_stream zs{};
+  bool initialized = false;
+  int window_bits = 0;
+  body_inflater(const body_inflater&) = delete;
+  body_inflater& operator =(const body_inflater&) = delete;
+public:
+  body_inflater() = default;
+  ~body_inflater() {
+    if (initialized) {
+      inflateEnd(&zs);
     }
   }
-  if (has_content_length && req_body.size() > content_length) {
-    req_body.resize(content_length);
+  static body_inflater& local() {
+    thread_local body_inflater inflater;
+    return inflater;
   }
-
-  return make_request_read_success(
-      keep_alive,
-      request(
-        req_method,
-        req_raw_path,
-        req_path,
-        std::move(req_uri_params),
-        std::move(req_headers),
-        std::move(req_body)));
-}
-
-typedef std::function<void(response_writer&, request&)> functor_writer;
-typedef std::function<std::string(request&)> functor_string;
-typedef std::function<response(request&)> functor_response;
-
-typedef struct _func_t {
-  functor_writer f_writer;
-  functor_string f_string;
-  functor_response f_response;
-  bool prefix_match;
-  int handle(int, request&, bool&) const;
-} func_t;
-
-inline int func_t::handle(int s, request& req, bool& keep_alive) const {
-  int code = 200;
-  const auto head_only = req.method == "HEAD";
-  if (f_string != nullptr) {
-    auto res = f_string(req);
-    std::string hdr;
-    hdr.reserve(128 + res.size());
-    hdr += "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=UTF-8\r\nConnection: ";
-    hdr += keep_alive ? "Keep-Alive" : "Close";
-    hdr += "\r\nContent-Length: ";
-    hdr += std::to_string(res.size());
-    hdr += "\r\n\r\n";
-    if (!head_only) {
-      hdr += res;
-    }
-    send(s, hdr.data(), (int) hdr.size(), MSG_NOSIGNAL);
-  } else if (f_writer != nullptr) {
-    response_writer writer(s, 200);
-    writer.head_only = head_only;
-    writer.set_header("Connection", "Close");
-    f_writer(writer, req);
-    keep_alive = false;
-    code = writer.code;
-  } else if (f_response != nullptr) {
-    auto res = f_response(req);
-    auto has_connection = false;
-    std::string hdr;
-    hdr.reserve(256 + res.content.size());
-    hdr += "HTTP/1.1 ";
-    hdr += std::to_string(res.code);
-    hdr += " ";
-    hdr += status_codes[res.code];
-    hdr += "\r\n";
-    for (auto& h : res.headers) {
-      auto key = camelize(h.first);
-      if (key == "Content-Length")
-        continue;
-      if (key == "Connection")
-        has_connection = true;
-      hdr += key;
-      hdr += ": ";
-      hdr += h.second;
-      hdr += "\r\n";
+  bool reset(int bits) {
+    if (initialized && bits == window_bits) {
+      return inflateReset(&zs) == Z_OK;
     }
-    if (!has_connection) {
-      hdr += "Connection: ";
-      hdr += keep_alive ? "Keep-Alive" : "Close";
-      hdr += "\r\n";
+    if (initialized) {
+      inflateEnd(&zs);
     }
-    hdr += "Content-Length: ";
-    hdr += std::to_string(res.content.size());
-    hdr += "\r\n\r\n";
-    if (!head_only) {
-      hdr += res.content;
+    zs = z_stream{};
+    initialized = inflateInit2(&zs, bits) == Z_OK;
+    window_bits = bits;
+    return initialized;
+  }
+  // Returns Z_OK while more input is expected, Z_STREAM_END once the
+  // stream is complete, or a negative zlib error. A false return from out
+  // stops inflating and is reported as Z_MEM_ERROR.
+  template <typename Out>
+  int feed(const char* data, size_t len, Out&& out) {
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs.avail_in = (uInt) len;
+    char chunk[16384];
+    while (true) {
+      zs.next_out = reinterpret_cast<Bytef*>(chunk);
+      zs.avail_out = sizeof(chunk);
+      auto ret = ::inflate(&zs, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+        return ret < 0 ? ret : Z_DATA_ERROR;
+      }
+      auto produced = sizeof(chunk) - zs.avail_out;
+      if (produced > 0 && !out(chunk, produced)) {
+        return Z_MEM_ERROR;
+      }
+      if (ret == Z_STREAM_END) {
+        return zs.avail_in > 0 ? Z_DATA_ERROR : Z_STREAM_END;
+      }
+      if (zs.avail_in == 0 && zs.avail_out != 0) {
+        return Z_OK;
+      }
+      if (ret == Z_BUF_ERROR) {
+        return Z_DATA_ERROR;
+      }
     }
-    send(s, hdr.data(), (int) hdr.size(), MSG_NOSIGNAL);
-    code = res.code;
   }
-  return code;
+};
+
+// "deflate" is meant to be zlib-wrapped, but some clients send a raw
+// deflate stream; a valid zlib header tells the two apart.
+inline int deflate_window_bits(const std::string& encoding, const char* data, size_t len) {
+  if (encoding != "deflate") {
+    return 15 + 16;
+  }
+  if (len >= 2) {
+    auto cmf = static_cast<unsigned char>(data[0]);
+    auto flg = static_cast<unsigned char>(data[1]);
+    if ((cmf & 0x0f) == 8 && ((cmf << 8) | flg) % 31 == 0) {
+      return 15;
+    }
+  }
+  return -15;
 }
 
-template <typename MatchFn>
-inline bool dispatch_request(
-    MatchFn&& match_fn,
+// Reads the remaining content_length bytes of an encoded body, inflating
+// them as they arrive. Returns 0 on success, an HTTP status on rejection
+// or -1 when the peer went away.
+inline int read_encoded_body(
     int s,
-    const std::string& remote,
-    request& req,
-    bool& keep_alive) {
-  if (!match_fn(req.method, req.uri, [&](const func_t& fn, const std::vector<std::string>& args) {
-    req.args = args;
-    int code = 500;
-    try {
-      code = fn.handle(s, req, keep_alive);
-#ifndef CLASK_DISABLE_LOGS
-      CLASK_LOG(clask::log_level::INFO) << remote << " " << code << " " << req.method << " " << req.uri;
+    const std::string& encoding,
+    size_t content_length,
+    std::string& buf,
+    std::string& req_body,
+    std::shared_ptr<request_body_storage>& body_storage,
+    const request_read_config& config) {
+  std::string decoded;
+  decoded_body_collector collector(decoded, body_storage, config);
+  auto& inflater = body_inflater::local();
+  auto initialized = false;
+  size_t consumed = 0;
+  auto ret = Z_OK;
+  auto out = [&](const char* data, size_t len) {
+    if (!collector.append(data, len)) {
+      return false;
+    }
+    if (config.max_decompression_ratio > 0
+        && collector.size() > decompression_ratio_floor
+        && collector.size() / config.max_decompression_ratio > consumed) {
+      collector.error = 413;
+      return false;
+    }
+    return true;
+  };
+  auto feed = [&](const char* data, size_t len) {
+    if (!initialized) {
+      initialized = inflater.reset(deflate_window_bits(encoding, data, len));
+      if (!initialized) {
+        return 503;
+      }
+    }
+    consumed += len;
+    ret = inflater.feed(data, len, out);
+    if (ret == Z_MEM_ERROR && collector.error != 0) {
+      return collector.error;
+    }
+    return ret == Z_OK || ret == Z_STREAM_END ? 0 : 400;
+  };
+
+  auto have = std::min(content_length, req_body.size());
+  if (have > 0) {
+    if (auto err = feed(req_body.data(), have)) {
+      return err;
+    }
+  }
+  auto rest = content_length - have;
+  buf.resize(std::max(buf.size(), body_scratch_buffer_size));
+  while (rest > 0) {
+    ssize_t rret;
+    while ((rret = recv(s, &buf[0], (int) std::min(rest, buf.size()), MSG_NOSIGNAL)) == -1 && errno == EINTR);
+    if (rret <= 0) {
+      return -1;
+    }
+    if (auto err = feed(buf.data(), (size_t) rret)) {
+      return err;
+    }
+    rest -= (size_t) rret;
+  }
+  if (content_length > 0 && ret != Z_STREAM_END) {
+    return 400;
+  }
+  if (!collector.finish()) {
+    return collector.error;
+  }
+  req_body = std::move(decoded);
+  return 0;
+}
 #endif
-    } catch (std::exception&) {
-#ifndef CLASK_DISABLE_LOGS
-      CLASK_LOG(clask::log_level::WARN) << remote << " " << code << " " << req.method << " " << req.uri;
+
+// Reads the rest of an unencoded body into req_body, or into a spill file
+// when it is larger than the spill threshold. Returns 0 on success, an
+// HTTP status on rejection or -1 when the peer went away.
+inline int read_identity_body(
+    int s,
+    bool has_content_length,
+    size_t content_length,
+    std::string& buf,
+    std::string& req_body,
+    std::shared_ptr<request_body_storage>& body_storage,
+    const request_read_config& config) {
+  ssize_t rret;
+#ifndef _WIN32
+  if (has_content_length
+      && config.body_spill_threshold > 0
+      && content_length > config.body_spill_threshold) {
+    body_storage = std::make_shared<request_body_storage>();
+    // Spill-file failures are I/O errors (500), not a lack of capacity.
+    body_storage->fd = create_spill_file();
+    if (body_storage->fd < 0) {
+      return 500;
+    }
+    auto rest = content_length;
+    auto have = std::min(content_length, req_body.size());
+    if (!write_all(body_storage->fd, req_body.data(), have)) {
+      return 500;
+    }
+    rest -= have;
+    req_body.clear();
+    buf.resize(std::max(buf.size(), body_scratch_buffer_size));
+    while (rest > 0) {
+      auto chunk_size = std::min(rest, buf.size());
+      while ((rret = recv(s, &buf[0], (int) chunk_size, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+      if (rret <= 0) {
+        return -1;
+      }
+      if (!write_all(body_storage->fd, buf.data(), (size_t) rret)) {
+        return 500;
+      }
+      rest -= (size_t) rret;
+    }
+    body_storage->map = mmap(nullptr, content_length, PROT_READ, MAP_PRIVATE, body_storage->fd, 0);
+    if (body_storage->map == MAP_FAILED) {
+      body_storage->map = nullptr;
+      return 500;
+    }
+    body_storage->size = content_length;
+  }
 #endif
-      keep_alive = false;
-      send_status_text_response(s, 500, keep_alive, req.method == "HEAD");
+
+  if (!body_storage && has_content_length && content_length > 0 && config.budget != nullptr) {
+    if (!config.budget->try_acquire(content_length)) {
+      return 503;
     }
-  })) {
-#ifndef CLASK_DISABLE_LOGS
-    CLASK_LOG(clask::log_level::WARN) << remote << " " << 404 << " " << req.method << " " << req.uri;
+    body_storage = std::make_shared<request_body_storage>();
+    body_storage->budget = config.budget;
+    body_storage->reserved = content_length;
+  }
+
+  if (has_content_length && (body_storage == nullptr || body_storage->map == nullptr)) {
+    if (req_body.size() < content_length) {
+      // Receive straight into the body instead of bouncing through buf.
+      auto have = req_body.size();
+      req_body.resize(content_length);
+      while (have < content_length) {
+        while ((rret = recv(s, &req_body[have], (int) (content_length - have), MSG_NOSIGNAL)) == -1 && errno == EINTR);
+        if (rret <= 0) {
+          return -1;
+        }
+        have += (size_t) rret;
+      }
+    }
+    if (req_body.size() > content_length) {
+      req_body.resize(content_length);
+    }
+  }
+
+  return 0;
+}
+
+// Adds the key=value pairs of a query string to params.
+inline void parse_query_params(const std::string& query, std::unordered_map<std::string, std::string>& params) {
+  std::istringstream iss(query);
+  std::string keyval, key, val;
+  while (std::getline(iss, keyval, '&')) {
+    std::istringstream isk(keyval);
+    if(std::getline(std::getline(isk, key, '='), val)) {
+      params[form_url_decode(key)] = form_url_decode(val);
+    }
+  }
+}
+
+inline request_read_result read_request_from_socket(int s, const request_read_config& config = {}) {
+  const auto max_header_size = config.max_header_size > 0 ? config.max_header_size : default_max_header_size;
+  const auto max_header_count = config.max_header_count > 0 ? config.max_header_count : default_max_header_count;
+  pooled_buffer pooled(std::max(initial_header_buffer_size, body_scratch_buffer_size));
+  auto& buf = pooled.buf;
+  thread_local std::vector<phr_header> headers;
+  if (headers.size() < max_header_count) {
+    headers.resize(max_header_count);
+  }
+  const char *method, *path;
+  int pret, minor_version;
+  size_t buflen = 0, prevbuflen = 0, method_len, path_len, num_headers;
+  ssize_t rret;
+
+  buf.resize(std::min(initial_header_buffer_size, max_header_size));
+  while (true) {
+    if (buflen == buf.size()) {
+      buf.resize(std::min(buf.size() * 2, max_header_size));
+    }
+    while ((rret = recv(s, &buf[buflen], (int) (buf.size() - buflen), MSG_NOSIGNAL)) == -1 && errno == EINTR);
+    if (rret <= 0) {
+      return make_request_read_error(0, "", "");
+    }
+
+    prevbuflen = buflen;
+    buflen += rret;
+    num_headers = max_header_count;
+    pret = phr_parse_request(
+        buf.data(), buflen, &method, &method_len, &path, &path_len,
+        &minor_version, headers.data(), &num_headers, prevbuflen);
+    if (pret > 0) {
+      break;
+    }
+    if (pret == -1) {
+      if (exceeds_header_count(buf.data(), buflen, max_header_count)) {
+        return make_request_read_error(431, "Request Header Fields Too Large", "Request Header Fields Too Large");
+      }
+      return make_request_read_error(400, "Bad Request", "Invalid Request");
+    }
+    if (buflen >= max_header_size) {
+      return make_request_read_error(431, "Request Header Fields Too Large", "Request Header Fields Too Large");
+    }
+  }
+
+  const std::string req_method(method, method_len);
+  std::string req_path(path, path_len);
+  std::string req_body(buf.data() + pret, buflen - pret);
+  const std::string req_raw_path = req_path;
+  std::unordered_map<std::string, std::string> req_uri_params;
+  std::vector<header> req_headers;
+
+  auto pos = req_path.find('?');
+  if (pos != std::string::npos) {
+    req_path.resize(pos);
+    parse_query_params(req_raw_path.substr(pos + 1), req_uri_params);
+  }
+
+  bool keep_alive = minor_version == 1;
+  bool has_content_length = false;
+  size_t content_length = 0;
+  std::string content_encoding;
+  for (size_t n = 0; n < num_headers; n++) {
+    auto key = std::string(headers[n].name, headers[n].name_len);
+    auto val = std::string(headers[n].value, headers[n].value_len);
+    camelize(key);
+    if (key == "Content-Length") {
+      auto parsed_content_length = parse_content_length(val);
+      if (!parsed_content_length.has_value()
+          || (has_content_length && *parsed_content_length != content_length)) {
+        return make_request_read_error(400, "Bad Request", "Invalid Content-Length");
+      }
+      content_length = *parsed_content_length;
+      has_content_length = true;
+    } else if (key == "Connection") {
+      for (auto& c : val) c = (char) std::tolower(static_cast<unsigned char>(c));
+      if (val == "keep-alive")
+        keep_alive = true;
+      else if (val == "close")
+        keep_alive = false;
+    } else if (key == "Content-Encoding") {
+      content_encoding = val;
+      trim_string(content_encoding);
+      for (auto& c : content_encoding) c = (char) std::tolower(static_cast<unsigned char>(c));
+    }
+    req_headers.emplace_back(std::move(key), std::move(val));
+  }
+
+  if (has_content_length && config.max_body_size > 0 && content_length > config.max_body_size) {
+    return make_request_read_error(413, "Payload Too Large", "Request Too Large");
+  }
+
+  if (has_content_length && content_length > 0
+      && (content_encoding.empty() || content_encoding == "identity")
+      && config.stream_body && config.stream_body(req_method, req_path)) {
+    if (req_body.size() > content_length) {
+      req_body.resize(content_length);
+    }
+    auto unread = content_length - req_body.size();
+    request req(
+        req_method,
+        req_raw_path,
+        req_path,
+        std::move(req_uri_params),
+        std::move(req_headers),
+        std::move(req_body));
+    req.minor_version = minor_version;
+    req.body_socket = s;
+    req.body_unread = unread;
+    return make_request_read_success(keep_alive, std::move(req));
+  }
+
+  std::shared_ptr<request_body_storage> body_storage;
+  int body_error = 0;
+  if (config.decompress && !content_encoding.empty() && content_encoding != "identity") {
+#ifdef CLASK_USE_ZLIB
+    if (content_encoding != "gzip" && content_encoding != "x-gzip" && content_encoding != "deflate") {
+      return make_request_read_error(415, "Unsupported Media Type", "Unsupported Content-Encoding");
+    }
+    // Only Content-Length framed bodies are read; an encoded body without
+    // one would otherwise reach the handler still compressed.
+    if (!has_content_length) {
+      return make_request_read_error(411, "Length Required", "Length Required");
+    }
+    body_error = read_encoded_body(s, content_encoding, content_length, buf, req_body, body_storage, config);
+    if (body_error == 0) {
+      auto decoded_size = body_storage && body_storage->map != nullptr ? body_storage->size : req_body.size();
+      req_headers.erase(
+          std::remove_if(req_headers.begin(), req_headers.end(), [](const header& h) {
+            return h.first == "Content-Encoding" || h.first == "Content-Length";
+          }),
+          req_headers.end());
+      req_headers.emplace_back("Content-Length", std::to_string(decoded_size));
+    }
+#else
+    // Without zlib nothing can be inflated; refuse rather than hand the
+    // handler compressed bytes.
+    return make_request_read_error(415, "Unsupported Media Type", "Unsupported Content-Encoding");
 #endif
-    send_status_text_response(s, 404, keep_alive, req.method == "HEAD");
+  } else {
+    body_error = read_identity_body(s, has_content_length, content_length, buf, req_body, body_storage, config);
   }
-  return keep_alive;
+  switch (body_error) {
+    case 0: break;
+    case -1: return make_request_read_error(0, "", "");
+    case 400: return make_request_read_error(400, "Bad Request", "Invalid Content-Encoding");
+    case 413: return make_request_read_error(413, "Payload Too Large", "Request Too Large");
+    case 500: return make_request_read_error(500, "Internal Server Error", "Internal Server Error");
+    default: return make_request_read_error(503, "Service Unavailable", "Service Unavailable");
+  }
+
+  request req(
+      req_method,
+      req_raw_path,
+      req_path,
+      std::move(req_uri_params),
+      std::move(req_headers),
+      std::move(req_body));
+  req.body_storage = std::move(body_storage);
+  req.minor_version = minor_version;
+  return make_request_read_success(keep_alive, std::move(req));
 }
 
-template <typename MatchFn>
-inline bool handle_connection_request(
-    int s,
-    const std::string& remote,
-    int socket_timeout_ms,
-    MatchFn&& match_fn) {
-  if (!set_socket_timeout(s, SO_RCVTIMEO, socket_timeout_ms)
-      || !set_socket_timeout(s, SO_SNDTIMEO, socket_timeout_ms)) {
-    closesocket(s);
-    return false;
+constexpr size_t max_route_params = 16;
+
+// Placeholder values of a matched route, as views into the request path.
+class route_args {
+private:
+  // Left uninitialized; only the first size_ values are ever read.
+  union {
+    std::string_view values_[max_route_params];
+  };
+  size_t size_ = 0;
+public:
+  route_args() { }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const std::string_view& operator[](size_t i) const { return values_[i]; }
+  const std::string_view* begin() const { return values_; }
+  const std::string_view* end() const { return values_ + size_; }
+  bool push(std::string_view v) {
+    if (size_ == max_route_params) {
+      return false;
+    }
+    values_[size_++] = v;
+    return true;
+  }
+  void resize(size_t n) { size_ = n; }
+  // Percent-decoded copies, as handlers see them in req.args.
+  std::vector<std::string> decode() const {
+    std::vector<std::string> ret;
+    ret.reserve(size_);
+    for (auto& v : *this) {
+      ret.emplace_back(url_decode(v));
+    }
+    return ret;
   }
+};
 
-  auto read_result = read_request_from_socket(s);
-  if (!read_result.ok) {
-#ifndef CLASK_DISABLE_LOGS
-    if (read_result.error_code == 400) {
-      CLASK_LOG(clask::log_level::ERR) << "invalid request";
-    } else if (read_result.error_code == 413) {
-      CLASK_LOG(clask::log_level::ERR) << "request is too long";
+struct response_write_config {
+  // Bytes a writer handler may buffer before they are sent; 0 writes
+  // through.
+  size_t output_buffer_size;
+  // Tag 200 responses from response handlers with a hash of their body.
+  bool etag_responses;
+  // Compress compressible bodies for clients that accept gzip or deflate.
+  bool compress;
+  int compression_level;
+  size_t compression_min_size;
+};
+
+typedef std::function<void(response_writer&, request&)> functor_writer;
+typedef std::function<std::string(request&)> functor_string;
+typedef std::function<response(request&)> functor_response;
+
+// Sends what a string handler returned as a text/plain response.
+inline int send_string_result(int s, request& req, bool& keep_alive, const response_write_config& config, const std::string& res) {
+  const auto head_only = req.method == "HEAD";
+  std::string_view body = res;
+  std::string hdr;
+  hdr.reserve(192);
+  hdr += "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=UTF-8\r\nConnection: ";
+  hdr += keep_alive ? "Keep-Alive" : "Close";
+  hdr += "\r\n";
+#ifdef CLASK_USE_ZLIB
+  std::string compressed;
+  if (config.compress) {
+    hdr += "Vary: Accept-Encoding\r\n";
+    auto coding = negotiate_response_encoding(req.header_value("Accept-Encoding"));
+    if (coding != nullptr && res.size() >= config.compression_min_size
+        && deflate_body(coding, config.compression_level, res, compressed)) {
+      append_header(hdr, "Content-Encoding", coding);
+      body = compressed;
     }
+  }
+#else
+  (void) config;
 #endif
-    if (read_result.error_code != 0) {
-      send_text_response(
-          s,
-          read_result.error_code,
-          read_result.error_reason,
-          read_result.error_body,
-          false);
+  hdr += "Content-Length: ";
+  append_number(hdr, body.size());
+  hdr += "\r\n";
+  hdr += http_date::header();
+  hdr += "\r\n";
+  if (!send_head_and_body(s, hdr, response_body(body), head_only)) {
+    keep_alive = false;
+  }
+  return 200;
+}
+
+// Sets up the writer a writer handler fills in.
+inline void prepare_handler_writer(response_writer& writer, request& req, bool keep_alive, const response_write_config& config) {
+  writer.head_only = req.method == "HEAD";
+  writer.auto_frame(keep_alive, req.minor_version >= 1);
+#ifdef CLASK_USE_ZLIB
+  if (config.compress) {
+    writer.compress(req.header_value("Accept-Encoding"), config.compression_level, config.compression_min_size);
+  }
+#else
+  (void) config;
+#endif
+}
+
+// Serializes and sends what a response handler returned.
+inline int send_response_result(int s, request& req, bool& keep_alive, const response_write_config& config, response res) {
+  const auto head_only = req.method == "HEAD";
+  auto has_connection = false, has_date = false;
+  std::string etag;
+  for (auto& h : res.headers) {
+    if (header_name_equals(h.first, "ETag")) {
+      etag = h.second;
     }
-    closesocket(s);
-    return false;
   }
+  if (etag.empty() && config.etag_responses && res.code == 200
+      && res.content.type() != response_body::kind::file) {
+    etag = content_etag(res.content.view());
+    res.headers.emplace_back("ETag", etag);
+  }
+  if (!etag.empty() && res.code == 200) {
+    auto if_none_match = req.header_value("If-None-Match");
+    if (!if_none_match.empty() && etag_matches(if_none_match, etag)) {
+      res.code = 304;
+      res.content = response_body();
+    }
+  }
+#ifdef CLASK_USE_ZLIB
+  if (config.compress && (res.code == 200 || res.code == 304)
+      && res.content.type() != response_body::kind::file) {
+    std::string_view content_type;
+    auto has_encoding = false;
+    for (auto& h : res.headers) {
+      if (header_name_equals(h.first, "Content-Type")) {
+        content_type = h.second;
+      } else if (header_name_equals(h.first, "Content-Encoding")) {
+        has_encoding = true;
+      }
+    }
+    if (!has_encoding && is_compressible_type(content_type)) {
+      vary_on_accept_encoding(res.headers);
+      auto coding = negotiate_response_encoding(req.header_value("Accept-Encoding"));
+      std::string compressed;
+      if (coding != nullptr && res.code == 200 && res.content.size() >= config.compression_min_size
+          && deflate_body(coding, config.compression_level, res.content.view(), compressed)) {
+        res.headers.emplace_back("Content-Encoding", coding);
+        weaken_etag(res.headers);
+        res.content = std::move(compressed);
+      }
+    }
+  }
+#endif
+  if (!has_response_body(res.code)) {
+    res.content = response_body();
+  }
+  std::string hdr;
+  hdr.reserve(256);
+  append_status_line(hdr, res.code);
+  for (auto& h : res.headers) {
+    auto key = camelize(h.first);
+    if (key == "Content-Length")
+      continue;
+    if (res.code == 304 && key == "Content-Type")
+      continue;
+    if (key == "Connection")
+      has_connection = true;
+    if (key == "Date")
+      has_date = true;
+    append_header(hdr, key, h.second);
+  }
+  if (!has_connection) {
+    append_header(hdr, "Connection", keep_alive ? "Keep-Alive" : "Close");
+  }
+  if (!has_date) {
+    hdr += http_date::header();
+  }
+  append_content_length(hdr, res.code, res.content.size());
+  hdr += "\r\n";
+  if (!send_head_and_body(s, hdr, res.content, head_only)) {
+    keep_alive = false;
+  }
+  return res.code;
+}
 
-  auto req = std::move(*read_result.req);
-  auto keep_alive = read_result.keep_alive;
-  dispatch_request(
-      std::forward<MatchFn>(match_fn),
-      s,
-      remote,
-      req,
-      keep_alive);
-  if (!keep_alive) {
-    closesocket(s);
+template <typename F>
+inline int invoke_string_handler(F& f, int s, request& req, bool& keep_alive, const response_write_config& config) {
+  return send_string_result(s, req, keep_alive, config, f(req));
+}
+
+template <typename F>
+inline int invoke_writer_handler(F& f, int s, request& req, bool& keep_alive, const response_write_config& config) {
+  response_writer writer(s, 200, config.output_buffer_size);
+  prepare_handler_writer(writer, req, keep_alive, config);
+  f(writer, req);
+  keep_alive = writer.finish();
+  return writer.code;
+}
+
+template <typename F>
+inline int invoke_response_handler(F& f, int s, request& req, bool& keep_alive, const response_write_config& config) {
+  return send_response_result(s, req, keep_alive, config, f(req));
+}
+
+template <typename F>
+inline int invoke_raw_handler(F& f, int s, request& req, bool& keep_alive, const response_write_config& config) {
+  return f(s, req, keep_alive, config);
+}
+
+// A response serialized once, when it is registered, in a keep-alive and
+// a close variant. Only Date changes between requests: it is sent from
+// http_date's per-second cache as a slice between the header lines and
+// the rest, so a request is one gathered send of immutable bytes and HEAD
+// stops before the body. ETag, compression and conditional requests are
+// not applied; the headers are sent as given.
+class constant_response {
+private:
+  struct serialized {
+    std::string bytes;
+    // Where the Date line goes, or npos when the response sets its own.
+    size_t date_offset;
+    // Where the body starts.
+    size_t body_offset;
+  };
+  struct variants {
+    int code;
+    serialized keep_alive;
+    serialized close;
+  };
+  std::shared_ptr<const variants> variants_;
+  static serialized serialize(const response& res, bool keep_alive) {
+    serialized out{};
+    auto has_connection = false, has_date = false;
+    append_status_line(out.bytes, res.code);
+    for (auto& h : res.headers) {
+      auto key = h.first;
+      camelize(key);
+      if (key == "Content-Length")
+        continue;
+      if (key == "Connection")
+        has_connection = true;
+      if (key == "Date")
+        has_date = true;
+      append_header(out.bytes, key, h.second);
+    }
+    if (!has_connection) {
+      append_header(out.bytes, "Connection", keep_alive ? "Keep-Alive" : "Close");
+    }
+    append_content_length(out.bytes, res.code, res.content.size());
+    out.date_offset = has_date ? std::string::npos : out.bytes.size();
+    out.bytes += "\r\n";
+    out.body_offset = out.bytes.size();
+    if (has_response_body(res.code)) {
+      out.bytes += res.content.view();
+    }
+    return out;
   }
-  return keep_alive;
+public:
+  // Throws std::invalid_argument for a file body.
+  explicit constant_response(const response& res) {
+    if (res.content.type() == response_body::kind::file) {
+      throw std::invalid_argument("constant response body must be in memory");
+    }
+    variants_ = std::make_shared<const variants>(variants{
+      .code = res.code,
+      .keep_alive = serialize(res, true),
+      .close = serialize(res, false),
+    });
+  }
+  int operator()(int s, request& req, bool& keep_alive, const response_write_config&) const {
+    auto& v = keep_alive ? variants_->keep_alive : variants_->close;
+    auto end = req.method == "HEAD" ? v.body_offset : v.bytes.size();
+    if (v.date_offset == std::string::npos) {
+      if (!send_all(s, v.bytes.data(), end)) {
+        keep_alive = false;
+      }
+      return variants_->code;
+    }
+    auto date = http_date::header();
+    io_slice slices[3] = {
+      {v.bytes.data(), v.date_offset},
+      {date.data(), date.size()},
+      {v.bytes.data() + v.date_offset, end - v.date_offset},
+    };
+    if (!send_slices(s, slices, 3)) {
+      keep_alive = false;
+    }
+    return variants_->code;
+  }
+};
+
+template <typename F>
+struct inline_handler_t {
+  F fn;
+  template <typename... A>
+  auto operator()(A&&... a) -> decltype(fn(std::forward<A>(a)...)) {
+    return fn(std::forward<A>(a)...);
+  }
+};
+
+// Marks a handler as reactor-inline: a request for its route that has no
+// body is parsed and answered on the event loop thread, without a worker
+// handoff. The handler runs with every other connection waiting on it,
+// so it must not block and should only build a small response, as health
+// checks and canned answers do.
+template <typename F>
+inline inline_handler_t<std::decay_t<F>> inline_handler(F&& fn) {
+  return inline_handler_t<std::decay_t<F>>{std::forward<F>(fn)};
+}
+
+template <typename Route, typename F>
+struct typed_route_handler;
+
+template <typename F>
+struct is_reactor_inline : std::false_type { };
+
+template <typename F>
+struct is_reactor_inline<inline_handler_t<F>> : std::true_type { };
+
+template <typename Route, typename F>
+struct is_reactor_inline<typed_route_handler<Route, F>> : is_reactor_inline<F> { };
+
+template <typename F>
+struct stream_body_t {
+  F fn;
+  template <typename... A>
+  auto operator()(A&&... a) -> decltype(fn(std::forward<A>(a)...)) {
+    return fn(std::forward<A>(a)...);
+  }
+};
+
+// Marks a handler as reading its body as it arrives. The body of a
+// request with a Content-Length is left on the socket, and
+// request::parse_multipart feeds it to the parser chunk by chunk, so an
+// upload never sits in memory or a spill file.
+template <typename F>
+inline stream_body_t<std::decay_t<F>> stream_body(F&& fn) {
+  return stream_body_t<std::decay_t<F>>{std::forward<F>(fn)};
+}
+
+template <typename F>
+struct is_body_streaming : std::false_type { };
+
+template <typename F>
+struct is_body_streaming<stream_body_t<F>> : std::true_type { };
+
+template <typename Route, typename F>
+struct is_body_streaming<typed_route_handler<Route, F>> : is_body_streaming<F> { };
+
+// A route handler. The callable is stored in an inline buffer (or on the
+// heap when it does not fit) next to an adapter chosen at compile time
+// from its signature:
+//
+//   void(response_writer&, request&)   writes the response itself
+//   response(request&)                 returns a status, body and headers
+//   std::string(request&)              returns a text/plain body
+//   int(int, request&, bool&, const response_write_config&)
+//                                      sends the response on the socket
+//                                      and returns its status code
+//
+// so handle() is a single indirect call. func_t is move-only.
+class func_t {
+private:
+  static constexpr size_t inline_size = 48;
+  struct ops_t {
+    int (*invoke)(void*, int, request&, bool&, const response_write_config&);
+    void (*move)(void*, void*);
+    void (*destroy)(void*);
+  };
+  template <typename F>
+  static constexpr bool fits_inline =
+      sizeof(F) <= inline_size
+      && alignof(F) <= alignof(std::max_align_t)
+      && std::is_nothrow_move_constructible_v<F>;
+  template <typename F>
+  static F& target(void* p) {
+    if constexpr (fits_inline<F>) {
+      return *std::launder(static_cast<F*>(p));
+    } else {
+      return **static_cast<F**>(p);
+    }
+  }
+  template <typename F, int (*Invoke)(F&, int, request&, bool&, const response_write_config&)>
+  static const ops_t* ops_for() {
+    static constexpr ops_t ops{
+      [](void* p, int s, request& req, bool& keep_alive, const response_write_config& config) {
+        return Invoke(target<F>(p), s, req, keep_alive, config);
+      },
+      [](void* from, void* to) {
+        if constexpr (fits_inline<F>) {
+          new (to) F(std::move(target<F>(from)));
+          target<F>(from).~F();
+        } else {
+          *static_cast<F**>(to) = *static_cast<F**>(from);
+        }
+      },
+      [](void* p) {
+        if constexpr (fits_inline<F>) {
+          target<F>(p).~F();
+        } else {
+          delete *static_cast<F**>(p);
+        }
+      },
+    };
+    return &ops;
+  }
+  alignas(std::max_align_t) mutable unsigned char storage_[inline_size];
+  const ops_t* ops_ = nullptr;
+public:
+  // Mounts such as static_dir also handle every path below their own.
+  bool prefix_match = false;
+  // Set for handlers wrapped by inline_handler().
+  bool reactor_inline = false;
+  // Set for handlers wrapped by stream_body().
+  bool streams_body = false;
+  func_t() { }
+  template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, func_t>>>
+  func_t(F&& f)
+    : reactor_inline(is_reactor_inline<std::decay_t<F>>::value),
+      streams_body(is_body_streaming<std::decay_t<F>>::value) {
+    using T = std::decay_t<F>;
+    if constexpr (fits_inline<T>) {
+      new (storage_) T(std::forward<F>(f));
+    } else {
+      *reinterpret_cast<T**>(storage_) = new T(std::forward<F>(f));
+    }
+    if constexpr (std::is_invocable_r_v<int, T&, int, request&, bool&, const response_write_config&>) {
+      ops_ = ops_for<T, invoke_raw_handler<T>>();
+    } else if constexpr (std::is_invocable_v<T&, response_writer&, request&>) {
+      ops_ = ops_for<T, invoke_writer_handler<T>>();
+    } else if constexpr (std::is_same_v<std::decay_t<std::invoke_result_t<T&, request&>>, response>) {
+      ops_ = ops_for<T, invoke_response_handler<T>>();
+    } else {
+      static_assert(
+          std::is_convertible_v<std::invoke_result_t<T&, request&>, std::string>,
+          "handlers take (response_writer&, request&) or (request&) and return response or a string");
+      ops_ = ops_for<T, invoke_string_handler<T>>();
+    }
+  }
+  func_t(func_t&& other) noexcept
+    : prefix_match(other.prefix_match), reactor_inline(other.reactor_inline), streams_body(other.streams_body) {
+    if (other.ops_ != nullptr) {
+      other.ops_->move(other.storage_, storage_);
+      ops_ = other.ops_;
+      other.ops_ = nullptr;
+    }
+  }
+  func_t& operator =(func_t&& other) noexcept {
+    if (this != &other) {
+      this->~func_t();
+      new (this) func_t(std::move(other));
+    }
+    return *this;
+  }
+  func_t(const func_t&) = delete;
+  func_t& operator =(const func_t&) = delete;
+  ~func_t() {
+    if (ops_ != nullptr) {
+      ops_->destroy(storage_);
+    }
+  }
+  explicit operator bool() const {
+    return ops_ != nullptr;
+  }
+  int handle(int s, request& req, bool& keep_alive, const response_write_config& config = {}) const {
+    return ops_->invoke(storage_, s, req, keep_alive, config);
+  }
+};
+
+// A placeholder constraint, written after the name in angle brackets and
+// checked while a path is matched:
+//
+//   :id<int>              an optional '-' and decimal digits
+//   :id<uuid>             8-4-4-4-12 hex digits
+//   :slug<[a-z0-9-]+>     one or more characters of a class; '*' instead
+//                         of '+' also accepts an empty segment, [^...]
+//                         negates the class and '\' escapes a character
+class segment_constraint {
+public:
+  enum class kind {
+    any,
+    integer,
+    uuid,
+    char_class,
+  };
+private:
+  kind kind_ = kind::any;
+  std::uint64_t bits_[4] = {};
+  bool allow_empty_ = true;
+  static constexpr bool is_hex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+  }
+  constexpr void set(unsigned char c) {
+    bits_[c >> 6] |= (std::uint64_t) 1 << (c & 63);
+  }
+  constexpr bool test(unsigned char c) const {
+    return (bits_[c >> 6] >> (c & 63)) & 1;
+  }
+public:
+  constexpr segment_constraint() { }
+  // spec is the text between the angle brackets. Throws on a malformed
+  // one, which is a compile error in a constant expression.
+  constexpr explicit segment_constraint(std::string_view spec) {
+    if (spec == "int") {
+      kind_ = kind::integer;
+      allow_empty_ = false;
+      return;
+    }
+    if (spec == "uuid") {
+      kind_ = kind::uuid;
+      allow_empty_ = false;
+      return;
+    }
+    if (spec.size() < 3 || spec[0] != '[' || (spec.back() != '+' && spec.back() != '*') || spec[spec.size() - 2] != ']') {
+      throw std::invalid_argument("route placeholder type is unknown");
+    }
+    kind_ = kind::char_class;
+    allow_empty_ = spec.back() == '*';
+    auto body = spec.substr(1, spec.size() - 3);
+    auto negate = !body.empty() && body[0] == '^';
+    if (negate) {
+      body.remove_prefix(1);
+    }
+    if (body.empty()) {
+      throw std::invalid_argument("route placeholder class is empty");
+    }
+    for (size_t i = 0; i < body.size(); i++) {
+      auto lo = (unsigned char) body[i];
+      if (lo == '\\') {
+        if (++i == body.size()) {
+          throw std::invalid_argument("route placeholder class ends with '\\'");
+        }
+        lo = (unsigned char) body[i];
+      }
+      auto hi = lo;
+      if (i + 2 < body.size() && body[i + 1] == '-') {
+        hi = (unsigned char) body[i + 2];
+        if (hi < lo) {
+          throw std::invalid_argument("route placeholder class has a reversed range");
+        }
+        i += 2;
+      }
+      for (unsigned c = lo; c <= hi; c++) {
+        set((unsigned char) c);
+      }
+    }
+    if (negate) {
+      for (auto& b : bits_) {
+        b = ~b;
+      }
+    }
+    // A segment never contains '/'.
+    bits_['/' >> 6] &= ~((std::uint64_t) 1 << ('/' & 63));
+  }
+  constexpr kind type() const {
+    return kind_;
+  }
+  constexpr bool accepts(std::string_view v) const {
+    if (v.empty()) {
+      return allow_empty_;
+    }
+    switch (kind_) {
+      case kind::any:
+        return true;
+      case kind::integer: {
+        size_t i = v[0] == '-' ? 1 : 0;
+        if (i == v.size()) {
+          return false;
+        }
+        for (; i < v.size(); i++) {
+          if (v[i] < '0' || v[i] > '9') {
+            return false;
+          }
+        }
+        return true;
+      }
+      case kind::uuid:
+        if (v.size() != 36) {
+          return false;
+        }
+        for (size_t i = 0; i < v.size(); i++) {
+          if (i == 8 || i == 13 || i == 18 || i == 23 ? v[i] != '-' : !is_hex(v[i])) {
+            return false;
+          }
+        }
+        return true;
+      case kind::char_class:
+        for (auto c : v) {
+          if (!test((unsigned char) c)) {
+            return false;
+          }
+        }
+        return true;
+    }
+    return false;
+  }
+};
+
+// Splits a placeholder segment, without its leading ':', into the name
+// and the constraint spec between angle brackets (empty if none).
+constexpr std::pair<std::string_view, std::string_view> split_placeholder(std::string_view segment) {
+  auto open = segment.find('<');
+  if (open == std::string_view::npos) {
+    return {segment, {}};
+  }
+  if (segment.back() != '>') {
+    throw std::invalid_argument("route placeholder type is not closed");
+  }
+  return {segment.substr(0, open), segment.substr(open + 1, segment.size() - open - 2)};
+}
+
+// Compile-time route patterns. A pattern is parsed in a constant
+// expression, so a malformed one fails the build instead of turning into
+// a route that never matches:
+//
+//   s.GET(CLASK_ROUTE("/zoo/:name/:id<int>"), [](request& req, std::string name, std::int64_t id) {
+//     ...
+//   });
+//
+// ":name" captures a percent-decoded std::string and ":name<int>" a
+// std::int64_t parsed with from_chars; other constraints (see
+// segment_constraint) capture a std::string. A capture that does not
+// parse, such as an integer out of range, answers 404 without running
+// the handler.
+enum class route_param_kind {
+  string,
+  integer,
+};
+
+struct route_pattern {
+  // Literal text before each capture, then after the last one.
+  std::string_view literals[max_route_params + 1];
+  std::string_view names[max_route_params];
+  route_param_kind kinds[max_route_params];
+  segment_constraint constraints[max_route_params];
+  size_t param_count;
+};
+
+constexpr bool is_route_name_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Throws on a malformed pattern, which is a compile error when evaluated
+// as a constant expression.
+constexpr route_pattern parse_route_pattern(std::string_view path) {
+  route_pattern p{};
+  if (path.empty() || path[0] != '/') {
+    throw std::invalid_argument("route pattern must start with '/'");
+  }
+  size_t literal_start = 0;
+  size_t i = 0;
+  while (i < path.size()) {
+    if (path[i] == '/' && i + 1 < path.size() && path[i + 1] == '/') {
+      throw std::invalid_argument("route pattern has an empty segment");
+    }
+    if (path[i] != ':' || path[i - 1] != '/') {
+      if (path[i] == '<' || path[i] == '>') {
+        throw std::invalid_argument("route pattern has a type outside a placeholder");
+      }
+      i++;
+      continue;
+    }
+    if (p.param_count == max_route_params) {
+      throw std::invalid_argument("route pattern has too many placeholders");
+    }
+    p.literals[p.param_count] = path.substr(literal_start, i - literal_start);
+    auto name_start = ++i;
+    while (i < path.size() && is_route_name_char(path[i])) {
+      i++;
+    }
+    auto name = path.substr(name_start, i - name_start);
+    if (name.empty()) {
+      throw std::invalid_argument("route placeholder has no name");
+    }
+    for (size_t k = 0; k < p.param_count; k++) {
+      if (p.names[k] == name) {
+        throw std::invalid_argument("route placeholder name is used twice");
+      }
+    }
+    segment_constraint constraint;
+    if (i < path.size() && path[i] == '<') {
+      auto end = std::min(path.find('/', i), path.size());
+      constraint = segment_constraint(split_placeholder(path.substr(i, end - i)).second);
+      i = end;
+    }
+    if (i < path.size() && path[i] != '/') {
+      throw std::invalid_argument("route placeholder must end its segment");
+    }
+    p.names[p.param_count] = name;
+    p.kinds[p.param_count] = constraint.type() == segment_constraint::kind::integer ? route_param_kind::integer : route_param_kind::string;
+    p.constraints[p.param_count] = constraint;
+    p.param_count++;
+    literal_start = i;
+  }
+  p.literals[p.param_count] = path.substr(literal_start);
+  return p;
+}
+
+template <route_param_kind>
+struct route_param_type {
+  typedef std::string type;
+};
+
+template <>
+struct route_param_type<route_param_kind::integer> {
+  typedef std::int64_t type;
+};
+
+template <typename F, typename Args>
+struct is_typed_writer_handler;
+
+template <typename F, typename... Args>
+struct is_typed_writer_handler<F, std::tuple<Args...>> : std::is_invocable<F&, response_writer&, request&, Args...> { };
+
+// A route declared with CLASK_ROUTE. Path is a type whose static path()
+// returns the pattern.
+template <typename Path>
+class route {
+public:
+  static constexpr route_pattern pattern = parse_route_pattern(Path::path());
+private:
+  template <size_t... I>
+  static auto args_tuple(std::index_sequence<I...>)
+      -> std::tuple<typename route_param_type<pattern.kinds[I]>::type...>;
+  template <size_t I, typename Tuple>
+  static bool parse_arg(std::string_view v, [[maybe_unused]] bool decode, Tuple& out) {
+    if constexpr (pattern.kinds[I] == route_param_kind::integer) {
+      auto& n = std::get<I>(out);
+      auto r = std::from_chars(v.data(), v.data() + v.size(), n);
+      return !v.empty() && r.ec == std::errc() && r.ptr == v.data() + v.size();
+    } else {
+      std::get<I>(out) = decode ? url_decode(v) : std::string(v);
+      return true;
+    }
+  }
+  template <typename Seq, typename Tuple, size_t... I>
+  static std::optional<Tuple> parse_args(const Seq& values, [[maybe_unused]] bool decode, std::index_sequence<I...>) {
+    Tuple out;
+    if (values.size() != pattern.param_count || !(parse_arg<I>(values[I], decode, out) && ...)) {
+      return std::nullopt;
+    }
+    return out;
+  }
+public:
+  typedef decltype(args_tuple(std::make_index_sequence<pattern.param_count>())) args_type;
+  static constexpr std::string_view path() {
+    return Path::path();
+  }
+  // Converts already decoded captures, such as request::args.
+  static std::optional<args_type> parse(const std::vector<std::string>& values) {
+    return parse_args<std::vector<std::string>, args_type>(values, false, std::make_index_sequence<pattern.param_count>());
+  }
+  // Matches a request path against the pattern alone.
+  static std::optional<args_type> match(std::string_view uri) {
+    route_args values;
+    for (size_t i = 0; i < pattern.param_count; i++) {
+      auto& literal = pattern.literals[i];
+      if (uri.substr(0, literal.size()) != literal) {
+        return std::nullopt;
+      }
+      uri.remove_prefix(literal.size());
+      auto end = std::min(uri.find('/'), uri.size());
+      if (end == 0 || !pattern.constraints[i].accepts(uri.substr(0, end))) {
+        return std::nullopt;
+      }
+      values.push(uri.substr(0, end));
+      uri.remove_prefix(end);
+    }
+    if (uri != pattern.literals[pattern.param_count]) {
+      return std::nullopt;
+    }
+    return parse_args<route_args, args_type>(values, true, std::make_index_sequence<pattern.param_count>());
+  }
+};
+
+// Runs a handler whose trailing parameters are a route's typed captures.
+template <typename Route, typename F>
+struct typed_route_handler {
+  F fn;
+  int operator()(int s, request& req, bool& keep_alive, const response_write_config& config) {
+    auto args = Route::parse(req.args);
+    if (!args) {
+      send_status_text_response(s, 404, keep_alive, req.method == "HEAD");
+      return 404;
+    }
+    auto call = [&](auto&... head) {
+      return std::apply([&](auto&... a) { return fn(head..., std::move(a)...); }, *args);
+    };
+    if constexpr (is_typed_writer_handler<F, typename Route::args_type>::value) {
+      auto bound = [&](response_writer& writer, request& r) { call(writer, r); };
+      return invoke_writer_handler(bound, s, req, keep_alive, config);
+    } else if constexpr (std::is_same_v<std::decay_t<decltype(call(req))>, response>) {
+      auto bound = [&](request& r) { return call(r); };
+      return invoke_response_handler(bound, s, req, keep_alive, config);
+    } else {
+      auto bound = [&](request& r) -> std::string { return call(r); };
+      return invoke_string_handler(bound, s, req, keep_alive, config);
+    }
+  }
+};
+
+#define CLASK_ROUTE(p) \
+  ([] { \
+    struct clask_route_path { \
+      static constexpr std::string_view path() { return p; } \
+    }; \
+    return ::clask::route<clask_route_path>(); \
+  }())
+
+class middleware_next;
+
+// A hook run around route handlers. It calls next() to run the rest of
+// the chain and the handler, or answers the request itself, and returns
+// the status code that was sent.
+typedef std::function<int(request&, const middleware_next&)> middleware_fn;
+
+// Whether path is prefix or below it. "/" covers every path.
+inline bool path_has_prefix(std::string_view path, std::string_view prefix) {
+  return prefix == "/" || (path.substr(0, prefix.size()) == prefix
+      && (path.size() == prefix.size() || path[prefix.size()] == '/'));
+}
+
+// The request path as handlers resolve it: percent-decoded, with empty
+// and "." segments dropped and ".." applied, so "/%61dmin", "//admin" and
+// "/./admin" all compare as "/admin" against a hook's prefix.
+inline std::string canonical_path(std::string_view uri) {
+  auto decoded = url_decode(uri);
+  std::string out;
+  out.reserve(decoded.size() + 1);
+  size_t i = 0;
+  while (i < decoded.size()) {
+    auto end = decoded.find('/', i);
+    if (end == std::string::npos) {
+      end = decoded.size();
+    }
+    std::string_view seg(decoded.data() + i, end - i);
+    if (seg == "..") {
+      auto pos = out.rfind('/');
+      out.resize(pos == std::string::npos ? 0 : pos);
+    } else if (!seg.empty() && seg != ".") {
+      out += '/';
+      out += seg;
+    }
+    i = end + 1;
+  }
+  if (out.empty()) {
+    out = "/";
+  }
+  return out;
+}
+
+struct middleware_hook {
+  std::shared_ptr<const middleware_fn> fn;
+  // Checked against the request path when the route's pattern cannot
+  // decide it; empty when the hook always applies to the route.
+  std::string prefix;
+};
+
+// The rest of a middleware chain. It only points into the chain and the
+// request, so calling through it allocates nothing.
+class middleware_next {
+private:
+  const middleware_hook* hooks_;
+  size_t count_;
+  const func_t* handler_;
+  int s_;
+  request* req_;
+  bool* keep_alive_;
+  const response_write_config* config_;
+  // What scoped hooks' prefixes are checked against.
+  std::string_view path_;
+public:
+  middleware_next(
+      const middleware_hook* hooks,
+      size_t count,
+      const func_t& handler,
+      int s,
+      request& req,
+      bool& keep_alive,
+      const response_write_config& config,
+      std::string_view path)
+    : hooks_(hooks), count_(count), handler_(&handler), s_(s), req_(&req), keep_alive_(&keep_alive), config_(&config), path_(path) { }
+  int operator()() const {
+    auto rest = *this;
+    while (rest.count_ > 0) {
+      auto& hook = *rest.hooks_;
+      rest.hooks_++;
+      rest.count_--;
+      if (hook.prefix.empty() || path_has_prefix(path_, hook.prefix)) {
+        return (*hook.fn)(*req_, rest);
+      }
+    }
+    return handler_->handle(s_, *req_, *keep_alive_, *config_);
+  }
+  // Answers the request instead of calling the handler.
+  int send(response res) const {
+    return send_response_result(s_, *req_, *keep_alive_, *config_, std::move(res));
+  }
+};
+
+// A route handler with the hooks that apply to its path.
+struct middleware_chain {
+  std::vector<middleware_hook> hooks;
+  std::shared_ptr<const func_t> handler;
+  // Whether any hook is checked against the request path.
+  bool scoped = false;
+  int operator()(int s, request& req, bool& keep_alive, const response_write_config& config) const {
+    std::string path;
+    if (scoped) {
+      path = canonical_path(req.uri);
+    }
+    return middleware_next(hooks.data(), hooks.size(), *handler, s, req, keep_alive, config, path)();
+  }
+};
+
+// Middleware registered on a server, in the order it runs. Each hook is
+// scoped to a path prefix; "/" applies to every route.
+class middleware_stack {
+private:
+  struct entry {
+    std::string prefix;
+    std::shared_ptr<const middleware_fn> fn;
+  };
+  std::vector<entry> entries_;
+public:
+  void add(std::string prefix, middleware_fn fn) {
+    while (prefix.size() > 1 && prefix.back() == '/') {
+      prefix.pop_back();
+    }
+    entries_.push_back({std::move(prefix), std::make_shared<const middleware_fn>(std::move(fn))});
+  }
+  bool empty() const {
+    return entries_.empty();
+  }
+  // Returns the handler itself when no hook applies to path, the route's
+  // pattern. A hook whose prefix the pattern lies under always runs. On
+  // placeholder and prefix routes, which also serve paths the pattern
+  // does not spell out (/admin/x through /:page or a static_dir on "/"),
+  // any other hook is checked against the canonical request path at
+  // dispatch.
+  std::shared_ptr<const func_t> wrap(std::string_view path, const std::shared_ptr<const func_t>& fn) const {
+    auto dynamic = fn->prefix_match || path.find("/:") != std::string_view::npos;
+    middleware_chain chain;
+    for (auto& e : entries_) {
+      if (path_has_prefix(path, e.prefix)) {
+        chain.hooks.push_back({e.fn, std::string()});
+      } else if (dynamic) {
+        chain.hooks.push_back({e.fn, e.prefix});
+        chain.scoped = true;
+      }
+    }
+    if (chain.hooks.empty()) {
+      return fn;
+    }
+    chain.handler = fn;
+    auto wrapped = std::make_shared<func_t>(std::move(chain));
+    wrapped->prefix_match = fn->prefix_match;
+    wrapped->reactor_inline = fn->reactor_inline;
+    wrapped->streams_body = fn->streams_body;
+    return wrapped;
+  }
+};
+
+template <typename MatchFn>
+inline bool dispatch_request(
+    MatchFn&& match_fn,
+    int s,
+    const std::string& remote,
+    request& req,
+    bool& keep_alive,
+    const response_write_config& write_config = {}) {
+  route_method_set allowed = 0;
+#ifndef CLASK_DISABLE_LOGS
+  auto start = std::chrono::steady_clock::now();
+  auto sent = socket_bytes_sent();
+  auto log_access = [&](log_level level, int code) {
+    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    access_log::instance().write(
+        level, remote, code, req.method, req.uri,
+        (std::uint32_t) std::min<long long>(latency.count(), UINT32_MAX),
+        socket_bytes_sent() - sent);
+  };
+#endif
+  if (!match_fn(req.method, req.uri, allowed, [&](const func_t& fn, const route_args& args) {
+    req.args = args.decode();
+    int code = 500;
+    try {
+      code = fn.handle(s, req, keep_alive, write_config);
+      // The next request cannot be found behind a body left unread.
+      if (req.body_unread > 0) {
+        keep_alive = false;
+      }
+#ifndef CLASK_DISABLE_LOGS
+      log_access(log_level::INFO, code);
+#endif
+    } catch (std::exception&) {
+      keep_alive = false;
+      send_status_text_response(s, 500, keep_alive, req.method == "HEAD");
+#ifndef CLASK_DISABLE_LOGS
+      log_access(log_level::WARN, code);
+#endif
+    }
+  })) {
+    // Unknown methods are 501, known ones on a routed path 405 (or an
+    // automatic OPTIONS response), and anything else 404.
+    int code = 404;
+    if (!parse_route_method(req.method)) {
+      code = 501;
+      send_status_text_response(s, code, keep_alive, false);
+    } else if (allowed != 0) {
+      code = send_allow_response(s, req.method, allowed, keep_alive);
+    } else {
+      send_status_text_response(s, code, keep_alive, req.method == "HEAD");
+    }
+#ifndef CLASK_DISABLE_LOGS
+    log_access(code == 204 ? log_level::INFO : log_level::WARN, code);
+#endif
+  }
+  return keep_alive;
+}
+
+template <typename MatchFn>
+inline bool handle_connection_request(
+    int s,
+    const std::string& remote,
+    int socket_timeout_ms,
+    const request_read_config& read_config,
+    const response_write_config& write_config,
+    MatchFn&& match_fn) {
+  if (!set_socket_timeout(s, SO_RCVTIMEO, socket_timeout_ms)
+      || !set_socket_timeout(s, SO_SNDTIMEO, socket_timeout_ms)) {
+    closesocket(s);
+    return false;
+  }
+
+  auto read_result = read_request_from_socket(s, read_config);
+  if (!read_result.ok) {
+#ifndef CLASK_DISABLE_LOGS
+    if (read_result.error_code == 400) {
+      CLASK_LOG(clask::log_level::ERR) << "invalid request";
+    } else if (read_result.error_code == 413) {
+      CLASK_LOG(clask::log_level::ERR) << "request is too long";
+    } else if (read_result.error_code == 415) {
+      CLASK_LOG(clask::log_level::ERR) << "unsupported content-encoding";
+    } else if (read_result.error_code == 431) {
+      CLASK_LOG(clask::log_level::ERR) << "request headers are too large";
+    } else if (read_result.error_code == 500) {
+      CLASK_LOG(clask::log_level::ERR) << "request body spill file I/O failed";
+    } else if (read_result.error_code == 503) {
+      CLASK_LOG(clask::log_level::WARN) << "request body rejected: memory budget exhausted";
+    }
+#endif
+    if (read_result.error_code != 0) {
+      send_text_response(
+          s,
+          read_result.error_code,
+          read_result.error_reason,
+          read_result.error_body,
+          false);
+    }
+    closesocket(s);
+    return false;
+  }
+
+  auto req = std::move(*read_result.req);
+  auto keep_alive = read_result.keep_alive;
+  dispatch_request(
+      std::forward<MatchFn>(match_fn),
+      s,
+      remote,
+      req,
+      keep_alive,
+      write_config);
+  if (!keep_alive) {
+    closesocket(s);
+  }
+  return keep_alive;
+}
+
+// A small static file held in memory together with its serialized header
+// lines, so a hit is answered with one write and no filesystem access.
+struct cached_file {
+  file_info info;
+  std::string body;
+  std::string etag;
+  std::string last_modified;
+  std::string header_lines;
+  std::string not_modified_lines;
+  // Last second the entry was checked against the file's stat.
+  mutable std::atomic<std::time_t> checked_at{0};
+  size_t cost() const {
+    return body.size() + header_lines.size() + not_modified_lines.size() + etag.size() + last_modified.size();
+  }
+};
+
+// LRU of cached_file bounded by total bytes. Keys name the mount as well
+// as the file path (see static_cache_key), since entries hold the mount's
+// headers. Entries are immutable once inserted, so a worker can keep
+// serving one that is evicted concurrently.
+class static_file_cache {
+private:
+  typedef std::pair<std::string, std::shared_ptr<const cached_file>> item;
+  mutable std::mutex mu;
+  std::list<item> lru;
+  std::unordered_map<std::string, std::list<item>::iterator> index;
+  size_t capacity_ = 0;
+  size_t max_file_size_ = default_static_cache_max_file_size;
+  size_t used = 0;
+  void evict_to(size_t limit) {
+    while (used > limit && !lru.empty()) {
+      used -= lru.back().second->cost();
+      index.erase(lru.back().first);
+      lru.pop_back();
+    }
+  }
+public:
+  // 0 disables the cache.
+  void capacity(size_t bytes) {
+    std::lock_guard<std::mutex> lk(mu);
+    capacity_ = bytes;
+    evict_to(capacity_);
+  }
+  size_t capacity() const {
+    std::lock_guard<std::mutex> lk(mu);
+    return capacity_;
+  }
+  void max_file_size(size_t bytes) {
+    std::lock_guard<std::mutex> lk(mu);
+    max_file_size_ = bytes;
+  }
+  size_t max_file_size() const {
+    std::lock_guard<std::mutex> lk(mu);
+    return max_file_size_;
+  }
+  size_t size() const {
+    std::lock_guard<std::mutex> lk(mu);
+    return used;
+  }
+  struct lookup_result {
+    std::shared_ptr<const cached_file> entry;
+    // False when the cache is disabled.
+    bool enabled;
+    size_t max_file_size;
+  };
+  // Everything a request needs from the cache, under one lock.
+  lookup_result lookup(const std::string& key) {
+    std::lock_guard<std::mutex> lk(mu);
+    lookup_result result{nullptr, capacity_ > 0, max_file_size_};
+    auto it = index.find(key);
+    if (it != index.end()) {
+      lru.splice(lru.begin(), lru, it->second);
+      result.entry = it->second->second;
+    }
+    return result;
+  }
+  std::shared_ptr<const cached_file> find(const std::string& key) {
+    return lookup(key).entry;
+  }
+  void insert(const std::string& path, std::shared_ptr<const cached_file> entry) {
+    std::lock_guard<std::mutex> lk(mu);
+    if (entry->cost() > capacity_) {
+      return;
+    }
+    auto it = index.find(path);
+    if (it != index.end()) {
+      used -= it->second->second->cost();
+      lru.erase(it->second);
+      index.erase(it);
+    }
+    used += entry->cost();
+    lru.emplace_front(path, std::move(entry));
+    index.emplace(path, lru.begin());
+    evict_to(capacity_);
+  }
+  void erase(const std::string& path) {
+    std::lock_guard<std::mutex> lk(mu);
+    auto it = index.find(path);
+    if (it == index.end()) {
+      return;
+    }
+    used -= it->second->second->cost();
+    lru.erase(it->second);
+    index.erase(it);
+  }
+};
+
+// Settings shared by every static_dir mount of a server. The route
+// closures hold a reference, so setters called after static_dir apply too.
+struct static_file_options {
+  static_file_cache cache;
+  // Numbers static_dir mounts, for static_cache_key.
+  std::atomic<size_t> next_mount{0};
+  // Serve file.gz / file.br / file.zst siblings to clients that accept them.
+  std::atomic<bool> precompressed{false};
+};
+
+// Perfect hash over the exact static routes of a table. One hash of the
+// path picks both a bucket, whose displacement moves its keys into free
+// slots, and the slot itself; one compare then confirms the hit.
+class static_route_index {
+private:
+  struct slot {
+    std::uint32_t path_offset;
+    std::uint32_t path_size;
+    std::int32_t handler;
+  };
+  std::uint64_t seed_ = 0;
+  std::vector<std::uint32_t> displacements_;
+  std::vector<slot> slots_;
+  std::string paths_;
+  bool try_build(const std::vector<std::pair<std::string, std::int32_t>>&, std::uint64_t);
+public:
+  void build(const std::vector<std::pair<std::string, std::int32_t>>& routes);
+  // Handler index of path, or -1.
+  std::int32_t find(std::string_view path) const {
+    if (slots_.empty()) {
+      return -1;
+    }
+    auto h = content_hash(path, seed_);
+    auto d = displacements_[(size_t) (h >> 32) & (displacements_.size() - 1)];
+    const auto& s = slots_[(size_t) ((std::uint32_t) h ^ d) & (slots_.size() - 1)];
+    if (s.handler < 0 || std::string_view(paths_.data() + s.path_offset, s.path_size) != path) {
+      return -1;
+    }
+    return s.handler;
+  }
+  size_t size() const {
+    return (size_t) std::count_if(slots_.begin(), slots_.end(), [](const slot& s) { return s.handler >= 0; });
+  }
+};
+
+inline size_t next_power_of_two(size_t n) {
+  size_t p = 1;
+  while (p < n) {
+    p <<= 1;
+  }
+  return p;
+}
+
+inline bool static_route_index::try_build(const std::vector<std::pair<std::string, std::int32_t>>& routes, std::uint64_t seed) {
+  auto bucket_count = displacements_.size();
+  auto slot_mask = slots_.size() - 1;
+  std::vector<std::vector<std::pair<std::uint32_t, size_t>>> buckets(bucket_count);
+  for (size_t i = 0; i < routes.size(); i++) {
+    auto h = content_hash(routes[i].first, seed);
+    buckets[(size_t) (h >> 32) & (bucket_count - 1)].emplace_back((std::uint32_t) h, i);
+  }
+  std::vector<size_t> order(bucket_count);
+  for (size_t i = 0; i < bucket_count; i++) {
+    order[i] = i;
+  }
+  // Crowded buckets go first, while most slots are still free.
+  std::stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) {
+    return buckets[x].size() > buckets[y].size();
+  });
+  std::vector<bool> used(slots_.size());
+  for (auto b : order) {
+    auto& keys = buckets[b];
+    if (keys.empty()) {
+      break;
+    }
+    auto placed = false;
+    for (std::uint32_t d = 0; d <= slot_mask && !placed; d++) {
+      placed = true;
+      for (size_t k = 0; k < keys.size() && placed; k++) {
+        auto pos = (keys[k].first ^ d) & slot_mask;
+        placed = !used[pos];
+        for (size_t j = 0; j < k && placed; j++) {
+          placed = ((keys[j].first ^ d) & slot_mask) != pos;
+        }
+      }
+      if (placed) {
+        displacements_[b] = d;
+        for (auto& key : keys) {
+          used[(key.first ^ d) & slot_mask] = true;
+        }
+      }
+    }
+    if (!placed) {
+      return false;
+    }
+  }
+  for (auto& s : slots_) {
+    s = slot{0, 0, -1};
+  }
+  paths_.clear();
+  for (auto& r : routes) {
+    auto h = content_hash(r.first, seed);
+    auto d = displacements_[(size_t) (h >> 32) & (bucket_count - 1)];
+    slots_[((std::uint32_t) h ^ d) & slot_mask] = slot{
+      .path_offset = (std::uint32_t) paths_.size(),
+      .path_size = (std::uint32_t) r.first.size(),
+      .handler = r.second,
+    };
+    paths_ += r.first;
+  }
+  seed_ = seed;
+  return true;
+}
+
+inline void static_route_index::build(const std::vector<std::pair<std::string, std::int32_t>>& routes) {
+  displacements_.clear();
+  slots_.clear();
+  paths_.clear();
+  if (routes.empty()) {
+    return;
+  }
+  // Twice as many slots as keys, and about two keys per bucket.
+  auto slot_count = next_power_of_two(routes.size() * 2);
+  auto bucket_count = next_power_of_two(routes.size() / 2 + 1);
+  for (std::uint64_t seed = 1;; seed++) {
+    displacements_.assign(bucket_count, 0);
+    slots_.assign(slot_count, slot{0, 0, -1});
+    if (try_build(routes, seed)) {
+      return;
+    }
+    // A bucket holding two keys that share their slot bits cannot be
+    // displaced apart; another seed regroups them. Growing the table
+    // now and then keeps this from looping on adversarial keys.
+    if (seed % 8 == 0) {
+      slot_count *= 2;
+    }
+  }
+}
+
+// A route trie flattened into contiguous arrays. Each node carries a
+// compressed static prefix; its static children are stored next to each
+// other and found by their first byte, and a placeholder child, if any,
+// takes the rest of a path segment.
+class route_table {
+private:
+  struct entry {
+    std::uint32_t label_offset;
+    std::uint32_t label_size;
+    std::uint32_t first_child;
+    std::uint32_t child_count;
+    // Placeholder children follow each other from first_param, with
+    // constrained ones first.
+    std::uint32_t first_param;
+    std::uint32_t param_count;
+    // Index into constraints_, or -1 for a placeholder that takes any
+    // segment.
+    std::int32_t constraint;
+    std::int32_t handler;
+  };
+  // Handlers registered on one path, indexed by route_method. Shared with
+  // the trie, since handlers cannot be copied.
+  struct handler_set {
+    std::array<std::shared_ptr<const func_t>, route_method_count> fn;
+    route_method_set methods;
+    // Methods whose handler also matches paths below this one.
+    route_method_set prefix_methods;
+  };
+  struct match_state {
+    // Best prefix route so far.
+    const func_t* fn = nullptr;
+    size_t length = 0;
+    route_args args;
+    // Methods of every route whose path matched.
+    route_method_set allowed = 0;
+  };
+  std::vector<entry> nodes_;
+  std::string labels_;
+  // First label byte of each node, so that a node's children can be
+  // searched with one memchr.
+  std::string keys_;
+  std::vector<handler_set> handlers_;
+  std::vector<segment_constraint> constraints_;
+  static_route_index statics_;
+  const func_t* match_node(route_method, std::uint32_t, std::string_view, size_t, route_args&, match_state&) const;
+  friend class route_trie;
+public:
+  // Routes without placeholders are looked up in a perfect-hash index
+  // first. Otherwise static segments win over placeholders, backtracking
+  // when a static branch dead-ends, and without an exact match the longest
+  // prefix route (static_dir) that ends on a segment boundary is used.
+  // Routes for other methods are skipped; when nothing matches, allowed
+  // (if given) receives the methods that path has routes for.
+  const func_t* match(route_method method, std::string_view path, route_args& args, route_method_set* allowed = nullptr) const;
+  size_t node_count() const { return nodes_.size(); }
+  size_t static_route_count() const { return statics_.size(); }
+};
+
+// Routes as registered. compile() turns them into a route_table.
+class route_trie {
+private:
+  struct trie_node {
+    std::string label;
+    std::vector<std::unique_ptr<trie_node>> children;
+    // Constrained placeholders first, in registration order.
+    std::vector<std::unique_ptr<trie_node>> params;
+    // Of a placeholder node, as written between the angle brackets.
+    std::string constraint_spec;
+    segment_constraint constraint;
+    std::array<std::shared_ptr<const func_t>, route_method_count> fn;
+    // The pattern fn was registered with.
+    std::string path;
+  };
+  trie_node root_;
+  static trie_node* insert_literal(trie_node*, std::string_view);
+  static trie_node* find_param(const trie_node*, std::string_view);
+public:
+  // ":name" at the start of a segment is a placeholder, optionally
+  // followed by a constraint (see segment_constraint). Registering the
+  // same method and path again replaces its handler. Throws
+  // std::invalid_argument on a malformed constraint.
+  void insert(route_method method, std::string_view path, func_t fn);
+  // Returns false if no route was registered with method and path.
+  bool erase(route_method method, std::string_view path);
+  // Handlers are wrapped in the middleware that applies to their path.
+  route_table compile(const middleware_stack& middleware = {}) const;
+};
+
+inline route_trie::trie_node* route_trie::insert_literal(trie_node* n, std::string_view s) {
+  while (!s.empty()) {
+    std::unique_ptr<trie_node>* next = nullptr;
+    for (auto& c : n->children) {
+      if (c->label[0] == s[0]) {
+        next = &c;
+        break;
+      }
+    }
+    if (next == nullptr) {
+      auto c = std::make_unique<trie_node>();
+      c->label = std::string(s);
+      n->children.emplace_back(std::move(c));
+      return n->children.back().get();
+    }
+    auto& label = (*next)->label;
+    size_t k = 1;
+    while (k < label.size() && k < s.size() && label[k] == s[k]) {
+      k++;
+    }
+    if (k < label.size()) {
+      auto mid = std::make_unique<trie_node>();
+      mid->label = label.substr(0, k);
+      label.erase(0, k);
+      mid->children.emplace_back(std::move(*next));
+      *next = std::move(mid);
+    }
+    n = next->get();
+    s.remove_prefix(k);
+  }
+  return n;
+}
+
+inline route_trie::trie_node* route_trie::find_param(const trie_node* n, std::string_view spec) {
+  for (auto& p : n->params) {
+    if (p->constraint_spec == spec) {
+      return p.get();
+    }
+  }
+  return nullptr;
+}
+
+inline void route_trie::insert(route_method method, std::string_view path, func_t fn) {
+  auto pattern = path;
+  auto n = &root_;
+  while (true) {
+    size_t colon = 0;
+    while ((colon = path.find(':', colon)) != std::string_view::npos && (colon == 0 || path[colon - 1] != '/')) {
+      colon++;
+    }
+    n = insert_literal(n, path.substr(0, colon));
+    if (colon == std::string_view::npos) {
+      break;
+    }
+    auto end = std::min(path.find('/', colon), path.size());
+    auto spec = split_placeholder(path.substr(colon + 1, end - colon - 1)).second;
+    auto param = find_param(n, spec);
+    if (param == nullptr) {
+      auto c = std::make_unique<trie_node>();
+      c->constraint_spec = std::string(spec);
+      c->constraint = spec.empty() ? segment_constraint() : segment_constraint(spec);
+      auto at = n->params.end();
+      if (!spec.empty() && !n->params.empty() && n->params.back()->constraint_spec.empty()) {
+        at--;
+      }
+      param = n->params.insert(at, std::move(c))->get();
+    }
+    n = param;
+    if (end == path.size()) {
+      break;
+    }
+    path.remove_prefix(end);
+  }
+  n->fn[(size_t) method] = std::make_shared<const func_t>(std::move(fn));
+  n->path = std::string(pattern);
+}
+
+inline bool route_trie::erase(route_method method, std::string_view path) {
+  auto n = &root_;
+  size_t pos = 0;
+  while (n != nullptr && pos < path.size()) {
+    if (path[pos] == ':' && (pos == 0 || path[pos - 1] == '/')) {
+      auto end = std::min(path.find('/', pos), path.size());
+      n = find_param(n, split_placeholder(path.substr(pos + 1, end - pos - 1)).second);
+      pos = end;
+      continue;
+    }
+    trie_node* next = nullptr;
+    for (auto& c : n->children) {
+      if (path.compare(pos, c->label.size(), c->label) == 0) {
+        next = c.get();
+        break;
+      }
+    }
+    if (next != nullptr) {
+      pos += next->label.size();
+    }
+    n = next;
+  }
+  if (n == nullptr || !n->fn[(size_t) method]) {
+    return false;
+  }
+  n->fn[(size_t) method].reset();
+  return true;
+}
+
+inline route_table route_trie::compile(const middleware_stack& middleware) const {
+  route_table t;
+  struct pending {
+    const trie_node* n;
+    std::uint32_t index;
+    // Full path of static routes; empty below a placeholder.
+    std::string path;
+    bool dynamic;
+  };
+  std::vector<pending> queue;
+  std::vector<std::pair<std::string, std::int32_t>> statics;
+  std::unordered_map<std::string, std::int32_t> constraints;
+  queue.push_back({&root_, 0, "", false});
+  t.nodes_.push_back({});
+  t.keys_.push_back('\0');
+  // Breadth first, so that each node's children are allocated together.
+  for (size_t q = 0; q < queue.size(); q++) {
+    auto n = queue[q].n;
+    auto i = queue[q].index;
+    auto dynamic = queue[q].dynamic;
+    auto path = dynamic ? std::string() : queue[q].path + n->label;
+    route_table::entry e{
+      .label_offset = (std::uint32_t) t.labels_.size(),
+      .label_size = (std::uint32_t) n->label.size(),
+      .first_child = (std::uint32_t) t.nodes_.size(),
+      .child_count = (std::uint32_t) n->children.size(),
+      .first_param = 0,
+      .param_count = (std::uint32_t) n->params.size(),
+      .constraint = -1,
+      .handler = -1,
+    };
+    t.labels_ += n->label;
+    if (!n->constraint_spec.empty()) {
+      auto it = constraints.try_emplace(n->constraint_spec, (std::int32_t) t.constraints_.size()).first;
+      if (it->second == (std::int32_t) t.constraints_.size()) {
+        t.constraints_.push_back(n->constraint);
+      }
+      e.constraint = it->second;
+    }
+    route_table::handler_set set{};
+    for (size_t m = 0; m < route_method_count; m++) {
+      if (auto& fn = n->fn[m]) {
+        set.fn[m] = middleware.empty() ? fn : middleware.wrap(n->path, fn);
+        set.methods |= route_method_bit((route_method) m);
+        if (fn->prefix_match) {
+          set.prefix_methods |= route_method_bit((route_method) m);
+        }
+      }
+    }
+    if (set.methods != 0) {
+      e.handler = (std::int32_t) t.handlers_.size();
+      if (!dynamic && set.methods != set.prefix_methods) {
+        statics.emplace_back(path, e.handler);
+      }
+      t.handlers_.push_back(std::move(set));
+    }
+    for (auto& c : n->children) {
+      queue.push_back({c.get(), (std::uint32_t) t.nodes_.size(), path, dynamic});
+      t.nodes_.push_back({});
+      t.keys_.push_back(c->label[0]);
+    }
+    e.first_param = (std::uint32_t) t.nodes_.size();
+    for (auto& c : n->params) {
+      queue.push_back({c.get(), (std::uint32_t) t.nodes_.size(), "", true});
+      t.nodes_.push_back({});
+      t.keys_.push_back('\0');
+    }
+    t.nodes_[i] = e;
+  }
+  t.statics_.build(statics);
+  return t;
+}
+
+// Walks static edges iteratively and only recurses where a placeholder
+// gives an alternative to come back to.
+inline const func_t* route_table::match_node(
+    route_method method,
+    std::uint32_t i,
+    std::string_view path,
+    size_t pos,
+    route_args& args,
+    match_state& state) const {
+  const auto bit = route_method_bit(method);
+  auto base = args.size();
+  while (true) {
+    const auto& n = nodes_[i];
+    if (n.handler >= 0) {
+      const auto& set = handlers_[(size_t) n.handler];
+      if (pos == path.size()) {
+        if (set.methods & bit) {
+          return set.fn[(size_t) method].get();
+        }
+        state.allowed |= set.methods;
+      } else if (set.prefix_methods != 0 && (path[pos] == '/' || (pos > 0 && path[pos - 1] == '/'))) {
+        state.allowed |= set.prefix_methods;
+        if ((set.prefix_methods & bit) && (state.fn == nullptr || pos > state.length)) {
+          state.fn = set.fn[(size_t) method].get();
+          state.length = pos;
+          state.args = args;
+        }
+      }
+    }
+    if (pos < path.size() && n.child_count > 0) {
+      auto keys = keys_.data() + n.first_child;
+      auto hit = static_cast<const char*>(std::memchr(keys, path[pos], n.child_count));
+      if (hit != nullptr) {
+        auto c = n.first_child + (std::uint32_t) (hit - keys);
+        const auto& child = nodes_[c];
+        if (path.compare(pos, child.label_size, labels_.data() + child.label_offset, child.label_size) == 0) {
+          if (n.param_count == 0) {
+            i = c;
+            pos += child.label_size;
+            continue;
+          }
+          if (auto fn = match_node(method, c, path, pos + child.label_size, args, state)) {
+            return fn;
+          }
+        }
+      }
+    }
+    if (n.param_count == 0) {
+      break;
+    }
+    auto end = std::min(path.find('/', pos), path.size());
+    auto segment = path.substr(pos, end - pos);
+    // Every accepting placeholder but the last is an alternative to
+    // come back to.
+    auto last = n.first_param + n.param_count - 1;
+    std::int64_t next = -1;
+    for (auto c = n.first_param; c <= last; c++) {
+      auto constraint = nodes_[c].constraint;
+      if (constraint >= 0 && !constraints_[(size_t) constraint].accepts(segment)) {
+        continue;
+      }
+      if (c == last) {
+        next = c;
+        break;
+      }
+      if (!args.push(segment)) {
+        break;
+      }
+      if (auto fn = match_node(method, c, path, end, args, state)) {
+        return fn;
+      }
+      args.resize(args.size() - 1);
+    }
+    if (next < 0 || !args.push(segment)) {
+      break;
+    }
+    i = (std::uint32_t) next;
+    pos = end;
+  }
+  args.resize(base);
+  return nullptr;
+}
+
+inline const func_t* route_table::match(route_method method, std::string_view path, route_args& args, route_method_set* allowed) const {
+  if (nodes_.empty()) {
+    if (allowed != nullptr) {
+      *allowed = 0;
+    }
+    return nullptr;
+  }
+  auto handler = statics_.find(path);
+  if (handler >= 0) {
+    auto& fn = handlers_[(size_t) handler].fn[(size_t) method];
+    if (fn) {
+      return fn.get();
+    }
+  }
+  match_state state;
+  auto fn = match_node(method, 0, path, 0, args, state);
+  if (fn == nullptr && state.fn != nullptr) {
+    fn = state.fn;
+    args = state.args;
+  }
+  if (allowed != nullptr) {
+    *allowed = fn == nullptr ? state.allowed : 0;
+  }
+  return fn;
+}
+
+// Epoch-based reclamation for data read without locks. A reader marks
+// its thread with the current epoch while it reads; an object retired in
+// some epoch is freed once no thread is still reading in that epoch or
+// an earlier one. Readers only store to their own slot.
+class rcu_domain {
+private:
+  struct slot {
+    // 0 while the thread is not reading.
+    std::atomic<std::uint64_t> epoch{0};
+    std::atomic<bool> in_use{true};
+    unsigned depth = 0;
+    slot* next = nullptr;
+  };
+  std::atomic<std::uint64_t> epoch_{1};
+  // Slots are reused by later threads and never freed.
+  std::atomic<slot*> slots_{nullptr};
+  slot* acquire_slot() {
+    for (auto p = slots_.load(); p != nullptr; p = p->next) {
+      bool expected = false;
+      if (p->in_use.compare_exchange_strong(expected, true)) {
+        return p;
+      }
+    }
+    auto p = new slot;
+    p->next = slots_.load();
+    while (!slots_.compare_exchange_weak(p->next, p)) {
+    }
+    return p;
+  }
+  slot& local() {
+    struct holder {
+      slot* p;
+      ~holder() {
+        p->in_use.store(false);
+      }
+    };
+    thread_local holder h{instance().acquire_slot()};
+    return *h.p;
+  }
+public:
+  static rcu_domain& instance() {
+    static rcu_domain domain;
+    return domain;
+  }
+  // Sections nest; only the outermost one marks the thread.
+  void read_lock() {
+    auto& s = local();
+    if (s.depth++ == 0) {
+      s.epoch.store(epoch_.load());
+    }
+  }
+  void read_unlock() {
+    auto& s = local();
+    if (--s.depth == 0) {
+      s.epoch.store(0, std::memory_order_release);
+    }
+  }
+  // Call after unpublishing an object; returns the epoch to retire it in.
+  std::uint64_t retire_epoch() {
+    return epoch_.fetch_add(1);
+  }
+  // Whether every reader that could see an object retired in epoch has
+  // finished.
+  bool quiescent(std::uint64_t epoch) const {
+    for (auto p = slots_.load(); p != nullptr; p = p->next) {
+      auto e = p->epoch.load();
+      if (e != 0 && e <= epoch) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+class rcu_read_guard {
+public:
+  rcu_read_guard() {
+    rcu_domain::instance().read_lock();
+  }
+  ~rcu_read_guard() {
+    rcu_domain::instance().read_unlock();
+  }
+  rcu_read_guard(const rcu_read_guard&) = delete;
+  rcu_read_guard& operator =(const rcu_read_guard&) = delete;
+};
+
+// Registered routes and middleware, and the route table compiled from
+// them. Writers serialize on a mutex and publish a new table through an
+// atomic pointer; readers load it inside an rcu_read_guard and never
+// block. Replaced tables are freed on a later publish, once the
+// readers that could see them are done.
+//
+// Until go_live() changes are batched and compiled on first use; after
+// it, every change is compiled and published before it returns.
+class route_registry {
+private:
+  std::mutex mutex_;
+  route_trie trie_;
+  middleware_stack middleware_;
+  std::atomic<const route_table*> current_{nullptr};
+  std::atomic<bool> stale_{true};
+  bool live_ = false;
+  std::atomic<bool> has_inline_{false};
+  std::vector<std::pair<const route_table*, std::uint64_t>> retired_;
+  void publish() {
+    auto next = new route_table(trie_.compile(middleware_));
+    auto old = current_.exchange(next);
+    stale_.store(false, std::memory_order_release);
+    auto& rcu = rcu_domain::instance();
+    if (old != nullptr) {
+      retired_.emplace_back(old, rcu.retire_epoch());
+    }
+    retired_.erase(std::remove_if(retired_.begin(), retired_.end(), [&](auto& r) {
+      if (!rcu.quiescent(r.second)) {
+        return false;
+      }
+      delete r.first;
+      return true;
+    }), retired_.end());
+  }
+  void changed() {
+    if (live_) {
+      publish();
+    } else {
+      stale_.store(true, std::memory_order_release);
+    }
+  }
+public:
+  route_registry() = default;
+  route_registry(const route_registry&) = delete;
+  route_registry& operator =(const route_registry&) = delete;
+  ~route_registry() {
+    delete current_.load();
+    for (auto& r : retired_) {
+      delete r.first;
+    }
+  }
+  void insert(route_method method, std::string_view path, func_t fn) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fn.reactor_inline) {
+      has_inline_.store(true, std::memory_order_relaxed);
+    }
+    trie_.insert(method, path, std::move(fn));
+    changed();
+  }
+  bool erase(route_method method, std::string_view path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!trie_.erase(method, path)) {
+      return false;
+    }
+    changed();
+    return true;
+  }
+  void use(const std::string& prefix, middleware_fn fn) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    middleware_.add(prefix, std::move(fn));
+    changed();
+  }
+  // Set once a reactor-inline handler is registered, before or after the
+  // server starts.
+  const std::atomic<bool>& inline_routes() const {
+    return has_inline_;
+  }
+  void go_live() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    live_ = true;
+    if (stale_.load(std::memory_order_relaxed)) {
+      publish();
+    }
+  }
+  // The caller must hold an rcu_read_guard while it uses the table.
+  const route_table& snapshot() {
+    if (stale_.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stale_.load(std::memory_order_relaxed)) {
+        publish();
+      }
+    }
+    return *current_.load();
+  }
+};
+
+class server_t {
+private:
+  std::shared_ptr<route_registry> routes_;
+  unsigned int worker_count_;
+  size_t accept_queue_limit_;
+  int socket_timeout_ms_;
+  size_t max_body_size_;
+  size_t body_spill_threshold_;
+  size_t body_memory_limit_;
+  size_t max_header_size_;
+  size_t max_header_count_;
+  bool decompress_request_body_;
+  size_t max_decompressed_body_size_;
+  size_t max_decompression_ratio_;
+  size_t output_buffer_size_;
+  bool etag_responses_;
+  bool compress_responses_;
+  int compression_level_;
+  size_t compression_min_size_;
+  std::shared_ptr<static_file_options> static_files_;
+  void register_route(route_method, const std::string&, func_t);
+  const func_t* match(route_method, std::string_view, route_args&, route_method_set*) const;
+  bool handle_connection_socket(int, const std::string&, const server_runtime_config&, const request_read_config&, const response_write_config&) const;
+  reactor_result serve_inline(connection_state&, int, const response_write_config&) const;
+  void _run(const std::string&, int);
+
+public:
+  // fn is a writer, response or string handler; see func_t. A path with
+  // routes answers other methods with 405, and OPTIONS automatically
+  // unless it has an OPTIONS route.
+  template <typename F>
+  void GET(const std::string&, F&& fn);
+  template <typename F>
+  void POST(const std::string&, F&& fn);
+  template <typename F>
+  void QUERY(const std::string&, F&& fn);
+  template <typename F>
+  void PUT(const std::string&, F&& fn);
+  template <typename F>
+  void PATCH(const std::string&, F&& fn);
+  template <typename F>
+  void DELETE(const std::string&, F&& fn);
+  template <typename F>
+  void OPTIONS(const std::string&, F&& fn);
+  // fn takes the route's typed captures after its usual parameters.
+  template <typename Path, typename F>
+  void GET(route<Path>, F&& fn);
+  template <typename Path, typename F>
+  void POST(route<Path>, F&& fn);
+  template <typename Path, typename F>
+  void QUERY(route<Path>, F&& fn);
+  template <typename Path, typename F>
+  void PUT(route<Path>, F&& fn);
+  template <typename Path, typename F>
+  void PATCH(route<Path>, F&& fn);
+  template <typename Path, typename F>
+  void DELETE(route<Path>, F&& fn);
+  template <typename Path, typename F>
+  void OPTIONS(route<Path>, F&& fn);
+  // Routes and middleware may be added or removed while the server runs;
+  // each change swaps in a recompiled route table without blocking
+  // requests in flight. Returns false if no such route was registered.
+  bool remove_route(const std::string& method, const std::string& path);
+  // Middleware runs in registration order, outermost first, on the routes
+  // under prefix (every route when it is omitted). use() adds a hook that
+  // wraps the handler; before() may answer instead of the handler by
+  // returning a response; after() sees the status code that was sent.
+  void use(middleware_fn);
+  void use(const std::string& prefix, middleware_fn);
+  void before(std::function<std::optional<response>(request&)>);
+  void before(const std::string& prefix, std::function<std::optional<response>(request&)>);
+  void after(std::function<void(request&, int)>);
+  void after(const std::string& prefix, std::function<void(request&, int)>);
+  void static_dir(
+      const std::string&,
+      const std::string&,
+      bool listing = false,
+      const std::vector<header>& extra_headers = {});
+  // Serves res for GET and HEAD on path from bytes serialized here; see
+  // constant_response. The route is reactor-inline.
+  void constant(const std::string&, const response&);
+  server_t& worker_count(unsigned int) &;
+  server_t&& worker_count(unsigned int) &&;
+  server_t& accept_queue_limit(size_t) &;
+  server_t&& accept_queue_limit(size_t) &&;
+  server_t& socket_timeout(int) &;
+  server_t&& socket_timeout(int) &&;
+  server_t& max_body_size(size_t) &;
+  server_t&& max_body_size(size_t) &&;
+  server_t& body_spill_threshold(size_t) &;
+  server_t&& body_spill_threshold(size_t) &&;
+  server_t& body_memory_limit(size_t) &;
+  server_t&& body_memory_limit(size_t) &&;
+  server_t& max_header_size(size_t) &;
+  server_t&& max_header_size(size_t) &&;
+  server_t& max_header_count(size_t) &;
+  server_t&& max_header_count(size_t) &&;
+  server_t& decompress_request_body(bool) &;
+  server_t&& decompress_request_body(bool) &&;
+  server_t& max_decompressed_body_size(size_t) &;
+  server_t&& max_decompressed_body_size(size_t) &&;
+  server_t& max_decompression_ratio(size_t) &;
+  server_t&& max_decompression_ratio(size_t) &&;
+  server_t& output_buffer_size(size_t) &;
+  server_t&& output_buffer_size(size_t) &&;
+  server_t& etag_responses(bool) &;
+  server_t&& etag_responses(bool) &&;
+  server_t& compress_responses(bool) &;
+  server_t&& compress_responses(bool) &&;
+  server_t& compression_level(int) &;
+  server_t&& compression_level(int) &&;
+  server_t& compression_min_size(size_t) &;
+  server_t&& compression_min_size(size_t) &&;
+  server_t& static_cache_size(size_t) &;
+  server_t&& static_cache_size(size_t) &&;
+  server_t& static_cache_max_file_size(size_t) &;
+  server_t&& static_cache_max_file_size(size_t) &&;
+  server_t& static_precompressed(bool) &;
+  server_t&& static_precompressed(bool) &&;
+  void run(const std::string&);
+  void run(int);
+  logger log;
+  server_t() : routes_{std::make_shared<route_registry>()}, worker_count_{0}, accept_queue_limit_{0}, socket_timeout_ms_{keep_alive_timeout_ms}, max_body_size_{0}, body_spill_threshold_{0}, body_memory_limit_{0}, max_header_size_{default_max_header_size}, max_header_count_{default_max_header_count}, decompress_request_body_{false}, max_decompressed_body_size_{0}, max_decompression_ratio_{default_max_decompression_ratio}, output_buffer_size_{default_output_buffer_size}, etag_responses_{false}, compress_responses_{false}, compression_level_{default_compression_level}, compression_min_size_{default_compression_min_size}, static_files_{std::make_shared<static_file_options>()} {}
+#ifdef CLASK_TEST
+  bool test_match(const std::string&, const std::string&, const std::function<void(const func_t& fn, const route_args&)>&, route_method_set* allowed = nullptr) const;
+  reactor_result test_serve_inline(connection_state& conn) const {
+    return serve_inline(conn, keep_alive_timeout_ms, {});
+  }
+#endif
+};
+
+inline server_t& server_t::worker_count(unsigned int v) & {
+  worker_count_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::worker_count(unsigned int v) && {
+  worker_count_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::accept_queue_limit(size_t v) & {
+  accept_queue_limit_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::accept_queue_limit(size_t v) && {
+  accept_queue_limit_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::socket_timeout(int v) & {
+  socket_timeout_ms_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::socket_timeout(int v) && {
+  socket_timeout_ms_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::max_body_size(size_t v) & {
+  max_body_size_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::max_body_size(size_t v) && {
+  max_body_size_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::body_spill_threshold(size_t v) & {
+  body_spill_threshold_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::body_spill_threshold(size_t v) && {
+  body_spill_threshold_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::body_memory_limit(size_t v) & {
+  body_memory_limit_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::body_memory_limit(size_t v) && {
+  body_memory_limit_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::max_header_size(size_t v) & {
+  max_header_size_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::max_header_size(size_t v) && {
+  max_header_size_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::max_header_count(size_t v) & {
+  max_header_count_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::max_header_count(size_t v) && {
+  max_header_count_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::decompress_request_body(bool v) & {
+  decompress_request_body_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::decompress_request_body(bool v) && {
+  decompress_request_body_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::max_decompressed_body_size(size_t v) & {
+  max_decompressed_body_size_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::max_decompressed_body_size(size_t v) && {
+  max_decompressed_body_size_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::max_decompression_ratio(size_t v) & {
+  max_decompression_ratio_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::max_decompression_ratio(size_t v) && {
+  max_decompression_ratio_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::output_buffer_size(size_t v) & {
+  output_buffer_size_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::output_buffer_size(size_t v) && {
+  output_buffer_size_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::etag_responses(bool v) & {
+  etag_responses_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::etag_responses(bool v) && {
+  etag_responses_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::compress_responses(bool v) & {
+  compress_responses_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::compress_responses(bool v) && {
+  compress_responses_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::compression_level(int v) & {
+  compression_level_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::compression_level(int v) && {
+  compression_level_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::compression_min_size(size_t v) & {
+  compression_min_size_ = v;
+  return *this;
+}
+
+inline server_t&& server_t::compression_min_size(size_t v) && {
+  compression_min_size_ = v;
+  return std::move(*this);
+}
+
+inline server_t& server_t::static_cache_size(size_t v) & {
+  static_files_->cache.capacity(v);
+  return *this;
+}
+
+inline server_t&& server_t::static_cache_size(size_t v) && {
+  static_files_->cache.capacity(v);
+  return std::move(*this);
+}
+
+inline server_t& server_t::static_cache_max_file_size(size_t v) & {
+  static_files_->cache.max_file_size(v);
+  return *this;
+}
+
+inline server_t&& server_t::static_cache_max_file_size(size_t v) && {
+  static_files_->cache.max_file_size(v);
+  return std::move(*this);
+}
+
+inline server_t& server_t::static_precompressed(bool v) & {
+  static_files_->precompressed = v;
+  return *this;
+}
+
+inline server_t&& server_t::static_precompressed(bool v) && {
+  static_files_->precompressed = v;
+  return std::move(*this);
+}
+
+// The caller must hold an rcu_read_guard while it uses the handler.
+inline const func_t* server_t::match(route_method method, std::string_view path, route_args& args, route_method_set* allowed) const {
+  return routes_->snapshot().match(method, path, args, allowed);
+}
+
+inline bool server_t::handle_connection_socket(
+    int s,
+    const std::string& remote,
+    const server_runtime_config& config,
+    const request_read_config& read_config,
+    const response_write_config& write_config) const {
+  return handle_connection_request(
+      s,
+      remote,
+      config.socket_timeout_ms,
+      read_config,
+      write_config,
+      [&](const std::string& method, const std::string& path, route_method_set& allowed, const auto& fn) {
+        auto parsed_method = parse_route_method(method);
+        if (!parsed_method) {
+          return false;
+        }
+        // Held until the handler returns, so a route table swapped
+        // meanwhile is not freed under it.
+        rcu_read_guard guard;
+        route_args args;
+        auto handler = match(*parsed_method, path, args, &allowed);
+        if (handler == nullptr) {
+          return false;
+        }
+        fn(*handler, args);
+        return true;
+      });
+}
+
+// Answers a request on the reactor thread when it has no body and its
+// route is reactor-inline. Called only once the connection is readable,
+// so peeking does not block; anything else is left unread for a worker.
+// Only the request line is looked at until the route is known to be
+// inline, so worker routes cost one peek and one match here.
+inline reactor_result server_t::serve_inline(
+    connection_state& conn,
+    int socket_timeout_ms,
+    const response_write_config& write_config) const {
+  constexpr size_t max_inline_headers = 32;
+  char buf[4096];
+  ssize_t rret;
+  while ((rret = recv(conn.fd, buf, sizeof(buf), MSG_PEEK)) == -1 && errno == EINTR);
+  if (rret <= 0) {
+    return reactor_result::deferred;
+  }
+  std::string_view peeked(buf, (size_t) rret);
+  auto method_end = peeked.find(' ');
+  auto path_end = method_end == std::string_view::npos ? method_end : peeked.find(' ', method_end + 1);
+  if (path_end == std::string_view::npos) {
+    return reactor_result::deferred;
+  }
+  std::string req_method(buf, method_end);
+  auto parsed_method = parse_route_method(req_method);
+  if (!parsed_method) {
+    return reactor_result::deferred;
+  }
+  auto target = peeked.substr(method_end + 1, path_end - method_end - 1);
+  auto query = target.find('?');
+  rcu_read_guard guard;
+  route_args args;
+  auto handler = match(*parsed_method, target.substr(0, query), args, nullptr);
+  if (handler == nullptr || !handler->reactor_inline) {
+    return reactor_result::deferred;
+  }
+
+  const char *method, *path;
+  int minor_version;
+  size_t method_len, path_len, num_headers = max_inline_headers;
+  phr_header headers[max_inline_headers];
+  auto pret = phr_parse_request(
+      buf, (size_t) rret, &method, &method_len, &path, &path_len,
+      &minor_version, headers, &num_headers, 0);
+  if (pret <= 0 || std::string_view(path, path_len) != target) {
+    return reactor_result::deferred;
+  }
+  bool keep_alive = minor_version == 1;
+  for (size_t n = 0; n < num_headers; n++) {
+    std::string_view key(headers[n].name, headers[n].name_len);
+    std::string_view val(headers[n].value, headers[n].value_len);
+    if (header_name_equals(key, "Transfer-Encoding") || (header_name_equals(key, "Content-Length") && val != "0")) {
+      return reactor_result::deferred;
+    }
+    if (header_name_equals(key, "Connection")) {
+      if (header_name_equals(val, "keep-alive"))
+        keep_alive = true;
+      else if (header_name_equals(val, "close"))
+        keep_alive = false;
+    }
+  }
+
+  // Consume the request; this rewrites buf with the same bytes, so args
+  // and headers still point into it.
+  for (ssize_t got = 0; got < pret; ) {
+    while ((rret = recv(conn.fd, buf + got, (int) (pret - got), MSG_NOSIGNAL)) == -1 && errno == EINTR);
+    if (rret <= 0) {
+      return reactor_result::closed;
+    }
+    got += rret;
+  }
+  if (!set_socket_timeout(conn.fd, SO_SNDTIMEO, socket_timeout_ms)) {
+    return reactor_result::closed;
+  }
+
+  std::vector<header> req_headers;
+  req_headers.reserve(num_headers);
+  for (size_t n = 0; n < num_headers; n++) {
+    auto key = std::string(headers[n].name, headers[n].name_len);
+    camelize(key);
+    req_headers.emplace_back(std::move(key), std::string(headers[n].value, headers[n].value_len));
+  }
+  std::unordered_map<std::string, std::string> req_uri_params;
+  if (query != std::string_view::npos) {
+    parse_query_params(std::string(target.substr(query + 1)), req_uri_params);
+  }
+  request req(
+      std::move(req_method),
+      std::string(target),
+      std::string(target.substr(0, query)),
+      std::move(req_uri_params),
+      std::move(req_headers),
+      std::string());
+  req.minor_version = minor_version;
+
+  // The handler writes into out, which is then sent without blocking; a
+  // client that does not read cannot stall the reactor.
+  std::string out;
+  {
+    socket_capture_guard capture(out);
+    dispatch_request(
+        [&](const std::string&, const std::string&, route_method_set&, const auto& fn) {
+          fn(*handler, args);
+          return true;
+        },
+        conn.fd,
+        conn.remote,
+        req,
+        keep_alive,
+        write_config);
+  }
+  auto sent = send_nonblocking(conn.fd, out.data(), out.size());
+  if (sent < 0) {
+    return reactor_result::closed;
+  }
+  if ((size_t) sent < out.size()) {
+    out.erase(0, (size_t) sent);
+    conn.pending_output = std::move(out);
+    conn.pending_keep_alive = keep_alive;
+    return reactor_result::partial;
+  }
+  return keep_alive ? reactor_result::keep_alive : reactor_result::closed;
+}
+
+#ifdef CLASK_TEST
+bool server_t::test_match(const std::string& method, const std::string& s, const std::function<void(const func_t& fn, const route_args&)>& fn, route_method_set* allowed) const {
+  auto parsed_method = parse_route_method(method);
+  if (!parsed_method) {
+    return false;
+  }
+  rcu_read_guard guard;
+  route_args args;
+  auto handler = match(*parsed_method, s, args, allowed);
+  if (handler == nullptr) {
+    return false;
+  }
+  fn(*handler, args);
+  return true;
+}
+#endif
+
+inline void server_t::register_route(
+    route_method method,
+    const std::string& path,
+    func_t func) {
+  routes_->insert(method, path, std::move(func));
+}
+
+inline bool server_t::remove_route(const std::string& method, const std::string& path) {
+  auto parsed_method = parse_route_method(method);
+  return parsed_method && routes_->erase(*parsed_method, path);
 }
 
-typedef struct _node {
-  std::vector<struct _node> children;
-  std::string name;
-  func_t fn;
-  bool placeholder;
-} node;
+inline void server_t::use(middleware_fn fn) {
+  use("/", std::move(fn));
+}
 
-class server_t {
-private:
-  node get_routes_;
-  node post_routes_;
-  node query_routes_;
-  unsigned int worker_count_;
-  size_t accept_queue_limit_;
-  int socket_timeout_ms_;
-  node& route_tree(route_method);
-  const node& route_tree(route_method) const;
-  template <typename Functor>
-  void register_route(route_method, const std::string&, Functor&&);
-  void parse_tree(node&, const std::string&, const func_t&);
-  bool match(route_method, const std::string&, const std::function<void(const func_t& fn, const std::vector<std::string>&)>&) const;
-  bool handle_connection_socket(int, const std::string&, const server_runtime_config&) const;
-  void _run(const std::string&, int);
+inline void server_t::use(const std::string& prefix, middleware_fn fn) {
+  routes_->use(prefix, std::move(fn));
+}
 
-public:
-#define CLASK_DEFINE_REQUEST(name) \
-void GET(const std::string&, const functor_ ## name); \
-void POST(const std::string&, const functor_ ## name); \
-void QUERY(const std::string&, const functor_ ## name);
-  CLASK_DEFINE_REQUEST(writer)
-  CLASK_DEFINE_REQUEST(string)
-  CLASK_DEFINE_REQUEST(response)
-#undef CLASK_DEFINE_REQUEST
-  void static_dir(
-      const std::string&,
-      const std::string&,
-      bool listing = false,
-      const std::vector<header>& extra_headers = {});
-  server_t& worker_count(unsigned int) &;
-  server_t&& worker_count(unsigned int) &&;
-  server_t& accept_queue_limit(size_t) &;
-  server_t&& accept_queue_limit(size_t) &&;
-  server_t& socket_timeout(int) &;
-  server_t&& socket_timeout(int) &&;
-  void run(const std::string&);
-  void run(int);
-  logger log;
-  server_t() : get_routes_{}, post_routes_{}, query_routes_{}, worker_count_{0}, accept_queue_limit_{0}, socket_timeout_ms_{keep_alive_timeout_ms} {}
-#ifdef CLASK_TEST
-  bool test_match(const std::string&, const std::string&, const std::function<void(const func_t& fn, const std::vector<std::string>&)>&) const;
-#endif
-};
+inline void server_t::before(std::function<std::optional<response>(request&)> fn) {
+  before("/", std::move(fn));
+}
 
-inline server_t& server_t::worker_count(unsigned int v) & {
-  worker_count_ = v;
-  return *this;
+inline void server_t::before(const std::string& prefix, std::function<std::optional<response>(request&)> fn) {
+  use(prefix, [fn = std::move(fn)](request& req, const middleware_next& next) {
+    auto res = fn(req);
+    return res ? next.send(std::move(*res)) : next();
+  });
 }
 
-inline server_t&& server_t::worker_count(unsigned int v) && {
-  worker_count_ = v;
-  return std::move(*this);
+inline void server_t::after(std::function<void(request&, int)> fn) {
+  after("/", std::move(fn));
 }
 
-inline server_t& server_t::accept_queue_limit(size_t v) & {
-  accept_queue_limit_ = v;
-  return *this;
+inline void server_t::after(const std::string& prefix, std::function<void(request&, int)> fn) {
+  use(prefix, [fn = std::move(fn)](request& req, const middleware_next& next) {
+    auto code = next();
+    fn(req, code);
+    return code;
+  });
 }
 
-inline server_t&& server_t::accept_queue_limit(size_t v) && {
-  accept_queue_limit_ = v;
-  return std::move(*this);
+template <typename F>
+inline void server_t::GET(const std::string& path, F&& fn) {
+  register_route(route_method::get, path, func_t(std::forward<F>(fn)));
 }
 
-inline server_t& server_t::socket_timeout(int v) & {
-  socket_timeout_ms_ = v;
-  return *this;
+template <typename F>
+inline void server_t::POST(const std::string& path, F&& fn) {
+  register_route(route_method::post, path, func_t(std::forward<F>(fn)));
 }
 
-inline server_t&& server_t::socket_timeout(int v) && {
-  socket_timeout_ms_ = v;
-  return std::move(*this);
+template <typename F>
+inline void server_t::QUERY(const std::string& path, F&& fn) {
+  register_route(route_method::query, path, func_t(std::forward<F>(fn)));
 }
 
-inline node& server_t::route_tree(route_method method) {
-  if (method == route_method::get) {
-    return get_routes_;
-  }
-  if (method == route_method::query) {
-    return query_routes_;
-  }
-  return post_routes_;
+template <typename F>
+inline void server_t::PUT(const std::string& path, F&& fn) {
+  register_route(route_method::put, path, func_t(std::forward<F>(fn)));
 }
 
-inline const node& server_t::route_tree(route_method method) const {
-  if (method == route_method::get) {
-    return get_routes_;
-  }
-  if (method == route_method::query) {
-    return query_routes_;
-  }
-  return post_routes_;
+template <typename F>
+inline void server_t::PATCH(const std::string& path, F&& fn) {
+  register_route(route_method::patch, path, func_t(std::forward<F>(fn)));
 }
 
-inline void server_t::parse_tree(node& n, const std::string& s, const func_t& fn) {
-  auto segment = parse_path_segment(s, 0);
-  if (!segment.has_more) {
-    bool found = false;
-    for (auto& vv : n.children) {
-      if (vv.name == segment.value) {
-        vv.fn = fn;
-        found = true;
-        break;
-      }
-    }
-    if (!found) {
-      node nn =  {
-        .children = {},
-        .name = std::move(segment.value),
-        .fn = fn,
-        .placeholder = segment.placeholder,
-      };
-      n.children.emplace_back(nn);
-    }
-    return;
-  }
-  bool found = false;
-  for (auto& vv : n.children) {
-    if (vv.name == segment.value) {
-      found = true;
-      parse_tree(vv, s.substr(segment.next_offset), fn);
-      break;
-    }
-  }
-  if (!found) {
-    node nn = {
-      .children = {},
-      .name = std::move(segment.value),
-      .fn = {},
-      .placeholder = segment.placeholder,
-    };
-    parse_tree(nn, s.substr(segment.next_offset), fn);
-    n.children.emplace_back(std::move(nn));
-  }
+template <typename F>
+inline void server_t::DELETE(const std::string& path, F&& fn) {
+  register_route(route_method::delete_, path, func_t(std::forward<F>(fn)));
 }
 
-inline bool server_t::match(route_method method, const std::string& s, const std::function<void(const func_t& fn, const std::vector<std::string>&)>& fn) const {
-  const node* n = &route_tree(method);
-  std::vector<std::string> args;
-  const func_t* prefix_fn = nullptr;
-  std::vector<std::string> prefix_args;
-  size_t offset = 0;
-  while (offset < s.size()) {
-    for (const auto& vv : n->children) {
-      if (vv.name.empty() && vv.fn.prefix_match) {
-        prefix_fn = &vv.fn;
-        prefix_args = args;
-        break;
-      }
-    }
-    auto segment = parse_path_segment(s, offset);
-    bool found = false;
-    for (const auto& vv : n->children) {
-      if (!vv.placeholder
-          && (vv.name == segment.value || (vv.name.empty() && segment.value.empty()))) {
-        n = &vv;
-        found = true;
-        break;
-      }
-    }
-    if (!found) {
-      for (const auto& vv : n->children) {
-        if (vv.placeholder) {
-          args.emplace_back(url_decode(segment.value));
-          n = &vv;
-          found = true;
-          break;
-        }
-      }
-    }
-    if (!found)
-      break;
-    offset = segment.next_offset;
-    if (n->fn.prefix_match) {
-      prefix_fn = &n->fn;
-      prefix_args = args;
-    }
-    if (offset >= s.size()) {
-      fn(n->fn, args);
-      return true;
-    }
-  }
-  if (prefix_fn != nullptr) {
-    fn(*prefix_fn, prefix_args);
-    return true;
-  }
-  return false;
+template <typename F>
+inline void server_t::OPTIONS(const std::string& path, F&& fn) {
+  register_route(route_method::options, path, func_t(std::forward<F>(fn)));
 }
 
-inline bool server_t::handle_connection_socket(
-    int s,
-    const std::string& remote,
-    const server_runtime_config& config) const {
-  return handle_connection_request(
-      s,
-      remote,
-      config.socket_timeout_ms,
-      [&](const std::string& method, const std::string& path, const auto& fn) {
-        auto parsed_method = parse_route_method(method);
-        if (!parsed_method) {
-          return false;
-        }
-        return match(*parsed_method, path, fn);
-      });
+// The route table ignores what follows a placeholder's name, so the
+// pattern itself is registered.
+template <typename Path, typename F>
+inline void server_t::GET(route<Path> r, F&& fn) {
+  register_route(route_method::get, std::string(r.path()), func_t(typed_route_handler<route<Path>, std::decay_t<F>>{std::forward<F>(fn)}));
 }
 
-#ifdef CLASK_TEST
-bool server_t::test_match(const std::string& method, const std::string& s, const std::function<void(const func_t& fn, const std::vector<std::string>&)>& fn) const {
-  auto parsed_method = parse_route_method(method);
-  if (!parsed_method) {
-    return false;
-  }
-  return server_t::match(*parsed_method, s, fn);
+template <typename Path, typename F>
+inline void server_t::POST(route<Path> r, F&& fn) {
+  register_route(route_method::post, std::string(r.path()), func_t(typed_route_handler<route<Path>, std::decay_t<F>>{std::forward<F>(fn)}));
 }
-#endif
 
-inline void sort_handlers(node& n) {
-  std::sort(
-    n.children.begin(),
-    n.children.end(),
-    [](const node& x, const node& y){ return x.name > y.name; }
-  );
-  for (auto& v : n.children) {
-    sort_handlers(v);
-  }
+template <typename Path, typename F>
+inline void server_t::QUERY(route<Path> r, F&& fn) {
+  register_route(route_method::query, std::string(r.path()), func_t(typed_route_handler<route<Path>, std::decay_t<F>>{std::forward<F>(fn)}));
 }
 
-inline void prepare_handler_trees(node& get_routes, node& post_routes) {
-  sort_handlers(get_routes);
-  sort_handlers(post_routes);
+template <typename Path, typename F>
+inline void server_t::PUT(route<Path> r, F&& fn) {
+  register_route(route_method::put, std::string(r.path()), func_t(typed_route_handler<route<Path>, std::decay_t<F>>{std::forward<F>(fn)}));
 }
 
-template <typename Functor>
-inline void server_t::register_route(
-    route_method method,
-    const std::string& path,
-    Functor&& assign_functor) {
-  func_t func{};
-  assign_functor(func);
-  parse_tree(route_tree(method), path, func);
-}
-
-#define CLASK_DEFINE_REQUEST(name) \
-inline void server_t::GET(const std::string& path, functor_ ## name fn) { \
-  register_route(route_method::get, path, [&](func_t& func) { \
-    func.f_ ## name = std::move(fn); \
-  }); \
-} \
-inline void server_t::POST(const std::string& path, functor_ ## name fn) { \
-  register_route(route_method::post, path, [&](func_t& func) { \
-    func.f_ ## name = std::move(fn); \
-  }); \
-} \
-inline void server_t::QUERY(const std::string& path, functor_ ## name fn) { \
-  register_route(route_method::query, path, [&](func_t& func) { \
-    func.f_ ## name = std::move(fn); \
-  }); \
-}
-
-CLASK_DEFINE_REQUEST(writer)
-CLASK_DEFINE_REQUEST(string)
-CLASK_DEFINE_REQUEST(response)
-
-#undef CLASK_DEFINE_REQUEST
+template <typename Path, typename F>
+inline void server_t::PATCH(route<Path> r, F&& fn) {
+  register_route(route_method::patch, std::string(r.path()), func_t(typed_route_handler<route<Path>, std::decay_t<F>>{std::forward<F>(fn)}));
+}
+
+template <typename Path, typename F>
+inline void server_t::DELETE(route<Path> r, F&& fn) {
+  register_route(route_method::delete_, std::string(r.path()), func_t(typed_route_handler<route<Path>, std::decay_t<F>>{std::forward<F>(fn)}));
+}
+
+template <typename Path, typename F>
+inline void server_t::OPTIONS(route<Path> r, F&& fn) {
+  register_route(route_method::options, std::string(r.path()), func_t(typed_route_handler<route<Path>, std::decay_t<F>>{std::forward<F>(fn)}));
+}
 
 inline void serve_dir(
     response_writer& resp,
@@ -1843,76 +6467,411 @@ inline void serve_dir(
   resp.write("</body>\n</html>\n");
 }
 
+struct byte_range {
+  std::uint64_t first;
+  std::uint64_t last;
+};
+
+enum class range_status { full, partial, unsatisfiable };
+
+// More ranges than this are answered with the whole file rather than a
+// large multipart body.
+constexpr size_t max_byte_ranges = 16;
+
+inline std::optional<std::uint64_t> parse_range_number(std::string_view s) {
+  std::uint64_t v = 0;
+  if (s.empty()) {
+    return std::nullopt;
+  }
+  auto r = std::from_chars(s.data(), s.data() + s.size(), v);
+  if (r.ec != std::errc() || r.ptr != s.data() + s.size()) {
+    return std::nullopt;
+  }
+  return v;
+}
+
+// Parses a "bytes=" Range header against a representation of size bytes.
+// Malformed headers are ignored (full); ranges that start past the end are
+// dropped and, if none remain, the request is unsatisfiable.
+inline range_status parse_range_header(std::string_view value, std::uint64_t size, std::vector<byte_range>& ranges) {
+  ranges.clear();
+  constexpr std::string_view unit = "bytes=";
+  if (value.substr(0, unit.size()) != unit) {
+    return range_status::full;
+  }
+  value.remove_prefix(unit.size());
+  size_t count = 0;
+  while (!value.empty()) {
+    auto comma = value.find(',');
+    auto spec = value.substr(0, comma);
+    value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+    while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) spec.remove_prefix(1);
+    while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) spec.remove_suffix(1);
+    if (spec.empty()) {
+      continue;
+    }
+    if (++count > max_byte_ranges) {
+      ranges.clear();
+      return range_status::full;
+    }
+    auto dash = spec.find('-');
+    if (dash == std::string_view::npos) {
+      ranges.clear();
+      return range_status::full;
+    }
+    auto first = spec.substr(0, dash), last = spec.substr(dash + 1);
+    if (first.empty()) {
+      auto suffix = parse_range_number(last);
+      if (!suffix) {
+        ranges.clear();
+        return range_status::full;
+      }
+      if (*suffix > 0 && size > 0) {
+        ranges.push_back({size - std::min(*suffix, size), size - 1});
+      }
+      continue;
+    }
+    auto from = parse_range_number(first);
+    auto to = last.empty() ? std::optional<std::uint64_t>(UINT64_MAX) : parse_range_number(last);
+    if (!from || !to || *to < *from) {
+      ranges.clear();
+      return range_status::full;
+    }
+    if (*from < size) {
+      ranges.push_back({*from, std::min(*to, size - 1)});
+    }
+  }
+  if (count == 0) {
+    return range_status::full;
+  }
+  return ranges.empty() ? range_status::unsatisfiable : range_status::partial;
+}
+
+inline std::string make_multipart_boundary() {
+  thread_local std::mt19937_64 rng(std::random_device{}());
+  std::string boundary = "clask-";
+  append_number(boundary, rng(), 16);
+  return boundary;
+}
+
+inline std::string content_range(std::uint64_t first, std::uint64_t last, std::uint64_t size) {
+  std::string v = "bytes ";
+  append_number(v, first);
+  v += '-';
+  append_number(v, last);
+  v += '/';
+  append_number(v, size);
+  return v;
+}
+
+// Answers a satisfiable Range request for an open file: one range as a
+// plain 206, several as multipart/byteranges. Bodies go out through
+// write_file, so they keep the sendfile path.
+inline void write_byte_ranges(
+    response_writer& resp,
+    int fd,
+    std::uint64_t size,
+    const std::string& content_type,
+    const std::vector<byte_range>& ranges) {
+  resp.code = 206;
+  if (ranges.size() == 1) {
+    auto& r = ranges.front();
+    resp.set_header("content-range", content_range(r.first, r.last, size));
+    resp.set_header("content-length", std::to_string(r.last - r.first + 1));
+    resp.write_file(fd, r.first, (size_t) (r.last - r.first + 1));
+    return;
+  }
+  auto boundary = make_multipart_boundary();
+  std::vector<std::string> part_heads;
+  part_heads.reserve(ranges.size());
+  std::uint64_t length = 0;
+  for (auto& r : ranges) {
+    std::string head = "\r\n--" + boundary + "\r\n";
+    if (!content_type.empty()) {
+      append_header(head, "Content-Type", content_type);
+    }
+    append_header(head, "Content-Range", content_range(r.first, r.last, size));
+    head += "\r\n";
+    length += head.size() + (r.last - r.first + 1);
+    part_heads.emplace_back(std::move(head));
+  }
+  auto tail = "\r\n--" + boundary + "--\r\n";
+  length += tail.size();
+  resp.set_header("content-type", "multipart/byteranges; boundary=" + boundary);
+  resp.set_header("content-length", std::to_string(length));
+  for (size_t i = 0; i < ranges.size(); i++) {
+    resp.write(part_heads[i]);
+    resp.write_file(fd, ranges[i].first, (size_t) (ranges[i].last - ranges[i].first + 1));
+  }
+  resp.write(tail);
+}
+
+inline std::string static_content_type(const std::string& path) {
+  auto it = content_types.find(std::filesystem::path(to_wstring(path)).extension().string());
+  return it != content_types.end() ? it->second : std::string();
+}
+
+// If-None-Match takes precedence; If-Modified-Since is only consulted when
+// the client has no ETag.
+inline bool is_not_modified(
+    request& req,
+    const std::string& etag,
+    const std::string& last_modified,
+    std::time_t mtime) {
+  auto if_none_match = req.header_value("If-None-Match");
+  if (!if_none_match.empty()) {
+    return etag_matches(if_none_match, etag);
+  }
+  auto if_modified_since = req.header_value("If-Modified-Since");
+  if (if_modified_since.empty()) {
+    return false;
+  }
+  auto since = if_modified_since == last_modified
+      ? std::optional<std::time_t>(mtime)
+      : parse_http_date(if_modified_since);
+  return since && mtime <= *since;
+}
+
+// serve_file for a file that is already open and stat'ed.
+inline void serve_open_file(
+    response_writer& resp,
+    request& req,
+    const std::string& content_type,
+    const file_handle& file,
+    const file_info& info,
+    const std::vector<header>& extra_headers = {}) {
+  if (!content_type.empty()) {
+    resp.set_header("content-type", content_type);
+  }
+  for (const auto& h : extra_headers) {
+    resp.set_header(h.first, h.second);
+  }
+
+  auto etag = file_etag(info);
+  auto last_modified = format_http_date(info.mtime);
+  resp.set_header("accept-ranges", "bytes");
+  resp.set_header("content-length", std::to_string(info.size));
+
+  if (is_not_modified(req, etag, last_modified, info.mtime)) {
+    resp.clear_header();
+    for (const auto& h : extra_headers) {
+      resp.set_header(h.first, h.second);
+    }
+    resp.set_header("etag", etag);
+    resp.code = 304;
+    resp.write_headers();
+    return;
+  }
+
+  resp.set_header("etag", etag);
+  resp.set_header("last-modified", last_modified);
+
+  auto range = req.header_value("Range");
+  auto if_range = req.header_value("If-Range");
+  // A stale If-Range validator means the client's partial copy is out of
+  // date, so it gets the whole file.
+  if (!range.empty() && (if_range.empty() || if_range == last_modified || if_range == etag)) {
+    std::vector<byte_range> ranges;
+    switch (parse_range_header(range, info.size, ranges)) {
+      case range_status::partial:
+        write_byte_ranges(resp, file.fd(), info.size, content_type, ranges);
+        return;
+      case range_status::unsatisfiable: {
+        auto headers = extra_headers;
+        headers.emplace_back("Content-Range", "bytes */" + std::to_string(info.size));
+        write_status_text_response(resp, 416, headers);
+        return;
+      }
+      case range_status::full:
+        break;
+    }
+  }
+
+  resp.write_file(file.fd(), 0, (size_t) info.size);
+}
+
 inline void serve_file(
     response_writer& resp,
     request& req,
     const std::string& path,
     const std::vector<header>& extra_headers = {}) {
-  auto wpath = to_wstring(path);
-  std::filesystem::path fspath(wpath.c_str());
-
-  std::ifstream is(fspath, std::ios::in | std::ios::binary);
-  if (is.fail()) {
+  file_info info{};
+  auto file = open_regular_file(path, info);
+  if (!file) {
     write_status_text_response(resp, 404, extra_headers);
     return;
   }
+  serve_open_file(resp, req, static_content_type(path), *file, info, extra_headers);
+}
+
+// Reads a small file into a cache entry with its 200 and 304 header lines
+// serialized the way serve_open_file would send them.
+inline std::shared_ptr<cached_file> make_cached_file(
+    const std::string& content_type,
+    const file_handle& file,
+    const file_info& info,
+    const std::vector<header>& extra_headers) {
+  auto entry = std::make_shared<cached_file>();
+  entry->info = info;
+  entry->body.resize((size_t) info.size);
+  if (read_file_at(file.fd(), &entry->body[0], entry->body.size(), 0) != (long long) info.size) {
+    return nullptr;
+  }
+  entry->etag = file_etag(info);
+  entry->last_modified = format_http_date(info.mtime);
 
-  auto it = content_types.find(fspath.extension().string());
-  if (it != content_types.end()) {
-    resp.set_header("content-type", it->second);
+  std::vector<header> headers;
+  if (!content_type.empty()) {
+    headers.emplace_back("Content-Type", content_type);
   }
   for (const auto& h : extra_headers) {
-    resp.set_header(h.first, h.second);
+    auto key = h.first;
+    camelize(key);
+    auto existing = std::find_if(headers.begin(), headers.end(), [&](const header& x) { return x.first == key; });
+    if (existing != headers.end()) {
+      existing->second = h.second;
+    } else {
+      headers.emplace_back(key, h.second);
+    }
+  }
+  for (auto& h : headers) {
+    append_header(entry->header_lines, h.first, h.second);
+  }
+  for (const auto& h : extra_headers) {
+    auto key = h.first;
+    append_header(entry->not_modified_lines, camelize(key), h.second);
   }
+  append_header(entry->not_modified_lines, "Etag", entry->etag);
+  append_header(entry->header_lines, "Accept-Ranges", "bytes");
+  append_header(entry->header_lines, "Content-Length", std::to_string(info.size));
+  append_header(entry->header_lines, "Etag", entry->etag);
+  append_header(entry->header_lines, "Last-Modified", entry->last_modified);
+  return entry;
+}
 
-  std::uintmax_t size = std::filesystem::file_size(fspath);
-  resp.set_header("content-length", std::to_string(size));
-
-  std::filesystem::file_time_type file_time = std::filesystem::last_write_time(fspath);
-  std::time_t tt = to_time_t(file_time);
-  std::tm *gmt = std::gmtime(&tt);
-  for (auto& h : req.headers) {
-    if (h.first == "If-Modified-Since") {
-      std::tm file_gmt{};
-      std::istringstream ss(h.second);
-      ss >> std::get_time(&file_gmt, "%a, %d %b %Y %H:%M:%S");
-      if (!ss.fail() && std::mktime(gmt) <= std::mktime(&file_gmt)) {
-        resp.clear_header();
-        for (const auto& h : extra_headers) {
-          resp.set_header(h.first, h.second);
-        }
-        resp.code = 304;
-        resp.write_headers();
-        return;
-      }
-      break;
+// The cache key of path served by mount. Two mounts that reach the same
+// file keep separate entries, each with its own headers.
+inline std::string static_cache_key(size_t mount, const std::string& path) {
+  std::string key;
+  key.reserve(path.size() + 8);
+  append_number(key, mount);
+  key += ':';
+  key += path;
+  return key;
+}
+
+// Serves path from the cache under key, filling it on a miss. A hit
+// takes the cache lock once. The stat that revalidates an entry, at most
+// once per second, runs outside it so a slow filesystem does not
+// serialize workers. Returns false, without writing anything, when path
+// is not a regular file.
+inline bool serve_cached_file(
+    response_writer& resp,
+    request& req,
+    const std::string& path,
+    const std::string& key,
+    static_file_cache::lookup_result cached,
+    const std::string& content_type,
+    const std::vector<header>& extra_headers,
+    static_file_cache& cache) {
+  auto now = http_date::now();
+  auto entry = std::move(cached.entry);
+  if (entry && entry->checked_at.load(std::memory_order_relaxed) != now) {
+    file_info current{};
+    if (!stat_regular_file(path, current) || !same_file_version(current, entry->info)) {
+      cache.erase(key);
+      entry = nullptr;
+    } else {
+      entry->checked_at.store(now, std::memory_order_relaxed);
+    }
+  }
+  // Ranges are rare enough to take the regular path.
+  if (!entry || !req.header_value("Range").empty()) {
+    file_info info{};
+    auto file = open_regular_file(path, info);
+    if (!file) {
+      return false;
+    }
+    if (info.size > cached.max_file_size || !req.header_value("Range").empty()) {
+      serve_open_file(resp, req, content_type, *file, info, extra_headers);
+      return true;
     }
+    auto fresh = make_cached_file(content_type, *file, info, extra_headers);
+    if (!fresh) {
+      serve_open_file(resp, req, content_type, *file, info, extra_headers);
+      return true;
+    }
+    fresh->checked_at.store(now, std::memory_order_relaxed);
+    cache.insert(key, fresh);
+    entry = std::move(fresh);
+  }
+  if (is_not_modified(req, entry->etag, entry->last_modified, entry->info.mtime)) {
+    resp.write_prepared(304, entry->not_modified_lines, {});
+    return true;
+  }
+  resp.write_prepared(200, entry->header_lines, entry->body);
+  return true;
+}
+
+// Serves path through the cache when it is enabled. Returns false, without
+// writing anything, when path is not a regular file.
+inline bool serve_static_path(
+    response_writer& resp,
+    request& req,
+    size_t mount,
+    const std::string& path,
+    const std::string& content_type,
+    const std::vector<header>& extra_headers,
+    static_file_options& options) {
+  auto key = static_cache_key(mount, path);
+  auto cached = options.cache.lookup(key);
+  if (cached.enabled) {
+    return serve_cached_file(resp, req, path, key, std::move(cached), content_type, extra_headers, options.cache);
+  }
+  file_info info{};
+  auto file = open_regular_file(path, info);
+  if (!file) {
+    return false;
   }
+  serve_open_file(resp, req, content_type, *file, info, extra_headers);
+  return true;
+}
 
-  std::stringstream date;
-  date << std::put_time(gmt, "%a, %d %b %Y %H:%M:%S GMT");
-  resp.set_header("last-modified", date.str());
+struct precompressed_variant {
+  const char* coding;
+  const char* extension;
+};
 
-  char buf[BUFSIZ];
-  while (!is.eof()) {
-    resp.write(buf, (size_t) is.read(buf, sizeof(buf)).gcount());
+// Variants the client accepts, best first; ties keep the server's order,
+// which favours the densest encoding.
+inline std::vector<precompressed_variant> negotiate_precompressed(std::string_view accept) {
+  static constexpr precompressed_variant variants[] = {
+    {"br", ".br"},
+    {"zstd", ".zst"},
+    {"gzip", ".gz"},
+  };
+  std::vector<std::pair<int, precompressed_variant>> ranked;
+  for (auto& v : variants) {
+    auto q = accept_encoding_quality(accept, v.coding);
+    if (q > 0) {
+      ranked.emplace_back(q, v);
+    }
   }
+  std::stable_sort(ranked.begin(), ranked.end(), [](const auto& x, const auto& y) { return x.first > y.first; });
+  std::vector<precompressed_variant> result;
+  for (auto& r : ranked) {
+    result.push_back(r.second);
+  }
+  return result;
 }
 
 inline void serve_not_found(
     response_writer& resp,
     const std::string& dir,
     const std::vector<header>& extra_headers = {}) {
-  auto page = dir + "/404.html";
-  auto wpath = to_wstring(page);
-  std::filesystem::path fspath(wpath.c_str());
-  std::error_code ec;
-  if (!std::filesystem::is_regular_file(fspath, ec)) {
-    write_status_text_response(resp, 404, extra_headers);
-    return;
-  }
-  std::ifstream is(fspath, std::ios::in | std::ios::binary);
-  if (is.fail()) {
+  file_info info{};
+  auto file = open_regular_file(dir + "/404.html", info);
+  if (!file) {
     write_status_text_response(resp, 404, extra_headers);
     return;
   }
@@ -1921,14 +6880,12 @@ inline void serve_not_found(
   for (const auto& h : extra_headers) {
     resp.set_header(h.first, h.second);
   }
-  auto size = std::filesystem::file_size(fspath, ec);
-  if (!ec) {
-    resp.set_header("content-length", std::to_string(size));
-  }
-  char buf[BUFSIZ];
-  while (!is.eof()) {
-    resp.write(buf, (size_t) is.read(buf, sizeof(buf)).gcount());
-  }
+  resp.set_header("content-length", std::to_string(info.size));
+  resp.write_file(file->fd(), 0, (size_t) info.size);
+}
+
+inline void server_t::constant(const std::string& path, const response& res) {
+  register_route(route_method::get, path, func_t(inline_handler(constant_response(res))));
 }
 
 inline void server_t::static_dir(
@@ -1936,42 +6893,55 @@ inline void server_t::static_dir(
     const std::string& dir,
     bool listing,
     const std::vector<header>& extra_headers) {
-  register_route(route_method::get, path, [&](func_t& func) {
-    func.prefix_match = true;
-    func.f_writer = [path, dir, listing, extra_headers](response_writer& resp, request& req) {
-      auto resolved = resolve_static_path(req.uri, path, dir);
-      if (resolved.forbidden) {
-        write_status_text_response(resp, 403, extra_headers);
-        return;
-      }
-      if (!resolved.matched) {
-        write_status_text_response(resp, 404, extra_headers);
+  auto mount = static_files_->next_mount++;
+  func_t func = [path, dir, listing, extra_headers, mount, files = static_files_](response_writer& resp, request& req) {
+    auto resolved = resolve_static_path(req.uri, path, dir);
+    if (resolved.forbidden) {
+      write_status_text_response(resp, 403, extra_headers);
+      return;
+    }
+    if (!resolved.matched) {
+      write_status_text_response(resp, 404, extra_headers);
+      return;
+    }
+
+    auto req_path = std::move(resolved.path);
+    if (!req_path.empty() && req_path[req_path.size() - 1] == '/') {
+      if (listing) {
+        serve_dir(resp, req, req_path, extra_headers);
         return;
       }
+      req_path += "index.html";
+    }
 
-      auto req_path = std::move(resolved.path);
-      if (!req_path.empty() && req_path[req_path.size() - 1] == '/') {
-        if (listing) {
-          serve_dir(resp, req, req_path, extra_headers);
+    auto content_type = static_content_type(req_path);
+    auto headers = &extra_headers;
+    std::vector<header> varied;
+    if (files->precompressed) {
+      // Every response from this mount depends on Accept-Encoding, so
+      // caches must key on it even when the identity file is sent.
+      varied = extra_headers;
+      varied.emplace_back("Vary", "Accept-Encoding");
+      headers = &varied;
+      for (auto& variant : negotiate_precompressed(req.header_value("Accept-Encoding"))) {
+        auto encoded = varied;
+        encoded.emplace_back("Content-Encoding", variant.coding);
+        if (serve_static_path(resp, req, mount, req_path + variant.extension, content_type, encoded, *files)) {
           return;
         }
-        req_path += "index.html";
-      }
-
-      std::error_code ec;
-      auto wpath = to_wstring(req_path);
-      if (!std::filesystem::is_regular_file(std::filesystem::path(wpath.c_str()), ec)) {
-        serve_not_found(resp, dir, extra_headers);
-        return;
       }
-      serve_file(resp, req, req_path, extra_headers);
-    };
-  });
+    }
+    if (!serve_static_path(resp, req, mount, req_path, content_type, *headers, *files)) {
+      serve_not_found(resp, dir, extra_headers);
+    }
+  };
+  func.prefix_match = true;
+  register_route(route_method::get, path, std::move(func));
 }
 
 inline void server_t::_run(const std::string& host, int port = 8080) {
   initialize_network_runtime();
-  prepare_handler_trees(get_routes_, post_routes_);
+  routes_->go_live();
 
   auto server_fd = create_listening_socket(host, port);
   auto config = resolve_server_runtime_config(
@@ -1979,6 +6949,41 @@ inline void server_t::_run(const std::string& host, int port = 8080) {
       accept_queue_limit_,
       socket_timeout_ms_);
   server_runtime_state runtime;
+  body_budget budget(body_memory_limit_);
+  request_read_config read_config{
+    .max_body_size = max_body_size_,
+    .body_spill_threshold = body_spill_threshold_,
+    .budget = &budget,
+    .max_header_size = max_header_size_,
+    .max_header_count = max_header_count_,
+    .decompress = decompress_request_body_,
+    .max_decompressed_size = max_decompressed_body_size_,
+    .max_decompression_ratio = max_decompression_ratio_,
+    .stream_body = [this](const std::string& method, const std::string& path) {
+      auto parsed_method = parse_route_method(method);
+      if (!parsed_method) {
+        return false;
+      }
+      rcu_read_guard guard;
+      route_args args;
+      auto handler = match(*parsed_method, path, args, nullptr);
+      return handler != nullptr && handler->streams_body;
+    },
+  };
+  response_write_config write_config{
+    .output_buffer_size = output_buffer_size_,
+    .etag_responses = etag_responses_,
+    .compress = compress_responses_,
+    .compression_level = compression_level_,
+    .compression_min_size = compression_min_size_,
+  };
+
+  runtime.serve_inline = [&](connection_state& conn) {
+    return serve_inline(conn, config.socket_timeout_ms, write_config);
+  };
+  runtime.inline_routes = &routes_->inline_routes();
+  // This thread becomes the reactor.
+  access_log::never_wait() = true;
 
   run_server_event_loop(
       server_fd,
@@ -1986,7 +6991,7 @@ inline void server_t::_run(const std::string& host, int port = 8080) {
       config.accept_queue_limit,
       runtime,
       [&](int s, const std::string& remote) {
-        return handle_connection_socket(s, remote, config);
+        return handle_connection_socket(s, remote, config, read_config, write_config);
       });
 }
 
@@ -235,6 +235,142 @@ void test_clask_request_parse_multipart6() {
   _ok(result == false, R"(result == false)");
 }
 
+class recording_part_sink : public clask::part_sink {
+public:
+  std::vector<std::string> names;
+  std::vector<std::string> bodies;
+  bool begin(const clask::part_header_views& hv) override {
+    names.push_back(hv.name());
+    bodies.emplace_back();
+    return true;
+  }
+  bool write(const char* data, size_t len) override {
+    bodies.back().append(data, len);
+    return true;
+  }
+  bool end() override {
+    return true;
+  }
+};
+
+void test_clask_multipart_parser_chunked_input() {
+  const std::string body =
+      "preamble\r\n"
+      "--xyz\r\n"
+      "Content-Disposition: form-data; name=\"field1\"\r\n"
+      "\r\n"
+      "value1 with --xy inside\r\n"
+      "--xyz\r\n"
+      "content-disposition: form-data; name=\"field2\"\r\n"
+      "\r\n"
+      "\r\n--xy\r\n"
+      "--xyz--\r\n"
+      "epilogue";
+  for (size_t step : {(size_t) 1, (size_t) 3, (size_t) 7, body.size()}) {
+    recording_part_sink sink;
+    clask::multipart_parser parser("xyz", sink);
+    auto fed = true;
+    for (size_t off = 0; off < body.size(); off += step) {
+      fed = fed && parser.feed(body.data() + off, std::min(step, body.size() - off));
+    }
+    _ok(fed == true, R"(fed == true)");
+    _ok(parser.finish() == true, R"(parser.finish() == true)");
+    _ok(sink.names.size() == 2, R"(sink.names.size() == 2)");
+    _ok(sink.names.size() == 2 && sink.names[1] == "field2", R"(sink.names[1] == "field2")");
+    _ok(
+        sink.bodies.size() == 2 && sink.bodies[0] == "value1 with --xy inside",
+        R"(sink.bodies[0] == "value1 with --xy inside")");
+    _ok(
+        sink.bodies.size() == 2 && sink.bodies[1] == "\r\n--xy",
+        R"(sink.bodies[1] == "\r\n--xy")");
+  }
+}
+
+void test_clask_multipart_parser_unterminated() {
+  recording_part_sink sink;
+  clask::multipart_parser parser("xyz", sink);
+  const std::string body =
+      "--xyz\r\n"
+      "Content-Disposition: form-data; name=\"field1\"\r\n"
+      "\r\n"
+      "value1";
+  _ok(parser.feed(body.data(), body.size()) == true, R"(parser.feed(...) == true)");
+  _ok(parser.finish() == false, R"(parser.finish() == false)");
+
+  clask::multipart_parser broken("xyz", sink);
+  const std::string garbage = "--xyzXX";
+  _ok(broken.feed(garbage.data(), garbage.size()) == false, R"(broken.feed(...) == false)");
+}
+
+void test_clask_multipart_fd_part_sink() {
+  const std::string path = "./test_multipart_sink.bin";
+  clask::fd_part_sink sink([&](const clask::part_header_views& hv) {
+    if (hv.filename() != "a.bin") {
+      return -1;
+    }
+    return ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  });
+  clask::request req(
+      "POST",
+      "/",
+      "/",
+      {},
+      {
+        { "Content-Type", "multipart/form-data; boundary=b" },
+      },
+      "--b\r\n"
+      "Content-Disposition: form-data; name=\"skip\"\r\n"
+      "\r\n"
+      "ignored\r\n"
+      "--b\r\n"
+      "Content-Disposition: form-data; name=\"file\"; filename=\"a.bin\"\r\n"
+      "\r\n"
+      "payload\r\n"
+      "--b--\r\n");
+  _ok(req.parse_multipart(sink) == true, R"(req.parse_multipart(sink) == true)");
+  std::ifstream is(path, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+  _ok(content == "payload", R"(content == "payload")");
+  remove(path.c_str());
+}
+
+void test_clask_multipart_streamed_body() {
+  std::string payload(1 << 20, 'p');
+  std::string body =
+      "--b\r\n"
+      "Content-Disposition: form-data; name=\"file\"; filename=\"a.bin\"\r\n"
+      "\r\n" + payload + "\r\n"
+      "--b--\r\n";
+  std::string raw =
+      "POST /upload HTTP/1.1\r\n"
+      "Content-Type: multipart/form-data; boundary=b\r\n"
+      "Content-Length: " + std::to_string(body.size()) + "\r\n"
+      "\r\n" + body;
+  int fds[2];
+  _ok(make_socket_pair(fds) == true, R"(make_socket_pair(fds) == true)");
+  std::thread writer([&] {
+    socket_write(fds[0], raw.data(), raw.size());
+  });
+  clask::request_read_config config{};
+  config.stream_body = [](const std::string& method, const std::string& path) {
+    return method == "POST" && path == "/upload";
+  };
+  auto result = clask::read_request_from_socket(fds[1], config);
+  _ok(result.ok, R"(headers read)");
+  auto& req = *result.req;
+  _ok(req.body_unread > 0 && req.body.size() + req.body_unread == body.size(), R"(body is left on the socket)");
+  recording_part_sink sink;
+  _ok(req.parse_multipart(sink) == true, R"(parts parsed from the socket)");
+  _ok(sink.bodies.size() == 1 && sink.bodies[0] == payload, R"(streamed part body)");
+  _ok(req.body_unread == 0, R"(whole body consumed)");
+  writer.join();
+  closesocket(fds[0]);
+  closesocket(fds[1]);
+
+  clask::func_t fn(clask::stream_body([](clask::request&) -> std::string { return "ok"; }));
+  _ok(fn.streams_body && !fn.reactor_inline, R"(stream_body marks the handler)");
+}
+
 void test_clask_part_unquoted_last_param() {
   {
     clask::part p;
@@ -338,7 +474,8 @@ void test_clask_request_uri_param() {
       .args = {},
     },
     {
-      .result = true,
+      // Stops before the placeholder, so no handler is registered here.
+      .result = false,
       .path = "/foo",
       .args = {},
     },
@@ -365,8 +502,8 @@ void test_clask_request_uri_param() {
   });
   for(auto x : tests) {
     std::vector<std::string> req_args;
-    auto result = s.test_match("GET", x.path, [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
-      req_args = args;
+    auto result = s.test_match("GET", x.path, [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
+      req_args = args.decode();
     });
     _ok(result == x.result, R"(result == x.result)");
     _ok(req_args.size() == x.args.size(), R"(req.args.size() == x.args.size())");
@@ -380,14 +517,14 @@ void test_clask_post_route_match() {
   });
 
   std::vector<std::string> req_args;
-  auto result = s.test_match("POST", "/submit/42", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
-    req_args = args;
+  auto result = s.test_match("POST", "/submit/42", [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
+    req_args = args.decode();
   });
   _ok(result == true, R"(result == true)");
   _ok(req_args.size() == 1, R"(req_args.size() == 1)");
   _ok(req_args[0] == "42", R"(req_args[0] == "42")");
 
-  auto invalid = s.test_match("PUT", "/submit/42", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& /*args*/) {
+  auto invalid = s.test_match("PUT", "/submit/42", [&](const clask::func_t& /*fn*/, const clask::route_args& /*args*/) {
   });
   _ok(invalid == false, R"(invalid == false)");
 }
@@ -399,14 +536,14 @@ void test_clask_query_route_match() {
   });
 
   std::vector<std::string> req_args;
-  auto result = s.test_match("QUERY", "/search/42", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
-    req_args = args;
+  auto result = s.test_match("QUERY", "/search/42", [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
+    req_args = args.decode();
   });
   _ok(result == true, R"(result == true)");
   _ok(req_args.size() == 1, R"(req_args.size() == 1)");
   _ok(req_args[0] == "42", R"(req_args[0] == "42")");
 
-  auto other_method = s.test_match("GET", "/search/42", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& /*args*/) {
+  auto other_method = s.test_match("GET", "/search/42", [&](const clask::func_t& /*fn*/, const clask::route_args& /*args*/) {
   });
   _ok(other_method == false, R"(other_method == false)");
 }
@@ -417,16 +554,40 @@ void test_clask_root_route_match() {
     return "root";
   });
 
-  auto result = s.test_match("GET", "/", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
+  auto result = s.test_match("GET", "/", [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
     _ok(args.empty() == true, R"(args.empty() == true)");
   });
   _ok(result == true, R"(result == true)");
 
-  auto miss = s.test_match("GET", "/root", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& /*args*/) {
+  auto miss = s.test_match("GET", "/root", [&](const clask::func_t& /*fn*/, const clask::route_args& /*args*/) {
   });
   _ok(miss == false, R"(miss == false)");
 }
 
+static std::string response_payload(const std::string& out) {
+  auto pos = out.find("\r\n\r\n");
+  return pos == std::string::npos ? "" : out.substr(pos + 4);
+}
+
+// Runs a matched handler against a socket pair and returns the response body.
+static std::string handler_body(const clask::func_t& fn, clask::request& req) {
+  int fds[2];
+  if (!make_socket_pair(fds)) {
+    return "";
+  }
+  bool keep_alive = false;
+  fn.handle(fds[1], req, keep_alive);
+  closesocket(fds[1]);
+  std::string out;
+  char buf[4096];
+  ssize_t n;
+  while ((n = recv(fds[0], buf, sizeof(buf), 0)) > 0) {
+    out.append(buf, (size_t) n);
+  }
+  closesocket(fds[0]);
+  return response_payload(out);
+}
+
 void test_clask_literal_route_priority() {
   auto s = clask::server();
   s.GET("/:id", [](clask::request& req) -> std::string {
@@ -437,10 +598,10 @@ void test_clask_literal_route_priority() {
   });
 
   auto matched_literal = false;
-  auto result = s.test_match("GET", "/about", [&](const clask::func_t& fn, const std::vector<std::string>& args) {
+  auto result = s.test_match("GET", "/about", [&](const clask::func_t& fn, const clask::route_args& args) {
     clask::request req("GET", "/about", "/about", {}, {}, "");
-    req.args = args;
-    matched_literal = fn.f_string(req) == "about";
+    req.args = args.decode();
+    matched_literal = handler_body(fn, req) == "about";
   });
   _ok(result == true, R"(result == true)");
   _ok(matched_literal == true, R"(matched_literal == true)");
@@ -456,19 +617,19 @@ void test_clask_route_register_after_child() {
   });
 
   auto matched_foo = false;
-  auto result = s.test_match("GET", "/foo", [&](const clask::func_t& fn, const std::vector<std::string>& args) {
+  auto result = s.test_match("GET", "/foo", [&](const clask::func_t& fn, const clask::route_args& args) {
     clask::request req("GET", "/foo", "/foo", {}, {}, "");
-    req.args = args;
-    matched_foo = fn.f_string != nullptr && fn.f_string(req) == "foo";
+    req.args = args.decode();
+    matched_foo = handler_body(fn, req) == "foo";
   });
   _ok(result == true, R"(result == true)");
   _ok(matched_foo == true, R"(matched_foo == true)");
 
   auto matched_bar = false;
-  result = s.test_match("GET", "/foo/bar", [&](const clask::func_t& fn, const std::vector<std::string>& args) {
+  result = s.test_match("GET", "/foo/bar", [&](const clask::func_t& fn, const clask::route_args& args) {
     clask::request req("GET", "/foo/bar", "/foo/bar", {}, {}, "");
-    req.args = args;
-    matched_bar = fn.f_string != nullptr && fn.f_string(req) == "bar";
+    req.args = args.decode();
+    matched_bar = handler_body(fn, req) == "bar";
   });
   _ok(result == true, R"(result == true)");
   _ok(matched_bar == true, R"(matched_bar == true)");
@@ -478,17 +639,17 @@ void test_clask_static_dir_route_match() {
   auto s = clask::server();
   s.static_dir("/", "./public");
 
-  auto root = s.test_match("GET", "/", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
+  auto root = s.test_match("GET", "/", [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
     _ok(args.empty() == true, R"(args.empty() == true)");
   });
   _ok(root == true, R"(root == true)");
 
-  auto file = s.test_match("GET", "/hello.txt", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
+  auto file = s.test_match("GET", "/hello.txt", [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
     _ok(args.empty() == true, R"(args.empty() == true)");
   });
   _ok(file == true, R"(file == true)");
 
-  auto nested = s.test_match("GET", "/sub/index.html", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
+  auto nested = s.test_match("GET", "/sub/index.html", [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
     _ok(args.empty() == true, R"(args.empty() == true)");
   });
   _ok(nested == true, R"(nested == true)");
@@ -498,21 +659,653 @@ void test_clask_non_root_static_dir_route_match() {
   auto s = clask::server();
   s.static_dir("/files", "./files");
 
-  auto root = s.test_match("GET", "/files", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
+  auto root = s.test_match("GET", "/files", [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
     _ok(args.empty() == true, R"(args.empty() == true)");
   });
   _ok(root == true, R"(root == true)");
 
-  auto nested = s.test_match("GET", "/files/readme.txt", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
+  auto nested = s.test_match("GET", "/files/readme.txt", [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
     _ok(args.empty() == true, R"(args.empty() == true)");
   });
   _ok(nested == true, R"(nested == true)");
 
-  auto miss = s.test_match("GET", "/files-other/readme.txt", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& /*args*/) {
+  auto miss = s.test_match("GET", "/files-other/readme.txt", [&](const clask::func_t& /*fn*/, const clask::route_args& /*args*/) {
   });
   _ok(miss == false, R"(miss == false)");
 }
 
+static std::string route_name(const clask::route_table& t, const std::string& path, std::vector<std::string>& args) {
+  clask::route_args route_args;
+  auto fn = t.match(clask::route_method::get, path, route_args);
+  args.assign(route_args.begin(), route_args.end());
+  if (fn == nullptr) {
+    return "";
+  }
+  clask::request req("GET", path, path, {}, {}, "");
+  return handler_body(*fn, req);
+}
+
+void test_clask_route_table() {
+  clask::route_trie trie;
+  auto add = [&](const std::string& path, bool prefix = false) {
+    clask::func_t fn([path](clask::request&) { return path; });
+    fn.prefix_match = prefix;
+    trie.insert(clask::route_method::get, path, std::move(fn));
+  };
+  add("/user");
+  add("/users");
+  add("/users/:id");
+  add("/users/:id/posts/:post");
+  add("/users/me/settings");
+  add("/assets", true);
+  auto t = trie.compile();
+  _ok(t.static_route_count() == 3, R"(placeholder and prefix routes are not indexed)");
+
+  std::vector<std::string> args;
+  _ok(route_name(t, "/user", args) == "/user", R"(shared prefix, shorter route)");
+  _ok(route_name(t, "/users", args) == "/users", R"(shared prefix, longer route)");
+  _ok(route_name(t, "/userx", args).empty(), R"(partial segment does not match)");
+  _ok(route_name(t, "/users/42", args) == "/users/:id" && args == std::vector<std::string>{"42"}, R"(placeholder capture)");
+  _ok(route_name(t, "/users/42/posts/7", args) == "/users/:id/posts/:post" && args == std::vector<std::string>{"42", "7"}, R"(two captures)");
+  _ok(route_name(t, "/users/me/settings", args) == "/users/me/settings" && args.empty(), R"(static segment wins)");
+  _ok(route_name(t, "/users/me/posts/1", args) == "/users/:id/posts/:post" && args[0] == "me", R"(dead static branch backtracks to the placeholder)");
+  _ok(route_name(t, "/assets/app.js", args) == "/assets", R"(prefix route)");
+  _ok(route_name(t, "/assets2", args).empty(), R"(prefix ends on a segment boundary)");
+
+  clask::route_args views;
+  std::string uri = "/users/a%20b";
+  t.match(clask::route_method::get, uri, views);
+  _ok(views.size() == 1 && views[0].data() == uri.data() + 7, R"(captures point into the path)");
+  _ok(views.decode() == std::vector<std::string>{"a b"}, R"(decode() percent-decodes)");
+
+  // Re-registering a path replaces its handler; the old table is unchanged.
+  trie.insert(clask::route_method::get, "/user", clask::func_t([](clask::request&) { return std::string("replaced"); }));
+  _ok(route_name(trie.compile(), "/user", args) == "replaced", R"(route replaced)");
+  _ok(route_name(t, "/user", args) == "/user", R"(compiled table is a snapshot)");
+}
+
+void test_clask_func_t() {
+  // A move-only capture is accepted and the adapter follows the signature.
+  auto owned = std::make_unique<std::string>("owned");
+  clask::func_t small([p = std::move(owned)](clask::request&) { return *p; });
+  std::array<char, 256> blob{};
+  blob[0] = 'x';
+  clask::func_t large([blob](clask::request&) {
+    return clask::response{.code = 201, .content = std::string(blob.data(), 1)};
+  });
+  clask::func_t writer([](clask::response_writer& resp, clask::request&) {
+    resp.write("written");
+  });
+  clask::request req("GET", "/", "/", {}, {}, "");
+  req.minor_version = 0;
+  _ok(handler_body(small, req) == "owned", R"(inline string handler)");
+  _ok(handler_body(large, req) == "x", R"(heap stored response handler)");
+  _ok(handler_body(writer, req) == "written", R"(writer handler)");
+
+  clask::func_t moved(std::move(large));
+  _ok(!large && moved, R"(move leaves the source empty)");
+  _ok(handler_body(moved, req) == "x", R"(moved handler still runs)");
+  small = std::move(moved);
+  _ok(handler_body(small, req) == "x", R"(move assignment replaces the target)");
+}
+
+void test_clask_route_dsl() {
+  constexpr auto p = clask::parse_route_pattern("/zoo/:name/visits/:id<int>");
+  static_assert(p.param_count == 2);
+  static_assert(p.names[1] == "id" && p.kinds[1] == clask::route_param_kind::integer);
+  static_assert(p.literals[1] == "/visits/" && p.literals[2].empty());
+  auto malformed = [](std::string_view path) {
+    try {
+      clask::parse_route_pattern(path);
+    } catch (std::invalid_argument&) {
+      return true;
+    }
+    return false;
+  };
+  _ok(malformed("zoo"), R"(pattern must start with a slash)");
+  _ok(malformed("/zoo/:"), R"(placeholder needs a name)");
+  _ok(malformed("/zoo/:id<itn>"), R"(unknown placeholder type)");
+  _ok(malformed("/zoo/:id<[a-z]+"), R"(unclosed placeholder type)");
+  _ok(malformed("/zoo/:id/:id"), R"(duplicate placeholder)");
+  _ok(malformed("/zoo/:id.json"), R"(placeholder must end its segment)");
+  _ok(!malformed("/a:b/"), R"(colon inside a segment is literal)");
+
+  auto r = CLASK_ROUTE("/zoo/:name/visits/:id<int>");
+  static_assert(std::is_same_v<decltype(r)::args_type, std::tuple<std::string, std::int64_t>>);
+  auto m = r.match("/zoo/red%20panda/visits/42");
+  _ok(m && std::get<0>(*m) == "red panda" && std::get<1>(*m) == 42, R"(typed captures)");
+  _ok(!r.match("/zoo/panda/visits/4x2"), R"(int capture rejects non-digits)");
+  _ok(!r.match("/zoo/panda/visits/"), R"(empty capture)");
+  _ok(!r.match("/zoo/panda/visit/42"), R"(literal mismatch)");
+  _ok(CLASK_ROUTE("/").match("/").has_value(), R"(pattern without captures)");
+
+  auto s = clask::server();
+  s.GET(CLASK_ROUTE("/zoo/:name/visits/:id<int>"), [](clask::request&, std::string name, std::int64_t id) {
+    return name + "#" + std::to_string(id + 1);
+  });
+  auto run = [&](const std::string& uri) {
+    std::string out;
+    s.test_match("GET", uri, [&](const clask::func_t& fn, const clask::route_args& args) {
+      clask::request req("GET", uri, uri, {}, {}, "");
+      req.minor_version = 0;
+      req.args = args.decode();
+      out = handler_body(fn, req);
+    });
+    return out;
+  };
+  _ok(run("/zoo/red%20panda/visits/41") == "red panda#42", R"(typed handler)");
+  _ok(run("/zoo/panda/visits/abc").empty(), R"(non-integer capture does not match)");
+  _ok(run("/zoo/panda/visits/99999999999999999999") == "Not Found", R"(out of range capture answers 404)");
+
+  s.OPTIONS(CLASK_ROUTE("/zoo/:name"), [](clask::request&, std::string name) {
+    return "options " + name;
+  });
+  std::string out;
+  s.test_match("OPTIONS", "/zoo/owl", [&](const clask::func_t& fn, const clask::route_args& args) {
+    clask::request req("OPTIONS", "/zoo/owl", "/zoo/owl", {}, {}, "");
+    req.minor_version = 0;
+    req.args = args.decode();
+    out = handler_body(fn, req);
+  });
+  _ok(out == "options owl", R"(typed OPTIONS handler)");
+}
+
+void test_clask_middleware() {
+  auto s = clask::server();
+  s.GET("/admin/users", [](clask::request&) -> std::string { return "users"; });
+  s.GET("/adminx", [](clask::request&) -> std::string { return "adminx"; });
+  s.GET("/", [](clask::request&) -> std::string { return "home"; });
+
+  std::vector<std::string> trace;
+  s.use([&](clask::request& req, const clask::middleware_next& next) {
+    trace.push_back("outer " + req.uri);
+    auto code = next();
+    trace.push_back("outer done");
+    return code;
+  });
+  s.before("/admin", [&](clask::request& req) -> std::optional<clask::response> {
+    trace.push_back("auth");
+    if (req.header_value("Authorization").empty()) {
+      return clask::response{.code = 401, .content = std::string("denied"), .headers = {}};
+    }
+    return std::nullopt;
+  });
+  s.after([&](clask::request&, int code) {
+    trace.push_back("sent " + std::to_string(code));
+  });
+
+  auto run = [&](const std::string& uri, const std::vector<clask::header>& headers = {}) {
+    std::string out;
+    trace.clear();
+    s.test_match("GET", uri, [&](const clask::func_t& fn, const clask::route_args& args) {
+      clask::request req("GET", uri, uri, {}, headers, "");
+      req.minor_version = 0;
+      req.args = args.decode();
+      out = handler_body(fn, req);
+    });
+    return out;
+  };
+  _ok(run("/") == "home", R"(handler runs inside the chain)");
+  _ok((trace == std::vector<std::string>{"outer /", "sent 200", "outer done"}), R"(hooks run in registration order)");
+  _ok(run("/admin/users") == "denied", R"(before() answers instead of the handler)");
+  _ok((trace == std::vector<std::string>{"outer /admin/users", "auth", "outer done"}), R"(hooks inside the one that answered are skipped)");
+  _ok(run("/admin/users", {{"Authorization", "Bearer x"}}) == "users", R"(before() passes through)");
+  _ok(run("/adminx") == "adminx", R"(prefix ends on a segment boundary)");
+  _ok(std::find(trace.begin(), trace.end(), "auth") == trace.end(), R"(scoped hook skipped)");
+
+  // Placeholder and prefix routes check scoped hooks against the request
+  // path, not the pattern.
+  s.GET("/:page", [](clask::request& req) -> std::string { return req.args[0]; });
+  s.GET("/:section/panel", [](clask::request&) -> std::string { return "panel"; });
+  _ok(run("/admin") == "denied", R"(scoped hook runs for a placeholder route)");
+  _ok(run("/admin/panel") == "denied", R"(scoped hook runs under a placeholder segment)");
+  _ok(run("/about") == "about", R"(placeholder route outside the prefix)");
+  // Prefixes are checked against the decoded, normalized path the
+  // handler sees.
+  _ok(run("/%61dmin") == "denied", R"(percent-encoded prefix is checked)");
+  _ok(run("/%61dmin/panel") == "denied", R"(percent-encoded prefix under a placeholder segment)");
+  for (auto uri : {"//admin", "/./admin", "//admin/panel", "/./admin/panel", "/x/../admin"}) {
+    auto out = run(uri);
+    _ok(out.empty() || out == "denied", R"(non-canonical prefix is checked)");
+  }
+  _ok(std::find(trace.begin(), trace.end(), "auth") == trace.end(), R"(scoped hook skipped outside its prefix)");
+
+  auto files = clask::server();
+  bool checked = false;
+  files.before("/private", [&](clask::request&) -> std::optional<clask::response> {
+    checked = true;
+    return clask::response{.code = 403, .content = std::string("no"), .headers = {}};
+  });
+  files.static_dir("/", ".");
+  files.test_match("GET", "/private/key.pem", [&](const clask::func_t& fn, const clask::route_args&) {
+    clask::request req("GET", "/private/key.pem", "/private/key.pem", {}, {}, "");
+    req.minor_version = 0;
+    _ok(handler_body(fn, req) == "no" && checked, R"(scoped hook runs for a static_dir mount)");
+  });
+  for (std::string uri : {"/%70rivate/key.pem", "//private/key.pem", "/./private/key.pem"}) {
+    checked = false;
+    std::string out;
+    files.test_match("GET", uri, [&](const clask::func_t& fn, const clask::route_args&) {
+      clask::request req("GET", uri, uri, {}, {}, "");
+      req.minor_version = 0;
+      out = handler_body(fn, req);
+    });
+    _ok(out == "no" && checked, R"(scoped hook runs for a non-canonical static_dir path)");
+  }
+  _ok(clask::canonical_path("//a/./b/../c/%2e/") == "/a/c", R"(canonical_path)");
+  _ok(clask::canonical_path("") == "/" && clask::canonical_path("/..") == "/", R"(canonical_path root)");
+}
+
+void test_clask_route_registry() {
+  auto s = clask::server();
+  s.GET("/plugin", [](clask::request&) -> std::string { return "plugin"; });
+  auto found = [&](const std::string& uri) {
+    return s.test_match("GET", uri, [](const clask::func_t&, const clask::route_args&) {});
+  };
+  _ok(found("/plugin"), R"(route registered)");
+  _ok(s.remove_route("GET", "/plugin"), R"(remove_route)");
+  _ok(!found("/plugin"), R"(removed route no longer matches)");
+  _ok(!s.remove_route("GET", "/plugin"), R"(second remove finds nothing)");
+  _ok(!s.remove_route("GET", "/plug"), R"(remove needs the full path)");
+  s.GET("/items/:id", [](clask::request&) -> std::string { return "item"; });
+  _ok(s.remove_route("GET", "/items/:id") && !found("/items/1"), R"(remove placeholder route)");
+
+  // Readers keep matching while a writer swaps tables under them.
+  clask::route_registry registry;
+  registry.insert(clask::route_method::get, "/stable", clask::func_t([](clask::request&) { return std::string(); }));
+  registry.go_live();
+  std::atomic<bool> done{false};
+  std::atomic<size_t> misses{0};
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; i++) {
+    readers.emplace_back([&] {
+      while (!done.load()) {
+        clask::rcu_read_guard guard;
+        clask::route_args args;
+        auto fn = registry.snapshot().match(clask::route_method::get, "/stable", args);
+        if (fn == nullptr || !*fn) {
+          misses++;
+        }
+      }
+    });
+  }
+  for (int i = 0; i < 200; i++) {
+    auto path = "/flag/" + std::to_string(i % 10);
+    registry.insert(clask::route_method::get, path, clask::func_t([](clask::request&) { return std::string(); }));
+    registry.erase(clask::route_method::get, path);
+  }
+  done = true;
+  for (auto& t : readers) {
+    t.join();
+  }
+  _ok(misses == 0, R"(stable route matched throughout the swaps)");
+  clask::rcu_read_guard guard;
+  clask::route_args args;
+  _ok(registry.snapshot().match(clask::route_method::get, "/flag/3", args) == nullptr, R"(last swap is visible)");
+}
+
+void test_clask_route_methods() {
+  auto s = clask::server();
+  s.GET("/items/:id", [](clask::request&) -> std::string { return "get"; });
+  s.PUT("/items/:id", [](clask::request&) -> std::string { return "put"; });
+  s.DELETE("/items/:id", [](clask::request&) -> std::string { return "delete"; });
+  s.POST("/items/new", [](clask::request&) -> std::string { return "post"; });
+  s.PATCH("/custom", [](clask::request&) -> std::string { return "patch"; });
+  s.OPTIONS("/custom", [](clask::request&) -> std::string { return "custom options"; });
+
+  auto dispatch = [&](const std::string& method, const std::string& uri) {
+    int fds[2];
+    if (!make_socket_pair(fds)) {
+      return std::string();
+    }
+    clask::request req(method, uri, uri, {}, {}, "");
+    bool keep_alive = false;
+    clask::dispatch_request([&](const std::string& m, const std::string& u, clask::route_method_set& allowed, const auto& fn) {
+      return s.test_match(m, u, fn, &allowed);
+    }, fds[1], "test", req, keep_alive);
+    closesocket(fds[1]);
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fds[0], buf, sizeof(buf), 0)) > 0) {
+      out.append(buf, (size_t) n);
+    }
+    closesocket(fds[0]);
+    return out;
+  };
+  _ok(response_payload(dispatch("PUT", "/items/1")) == "put", R"(PUT route)");
+  _ok(response_payload(dispatch("DELETE", "/items/1")) == "delete", R"(DELETE route)");
+  _ok(response_payload(dispatch("GET", "/items/new")) == "get", R"(other method's static route falls back to the placeholder)");
+  _ok(response_payload(dispatch("POST", "/items/new")) == "post", R"(POST route)");
+
+  auto out = dispatch("PATCH", "/items/1");
+  _ok(out.find("HTTP/1.1 405 ") == 0, R"(405 for a method without a route)");
+  _ok(out.find("Allow: GET, HEAD, PUT, DELETE, OPTIONS\r\n") != std::string::npos, R"(Allow lists the path's methods)");
+  out = dispatch("PATCH", "/items/new");
+  _ok(out.find("Allow: GET, HEAD, POST, PUT, DELETE, OPTIONS\r\n") != std::string::npos, R"(Allow merges every route the path matches)");
+  out = dispatch("OPTIONS", "/items/1");
+  _ok(out.find("HTTP/1.1 204 ") == 0 && response_payload(out).empty(), R"(automatic OPTIONS)");
+  _ok(out.find("Content-Length") == std::string::npos, R"(204 has no Content-Length)");
+  _ok(out.find("Allow: GET, HEAD, PUT, DELETE, OPTIONS\r\n") != std::string::npos, R"(OPTIONS lists the path's methods)");
+  _ok(response_payload(dispatch("OPTIONS", "/custom")) == "custom options", R"(OPTIONS route overrides the automatic answer)");
+  _ok(dispatch("GET", "/nothing").find("HTTP/1.1 404 ") == 0, R"(404 for an unknown path)");
+  _ok(dispatch("OPTIONS", "/nothing").find("HTTP/1.1 404 ") == 0, R"(OPTIONS on an unknown path)");
+  _ok(dispatch("TRACE", "/items/1").find("HTTP/1.1 501 ") == 0, R"(501 for an unknown method)");
+
+  clask::route_method_set allowed = 0;
+  s.test_match("PATCH", "/items/1", [](const clask::func_t&, const clask::route_args&) {}, &allowed);
+  _ok(allowed == (clask::route_method_bit(clask::route_method::get) | clask::route_method_bit(clask::route_method::put) | clask::route_method_bit(clask::route_method::delete_)), R"(allowed set from test_match)");
+}
+
+void test_clask_route_constraints() {
+  constexpr clask::segment_constraint integer("int");
+  static_assert(integer.accepts("42") && integer.accepts("-7"));
+  static_assert(!integer.accepts("") && !integer.accepts("-") && !integer.accepts("4x"));
+  constexpr clask::segment_constraint slug("[a-z0-9-]+");
+  static_assert(slug.accepts("hello-world-2") && !slug.accepts("Hello") && !slug.accepts(""));
+  constexpr clask::segment_constraint not_dot("[^.]*");
+  static_assert(not_dot.accepts("") && not_dot.accepts("abc") && !not_dot.accepts("a.b"));
+  constexpr clask::segment_constraint uuid("uuid");
+  static_assert(uuid.accepts("123e4567-e89b-12d3-a456-426614174000"));
+  static_assert(!uuid.accepts("123e4567e89b12d3a456426614174000") && !uuid.accepts("123e4567-e89b-12d3-a456-42661417400g"));
+  auto malformed = [](std::string_view spec) {
+    try {
+      clask::segment_constraint c(spec);
+    } catch (std::invalid_argument&) {
+      return true;
+    }
+    return false;
+  };
+  _ok(malformed("float"), R"(unknown constraint)");
+  _ok(malformed("[a-z]"), R"(class needs a quantifier)");
+  _ok(malformed("[z-a]+"), R"(reversed range)");
+  _ok(malformed("[]+"), R"(empty class)");
+
+  clask::route_trie trie;
+  auto add = [&](const std::string& path) {
+    trie.insert(clask::route_method::get, path, clask::func_t([path](clask::request&) { return path; }));
+  };
+  add("/items/:name");
+  add("/items/:id<int>");
+  add("/items/:slug<[a-z-]+>/reviews");
+  add("/keys/:key<uuid>");
+  auto t = trie.compile();
+  std::vector<std::string> args;
+  _ok(route_name(t, "/items/42", args) == "/items/:id<int>" && args[0] == "42", R"(constrained placeholder wins)");
+  _ok(route_name(t, "/items/4x2", args) == "/items/:name", R"(failed constraint falls through)");
+  _ok(route_name(t, "/items/big-box/reviews", args) == "/items/:slug<[a-z-]+>/reviews", R"(class constraint)");
+  _ok(route_name(t, "/items/Big/reviews", args).empty(), R"(no route accepts the segment)");
+  _ok(route_name(t, "/keys/123e4567-e89b-12d3-a456-426614174000", args) == "/keys/:key<uuid>", R"(uuid constraint)");
+  _ok(route_name(t, "/keys/123", args).empty(), R"(invalid uuid is a 404)");
+
+  _ok(trie.erase(clask::route_method::get, "/items/:id<int>"), R"(erase constrained route)");
+  _ok(route_name(trie.compile(), "/items/42", args) == "/items/:name", R"(erased constraint no longer matches)");
+  bool threw = false;
+  try {
+    add("/bad/:id<[a-z]>");
+  } catch (std::invalid_argument&) {
+    threw = true;
+  }
+  _ok(threw, R"(malformed constraint is rejected at registration)");
+
+  auto r = CLASK_ROUTE("/keys/:key<uuid>/:n<int>");
+  _ok(r.match("/keys/123e4567-e89b-12d3-a456-426614174000/3").has_value(), R"(CLASK_ROUTE uuid)");
+  _ok(!r.match("/keys/nope/3").has_value(), R"(CLASK_ROUTE checks constraints)");
+}
+
+void test_clask_reactor_inline() {
+  auto s = clask::server();
+  s.GET("/healthz", clask::inline_handler([](clask::request& req) -> std::string { return "ok " + req.uri_params["v"]; }));
+  s.GET(CLASK_ROUTE("/n/:n<int>"), clask::inline_handler([](clask::request&, std::int64_t n) { return std::to_string(n + 1); }));
+  s.GET("/slow", [](clask::request&) -> std::string { return "slow"; });
+  s.POST("/healthz", clask::inline_handler([](clask::request&) -> std::string { return "posted"; }));
+  s.test_match("GET", "/healthz", [](const clask::func_t& fn, const clask::route_args&) {
+    _ok(fn.reactor_inline, R"(inline_handler sets reactor_inline)");
+  });
+  s.test_match("GET", "/slow", [](const clask::func_t& fn, const clask::route_args&) {
+    _ok(!fn.reactor_inline, R"(plain handlers are not reactor-inline)");
+  });
+
+  struct served {
+    clask::reactor_result result;
+    std::string out;
+    std::string left;
+  };
+  auto serve = [&](const std::string& raw) {
+    served r{clask::reactor_result::deferred, "", ""};
+    int fds[2];
+    if (!make_socket_pair(fds)) {
+      return r;
+    }
+    send(fds[0], raw.data(), (int) raw.size(), 0);
+    clask::connection_state conn{fds[1], "test"};
+    r.result = s.test_serve_inline(conn);
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+      r.left.append(buf, (size_t) n);
+    }
+    closesocket(fds[1]);
+    while ((n = recv(fds[0], buf, sizeof(buf), 0)) > 0) {
+      r.out.append(buf, (size_t) n);
+    }
+    closesocket(fds[0]);
+    return r;
+  };
+  auto r = serve("GET /healthz?v=1 HTTP/1.1\r\nHost: x\r\n\r\nGET /slow HTTP/1.1\r\n\r\n");
+  _ok(r.result == clask::reactor_result::keep_alive, R"(answered on the reactor)");
+  _ok(response_payload(r.out) == "ok 1", R"(inline response with query params)");
+  _ok(r.left == "GET /slow HTTP/1.1\r\n\r\n", R"(only the answered request is consumed)");
+  r = serve("GET /n/41 HTTP/1.1\r\nConnection: close\r\n\r\n");
+  _ok(r.result == clask::reactor_result::closed && response_payload(r.out) == "42", R"(typed inline route honours Connection: close)");
+  r = serve("GET /slow HTTP/1.1\r\n\r\n");
+  _ok(r.result == clask::reactor_result::deferred && r.out.empty() && r.left == "GET /slow HTTP/1.1\r\n\r\n", R"(other routes are left for a worker)");
+  r = serve("POST /healthz HTTP/1.1\r\nContent-Length: 2\r\n\r\nhi");
+  _ok(r.result == clask::reactor_result::deferred && r.out.empty(), R"(requests with a body are left for a worker)");
+  r = serve("GET /heal");
+  _ok(r.result == clask::reactor_result::deferred && r.left == "GET /heal", R"(partial requests are left for a worker)");
+
+  {
+    // A client that does not read: the reactor sends what fits and hands
+    // the rest to a worker.
+    s.GET("/big", clask::inline_handler([](clask::request&) { return std::string(8 << 20, 'x'); }));
+    int fds[2];
+    _ok(make_socket_pair(fds) == true, R"(make_socket_pair(fds) == true)");
+    std::string raw = "GET /big HTTP/1.1\r\n\r\n";
+    send(fds[0], raw.data(), (int) raw.size(), 0);
+    clask::connection_state conn{fds[1], "test"};
+    _ok(s.test_serve_inline(conn) == clask::reactor_result::partial, R"(full socket buffer does not block the reactor)");
+    _ok(!conn.pending_output.empty() && conn.pending_keep_alive, R"(unsent bytes are kept for a worker)");
+    size_t received = 0;
+    std::thread reader([&] {
+      char buf[65536];
+      ssize_t n;
+      while ((n = recv(fds[0], buf, sizeof(buf), 0)) > 0) {
+        received += (size_t) n;
+      }
+    });
+    auto pending = conn.pending_output.size();
+    _ok(clask::send_pending_output(conn) == true, R"(worker sends the rest)");
+    shutdown(fds[1], SHUT_WR);
+    reader.join();
+    _ok(received > (size_t) (8 << 20) && received > pending, R"(whole response arrives)");
+    closesocket(fds[0]);
+    closesocket(fds[1]);
+  }
+
+  clask::route_registry registry;
+  _ok(!registry.inline_routes().load(), R"(no inline routes yet)");
+  registry.insert(clask::route_method::get, "/late", clask::func_t(clask::inline_handler([](clask::request&) -> std::string { return "late"; })));
+  _ok(registry.inline_routes().load(), R"(inline route registered later turns the reactor path on)");
+
+  int fds[2];
+  _ok(make_socket_pair(fds) == true, R"(make_socket_pair(fds) == true)");
+  clask::server_runtime_state runtime;
+  std::atomic<bool> inline_routes{false};
+  runtime.serve_inline = [&](clask::connection_state& conn) {
+    return s.test_serve_inline(conn);
+  };
+  runtime.inline_routes = &inline_routes;
+  runtime.tracked_connections = 1;
+  runtime.idle_connections.emplace(fds[1], clask::connection_state{fds[1], "test"});
+  std::string raw = "GET /healthz HTTP/1.1\r\n\r\n";
+  send(fds[0], raw.data(), (int) raw.size(), 0);
+  _ok(!clask::serves_inline(runtime), R"(reactor path is off without inline routes)");
+  inline_routes = true;
+  clask::requeue_readable_idle_connections({clask::socket_wait_event{fds[1], true, false}}, runtime);
+  _ok(runtime.idle_connections.count(fds[1]) == 1 && runtime.ready_queue.empty(), R"(answered connection stays idle)");
+  raw = "GET /slow HTTP/1.1\r\n\r\n";
+  send(fds[0], raw.data(), (int) raw.size(), 0);
+  clask::requeue_readable_idle_connections({clask::socket_wait_event{fds[1], true, false}}, runtime);
+  _ok(runtime.idle_connections.empty() && runtime.ready_queue.size() == 1, R"(deferred connection goes to a worker)");
+  closesocket(fds[0]);
+  closesocket(fds[1]);
+}
+
+void test_clask_constant_response() {
+  auto s = clask::server();
+  s.constant("/robots.txt", clask::response{
+    .code = 200,
+    .content = std::string("User-agent: *\nDisallow:\n"),
+    .headers = {{"content-type", "text/plain"}},
+  });
+  auto run = [&](const std::string& method, bool keep_alive) {
+    std::string out;
+    s.test_match(method, "/robots.txt", [&](const clask::func_t& fn, const clask::route_args&) {
+      _ok(fn.reactor_inline, R"(constant routes are reactor-inline)");
+      int fds[2];
+      if (!make_socket_pair(fds)) {
+        return;
+      }
+      clask::request req(method, "/robots.txt", "/robots.txt", {}, {}, "");
+      auto ka = keep_alive;
+      _ok(fn.handle(fds[1], req, ka) == 200, R"(constant response returns its code)");
+      closesocket(fds[1]);
+      char buf[4096];
+      ssize_t n;
+      while ((n = recv(fds[0], buf, sizeof(buf), 0)) > 0) {
+        out.append(buf, (size_t) n);
+      }
+      closesocket(fds[0]);
+    });
+    return out;
+  };
+  auto out = run("GET", true);
+  _ok(out.find("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: Keep-Alive\r\nContent-Length: 24\r\nDate: ") == 0, R"(keep-alive variant)");
+  _ok(response_payload(out) == "User-agent: *\nDisallow:\n", R"(constant body)");
+  out = run("GET", false);
+  _ok(out.find("Connection: Close\r\n") != std::string::npos && response_payload(out) == "User-agent: *\nDisallow:\n", R"(close variant)");
+  out = run("HEAD", true);
+  _ok(out.find("Content-Length: 24\r\n") != std::string::npos && response_payload(out).empty(), R"(HEAD stops before the body)");
+  _ok(out.size() > 4 && out.compare(out.size() - 4, 4, "\r\n\r\n") == 0, R"(HEAD ends with the head)");
+
+  s.test_match("GET", "/robots.txt", [&](const clask::func_t& fn, const clask::route_args&) {
+    clask::request req("GET", "/robots.txt", "/robots.txt", {}, {}, "");
+    bool ka = true;
+    fn.handle(-1, req, ka);
+    _ok(ka == false, R"(failed send drops keep-alive)");
+  });
+
+  bool threw = false;
+  try {
+    clask::constant_response(clask::response{.code = 200, .content = clask::response_body::file(nullptr, 0, 0), .headers = {}});
+  } catch (std::invalid_argument&) {
+    threw = true;
+  }
+  _ok(threw, R"(file bodies are rejected)");
+}
+
+void test_clask_access_log() {
+  clask::access_ring ring(3);
+  auto filled = 0;
+  while (auto r = ring.reserve()) {
+    r->code = 200 + filled++;
+    ring.commit();
+  }
+  _ok(filled == 4, R"(ring capacity rounds up to a power of two)");
+  int first = 0;
+  _ok(ring.drain([&](const clask::access_record& r) { if (first == 0) first = r.code; }) == 4 && first == 200, R"(drain returns records in order)");
+  _ok(ring.reserve() != nullptr, R"(drained ring has room)");
+
+  auto& log = clask::access_log::instance();
+  std::string out;
+  log.sink([&](std::string_view batch) { out.append(batch); });
+  log.write(clask::log_level::INFO, "10.0.0.1", 200, "GET", "/x", 34, 12);
+  log.write(clask::log_level::INFO, "10.0.0.1", 404, "GET", "/" + std::string(300, 'a'), 1, 0);
+  log.stop();
+  _ok(out.find(" INFO: 10.0.0.1 200 GET /x 12 34us\n") != std::string::npos, R"(record format)");
+  _ok(out.find(" INFO: 10.0.0.1 404 GET /" + std::string(199, 'a') + " 0 1us\n") != std::string::npos, R"(long uri is truncated)");
+
+  auto s = clask::server();
+  s.GET("/logged", [](clask::request&) -> std::string { return "hello"; });
+  int fds[2];
+  _ok(make_socket_pair(fds) == true, R"(make_socket_pair(fds) == true)");
+  clask::request req("GET", "/logged", "/logged", {}, {}, "");
+  bool keep_alive = false;
+  clask::dispatch_request([&](const std::string& m, const std::string& u, clask::route_method_set& allowed, const auto& fn) {
+    return s.test_match(m, u, fn, &allowed);
+  }, fds[1], "peer", req, keep_alive);
+  closesocket(fds[1]);
+  std::string response;
+  char buf[4096];
+  ssize_t n;
+  while ((n = recv(fds[0], buf, sizeof(buf), 0)) > 0) {
+    response.append(buf, (size_t) n);
+  }
+  closesocket(fds[0]);
+  log.stop();
+  _ok(out.find(" INFO: peer 200 GET /logged " + std::to_string(response.size()) + " ") != std::string::npos, R"(dispatch logs the bytes sent)");
+
+  auto count_lines = [&](const std::string& uri) {
+    size_t lines = 0;
+    for (auto pos = out.find(" GET " + uri + " "); pos != std::string::npos; pos = out.find(" GET " + uri + " ", pos + 1)) {
+      lines++;
+    }
+    return lines;
+  };
+  log.configure(2, clask::log_overflow::block);
+  std::thread([&] {
+    for (int i = 0; i < 1000; i++) {
+      log.write(clask::log_level::INFO, "peer", 200, "GET", "/blocked", 1, 1);
+    }
+  }).join();
+  log.stop();
+  _ok(count_lines("/blocked") == 1000, R"(block policy waits for room and stop() writes the rest)");
+
+  std::thread([&] {
+    clask::access_log::never_wait() = true;
+    for (int i = 0; i < 1000; i++) {
+      log.write(clask::log_level::INFO, "peer", 200, "GET", "/reactor", 1, 1);
+    }
+  }).join();
+  log.stop();
+  _ok(count_lines("/reactor") <= 1000, R"(a never_wait thread returns under the block policy)");
+  log.configure(0, clask::log_overflow::drop);
+  log.sink(nullptr);
+}
+
+void test_clask_static_route_index() {
+  std::vector<std::pair<std::string, std::int32_t>> routes;
+  for (int i = 0; i < 5000; i++) {
+    routes.emplace_back("/api/v1/items/" + std::to_string(i), i);
+  }
+  routes.emplace_back("/", 5000);
+  clask::static_route_index index;
+  index.build(routes);
+  _ok(index.size() == routes.size(), R"(index.size() == routes.size())");
+  auto all_found = true;
+  for (auto& r : routes) {
+    all_found = all_found && index.find(r.first) == r.second;
+  }
+  _ok(all_found, R"(every path finds its own handler)");
+  _ok(index.find("/api/v1/items/5000") == -1, R"(unknown path misses)");
+  _ok(index.find("") == -1, R"(empty path misses)");
+
+  clask::static_route_index empty;
+  empty.build({});
+  _ok(empty.find("/") == -1, R"(empty index misses)");
+}
+
 void test_clask_parse_listen_address() {
   {
     auto addr = clask::parse_listen_address("127.0.0.1:8080");
@@ -563,50 +1356,21 @@ void test_clask_parse_route_method() {
   }
   {
     auto method = clask::parse_route_method("DELETE");
-    _ok(method.has_value() == false, R"(method.has_value() == false)");
-  }
-  {
-    auto method = clask::parse_route_method("get");
-    _ok(method.has_value() == false, R"(method.has_value() == false)");
-  }
-}
-
-void test_clask_parse_path_segment() {
-  {
-    auto segment = clask::parse_path_segment("/users/:id", 0);
-    _ok(segment.value == "users", R"(segment.value == "users")");
-    _ok(segment.next_offset == 6, R"(segment.next_offset == 6)");
-    _ok(segment.placeholder == false, R"(segment.placeholder == false)");
-    _ok(segment.has_more == true, R"(segment.has_more == true)");
-  }
-  {
-    auto segment = clask::parse_path_segment("/:id", 0);
-    _ok(segment.value == "id", R"(segment.value == "id")");
-    _ok(segment.next_offset == 4, R"(segment.next_offset == 4)");
-    _ok(segment.placeholder == true, R"(segment.placeholder == true)");
-    _ok(segment.has_more == false, R"(segment.has_more == false)");
-  }
-  {
-    auto segment = clask::parse_path_segment("/users/:id", 6);
-    _ok(segment.value == "id", R"(segment.value == "id")");
-    _ok(segment.next_offset == 10, R"(segment.next_offset == 10)");
-    _ok(segment.placeholder == true, R"(segment.placeholder == true)");
-    _ok(segment.has_more == false, R"(segment.has_more == false)");
+    _ok(method.has_value() == true, R"(method.has_value() == true)");
+    _ok(*method == clask::route_method::delete_, R"(*method == clask::route_method::delete_)");
   }
   {
-    auto segment = clask::parse_path_segment("/", 0);
-    _ok(segment.value == "", R"(segment.value == "")");
-    _ok(segment.next_offset == 1, R"(segment.next_offset == 1)");
-    _ok(segment.placeholder == false, R"(segment.placeholder == false)");
-    _ok(segment.has_more == false, R"(segment.has_more == false)");
+    auto method = clask::parse_route_method("TRACE");
+    _ok(method.has_value() == false, R"(unknown method is rejected)");
   }
   {
-    auto segment = clask::parse_path_segment("/users//name", 6);
-    _ok(segment.value == "", R"(segment.value == "")");
-    _ok(segment.next_offset == 7, R"(segment.next_offset == 7)");
-    _ok(segment.placeholder == false, R"(segment.placeholder == false)");
-    _ok(segment.has_more == true, R"(segment.has_more == true)");
+    auto method = clask::parse_route_method("get");
+    _ok(method.has_value() == false, R"(method.has_value() == false)");
   }
+  // Methods are case-sensitive, including the ones added with DELETE.
+  _ok(!clask::parse_route_method("Get").has_value(), R"(mixed-case method is rejected)");
+  _ok(!clask::parse_route_method("delete").has_value(), R"(lowercase DELETE is rejected)");
+  _ok(!clask::parse_route_method("options").has_value(), R"(lowercase OPTIONS is rejected)");
 }
 
 void test_clask_request_read_result_helpers() {
@@ -716,19 +1480,215 @@ void test_clask_read_request_content_length_bounds_body() {
   closesocket(fds[1]);
 }
 
-static std::string serve_file_with_header(
+static clask::request_read_result read_request_with_config(
+    const std::string& request,
+    const clask::request_read_config& config) {
+  int fds[2];
+  if (!make_socket_pair(fds)) {
+    return clask::make_request_read_error(0, "", "");
+  }
+  socket_write(fds[0], request.data(), request.size());
+  shutdown(fds[0], SHUT_WR);
+  auto result = clask::read_request_from_socket(fds[1], config);
+  closesocket(fds[0]);
+  closesocket(fds[1]);
+  return result;
+}
+
+void test_clask_read_request_body_limits() {
+  const std::string request =
+      "POST / HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Content-Length: 10\r\n"
+      "\r\n"
+      "0123456789";
+  {
+    auto result = read_request_with_config(request, {.max_body_size = 9, .body_spill_threshold = 0, .budget = nullptr});
+    _ok(result.ok == false, R"(result.ok == false)");
+    _ok(result.error_code == 413, R"(result.error_code == 413)");
+  }
+  {
+    clask::body_budget budget(16);
+    _ok(budget.try_acquire(8) == true, R"(budget.try_acquire(8) == true)");
+    auto result = read_request_with_config(request, {.max_body_size = 0, .body_spill_threshold = 0, .budget = &budget});
+    _ok(result.ok == false, R"(result.ok == false)");
+    _ok(result.error_code == 503, R"(result.error_code == 503)");
+    budget.release(8);
+  }
+  {
+    clask::body_budget budget(16);
+    auto result = read_request_with_config(request, {.max_body_size = 0, .body_spill_threshold = 0, .budget = &budget});
+    _ok(result.ok == true, R"(result.ok == true)");
+    _ok(budget.used() == 10, R"(budget.used() == 10)");
+    _ok(result.req->body == "0123456789", R"(result.req->body == "0123456789")");
+    result.req.reset();
+    _ok(budget.used() == 0, R"(budget.used() == 0)");
+  }
+}
+
+void test_clask_read_request_body_spill() {
+  const std::string request =
+      "POST / HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Content-Type: multipart/form-data; boundary=b\r\n"
+      "Content-Length: 65\r\n"
+      "\r\n"
+      "--b\r\n"
+      "Content-Disposition: form-data; name=\"f\"\r\n"
+      "\r\n"
+      "spilled\r\n"
+      "--b--\r\n";
+  clask::body_budget budget(1);
+  auto result = read_request_with_config(request, {.max_body_size = 0, .body_spill_threshold = 8, .budget = &budget});
+  _ok(result.ok == true, R"(result.ok == true)");
+  if (!result.ok) {
+    return;
+  }
+#ifndef _WIN32
+  _ok(result.req->body.empty() == true, R"(result.req->body.empty() == true)");
+  _ok(result.req->body_view().size() == 65, R"(result.req->body_view().size() == 65)");
+  _ok(budget.used() == 0, R"(spilled body is not charged to the budget)");
+#endif
+  std::vector<clask::part> parts;
+  _ok(result.req->parse_multipart(parts) == true, R"(result.req->parse_multipart(parts) == true)");
+  _ok(parts.size() == 1 && parts[0].body == "spilled", R"(parts[0].body == "spilled")");
+
+#ifndef _WIN32
+  // A spill file that cannot be created is an I/O error, not a 503.
+  const char* tmpdir = std::getenv("TMPDIR");
+  std::string saved = tmpdir != nullptr ? tmpdir : "";
+  setenv("TMPDIR", "./no-such-spill-dir", 1);
+  result = read_request_with_config(request, {.max_body_size = 0, .body_spill_threshold = 8, .budget = &budget});
+  if (tmpdir != nullptr) {
+    setenv("TMPDIR", saved.c_str(), 1);
+  } else {
+    unsetenv("TMPDIR");
+  }
+  _ok(result.ok == false, R"(result.ok == false)");
+  _ok(result.error_code == 500, R"(spill failure is a 500)");
+#endif
+}
+
+void test_clask_read_request_header_limits() {
+  const std::string cookie(6000, 'c');
+  const std::string large =
+      "GET / HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Cookie: " + cookie + "\r\n"
+      "\r\n";
+  {
+    auto result = read_request_with_config(large, {});
+    _ok(result.ok == true, R"(6 KB of headers fit the default limit)");
+    _ok(result.ok && result.req->header_value("cookie") == cookie, R"(result.req->header_value("cookie") == cookie)");
+  }
+  {
+    clask::request_read_config config{};
+    config.max_header_size = 4096;
+    auto result = read_request_with_config(large, config);
+    _ok(result.ok == false, R"(result.ok == false)");
+    _ok(result.error_code == 431, R"(result.error_code == 431)");
+  }
+  {
+    std::string many = "GET / HTTP/1.1\r\n";
+    for (int n = 0; n < 5; n++) {
+      many += "X-H" + std::to_string(n) + ": v\r\n";
+    }
+    many += "\r\n";
+    clask::request_read_config config{};
+    config.max_header_count = 4;
+    auto result = read_request_with_config(many, config);
+    _ok(result.ok == false, R"(result.ok == false)");
+    _ok(result.error_code == 431, R"(result.error_code == 431)");
+    config.max_header_count = 5;
+    result = read_request_with_config(many, config);
+    _ok(result.ok == true, R"(result.ok == true)");
+  }
+  {
+    auto result = read_request_with_config("GET / HTTP/1.1\r\nbroken header\r\n\r\n", {});
+    _ok(result.ok == false, R"(result.ok == false)");
+    _ok(result.error_code == 400, R"(result.error_code == 400)");
+  }
+}
+
+#ifdef CLASK_USE_ZLIB
+static std::string zlib_compress(const std::string& data, int window_bits) {
+  z_stream zs{};
+  deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+  std::string out(deflateBound(&zs, (uLong) data.size()) + 32, '\0');
+  zs.next_in = (Bytef*) data.data();
+  zs.avail_in = (uInt) data.size();
+  zs.next_out = (Bytef*) &out[0];
+  zs.avail_out = (uInt) out.size();
+  deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  return out;
+}
+
+static std::string encoded_post(const std::string& encoding, const std::string& body) {
+  return "POST / HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Content-Encoding: " + encoding + "\r\n"
+      "Content-Length: " + std::to_string(body.size()) + "\r\n"
+      "\r\n" + body;
+}
+
+void test_clask_read_request_content_encoding() {
+  const std::string json = R"({"message":"hello hello hello hello"})";
+  clask::request_read_config config{};
+  config.decompress = true;
+  config.max_decompression_ratio = 100;
+  for (auto wb : {15 + 16, 15, -15}) {
+    auto encoding = wb == 15 + 16 ? "gzip" : "deflate";
+    auto result = read_request_with_config(encoded_post(encoding, zlib_compress(json, wb)), config);
+    _ok(result.ok == true, R"(result.ok == true)");
+    _ok(result.ok && result.req->body == json, R"(result.req->body == json)");
+    _ok(result.ok && result.req->header_value("content-encoding").empty(), R"(Content-Encoding is removed)");
+    _ok(
+        result.ok && result.req->header_value("content-length") == std::to_string(json.size()),
+        R"(Content-Length reflects the decoded body)");
+  }
+  {
+    auto result = read_request_with_config(encoded_post("gzip", "not gzip at all"), config);
+    _ok(result.ok == false, R"(result.ok == false)");
+    _ok(result.error_code == 400, R"(result.error_code == 400)");
+  }
+  {
+    auto result = read_request_with_config(encoded_post("br", "xx"), config);
+    _ok(result.ok == false, R"(result.ok == false)");
+    _ok(result.error_code == 415, R"(result.error_code == 415)");
+  }
+  {
+    auto bomb = zlib_compress(std::string(4 * 1024 * 1024, '\0'), 15 + 16);
+    auto result = read_request_with_config(encoded_post("gzip", bomb), config);
+    _ok(result.ok == false, R"(result.ok == false)");
+    _ok(result.error_code == 413, R"(decompression bomb is rejected)");
+  }
+  {
+    auto result = read_request_with_config(
+        "POST / HTTP/1.1\r\nHost: localhost\r\nContent-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n",
+        config);
+    _ok(result.ok == false, R"(result.ok == false)");
+    _ok(result.error_code == 411, R"(encoded body without Content-Length is rejected)");
+  }
+  {
+    auto compressed = zlib_compress(json, 15 + 16);
+    auto result = read_request_with_config(encoded_post("gzip", compressed), {});
+    _ok(result.ok == true, R"(result.ok == true)");
+    _ok(result.ok && result.req->body == compressed, R"(body is untouched unless decompression is enabled)");
+  }
+}
+#endif
+
+static std::string serve_file_with_headers(
     const std::string& path,
-    const std::string& if_modified_since,
+    const std::vector<clask::header>& headers,
     const std::vector<clask::header>& extra_headers = {}) {
   int fds[2];
   if (!make_socket_pair(fds)) {
     return "";
   }
   clask::response_writer resp(fds[1], 200);
-  std::vector<clask::header> headers;
-  if (!if_modified_since.empty()) {
-    headers.emplace_back("If-Modified-Since", if_modified_since);
-  }
   clask::request req("GET", "/f.txt", "/f.txt", {}, headers, "");
   clask::serve_file(resp, req, path, extra_headers);
   closesocket(fds[1]);
@@ -742,6 +1702,17 @@ static std::string serve_file_with_header(
   return out;
 }
 
+static std::string serve_file_with_header(
+    const std::string& path,
+    const std::string& if_modified_since,
+    const std::vector<clask::header>& extra_headers = {}) {
+  std::vector<clask::header> headers;
+  if (!if_modified_since.empty()) {
+    headers.emplace_back("If-Modified-Since", if_modified_since);
+  }
+  return serve_file_with_headers(path, headers, extra_headers);
+}
+
 void test_clask_serve_file_if_modified_since() {
   const std::string path = "./test_if_modified_since.txt";
   {
@@ -756,6 +1727,10 @@ void test_clask_serve_file_if_modified_since() {
         out.size() >= 4 && out.compare(out.size() - 4, 4, "\r\n\r\n") == 0,
         R"(304 response has no body)");
   }
+  {
+    auto out = serve_file_with_header(path, "Sun, 99 Dec 2099 99:99:99 GMT");
+    _ok(out.find("HTTP/1.1 200") == 0, R"(malformed If-Modified-Since is ignored)");
+  }
   {
     auto out = serve_file_with_header(path, "Mon, 01 Jan 1990 00:00:00 GMT");
     _ok(out.find("HTTP/1.1 200") == 0, R"(out.find("HTTP/1.1 200") == 0)");
@@ -773,6 +1748,124 @@ void test_clask_serve_file_if_modified_since() {
   remove(path.c_str());
 }
 
+void test_clask_parse_range_header() {
+  std::vector<clask::byte_range> ranges;
+  _ok(clask::parse_range_header("bytes=0-9", 100, ranges) == clask::range_status::partial, R"(bytes=0-9 is partial)");
+  _ok(ranges.size() == 1 && ranges[0].first == 0 && ranges[0].last == 9, R"(ranges == {0-9})");
+  _ok(clask::parse_range_header("bytes=90-", 100, ranges) == clask::range_status::partial, R"(bytes=90- is partial)");
+  _ok(ranges.size() == 1 && ranges[0].first == 90 && ranges[0].last == 99, R"(ranges == {90-99})");
+  _ok(clask::parse_range_header("bytes=-200", 100, ranges) == clask::range_status::partial, R"(bytes=-200 is partial)");
+  _ok(ranges.size() == 1 && ranges[0].first == 0 && ranges[0].last == 99, R"(ranges == {0-99})");
+  _ok(clask::parse_range_header("bytes=0-1, 5-500", 100, ranges) == clask::range_status::partial, R"(two ranges are partial)");
+  _ok(ranges.size() == 2 && ranges[1].first == 5 && ranges[1].last == 99, R"(last range is clamped)");
+  _ok(clask::parse_range_header("bytes=100-", 100, ranges) == clask::range_status::unsatisfiable, R"(bytes=100- is unsatisfiable)");
+  _ok(clask::parse_range_header("bytes=-0", 100, ranges) == clask::range_status::unsatisfiable, R"(bytes=-0 is unsatisfiable)");
+  _ok(clask::parse_range_header("bytes=5-1", 100, ranges) == clask::range_status::full, R"(reversed range is ignored)");
+  _ok(clask::parse_range_header("items=0-1", 100, ranges) == clask::range_status::full, R"(other units are ignored)");
+  _ok(clask::parse_range_header("bytes=x-1", 100, ranges) == clask::range_status::full, R"(garbage is ignored)");
+}
+
+void test_clask_serve_file_range() {
+  const std::string path = "./test_range.txt";
+  {
+    std::ofstream ofs(path, std::ios::binary);
+    ofs << "0123456789abcdefghij";
+  }
+
+  auto out = serve_file_with_headers(path, {{"Range", "bytes=2-5"}});
+  _ok(out.find("HTTP/1.1 206") == 0, R"(out.find("HTTP/1.1 206") == 0)");
+  _ok(out.find("Content-Range: bytes 2-5/20\r\n") != std::string::npos, R"(out.find("Content-Range: bytes 2-5/20\r\n") != std::string::npos)");
+  _ok(out.find("Content-Length: 4\r\n") != std::string::npos, R"(out.find("Content-Length: 4\r\n") != std::string::npos)");
+  _ok(out.substr(out.size() - 8) == "\r\n\r\n2345", R"(body is the range)");
+
+  out = serve_file_with_headers(path, {{"Range", "bytes=0-1,-3"}});
+  _ok(out.find("HTTP/1.1 206") == 0, R"(out.find("HTTP/1.1 206") == 0)");
+  auto ct = out.find("Content-Type: multipart/byteranges; boundary=");
+  _ok(ct != std::string::npos, R"(multipart/byteranges)");
+  auto boundary = out.substr(ct + 45, out.find("\r\n", ct) - ct - 45);
+  auto body = out.substr(out.find("\r\n\r\n") + 4);
+  _ok(
+      body == "\r\n--" + boundary + "\r\nContent-Type: text/plain; charset=utf-8\r\nContent-Range: bytes 0-1/20\r\n\r\n01"
+          "\r\n--" + boundary + "\r\nContent-Type: text/plain; charset=utf-8\r\nContent-Range: bytes 17-19/20\r\n\r\nhij"
+          "\r\n--" + boundary + "--\r\n",
+      R"(multipart body)");
+  _ok(out.find("Content-Length: " + std::to_string(body.size()) + "\r\n") != std::string::npos, R"(multipart Content-Length is exact)");
+
+  out = serve_file_with_headers(path, {{"Range", "bytes=30-"}});
+  _ok(out.find("HTTP/1.1 416") == 0, R"(out.find("HTTP/1.1 416") == 0)");
+  _ok(out.find("Content-Range: bytes */20\r\n") != std::string::npos, R"(out.find("Content-Range: bytes */20\r\n") != std::string::npos)");
+
+  // A stale If-Range validator falls back to the full file.
+  out = serve_file_with_headers(path, {{"Range", "bytes=2-5"}, {"If-Range", "Mon, 01 Jan 1990 00:00:00 GMT"}});
+  _ok(out.find("HTTP/1.1 200") == 0, R"(out.find("HTTP/1.1 200") == 0)");
+  _ok(out.find("Accept-Ranges: bytes\r\n") != std::string::npos, R"(out.find("Accept-Ranges: bytes\r\n") != std::string::npos)");
+  auto lm = out.find("Last-Modified: ");
+  auto last_modified = out.substr(lm + 15, out.find("\r\n", lm) - lm - 15);
+  out = serve_file_with_headers(path, {{"Range", "bytes=2-5"}, {"If-Range", last_modified}});
+  _ok(out.find("HTTP/1.1 206") == 0, R"(out.find("HTTP/1.1 206") == 0)");
+
+  remove(path.c_str());
+}
+
+void test_clask_http_date() {
+  _ok(clask::format_http_date(784111777) == "Sun, 06 Nov 1994 08:49:37 GMT", R"(clask::format_http_date(784111777) == "Sun, 06 Nov 1994 08:49:37 GMT")");
+  auto t = clask::parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT");
+  _ok(t && *t == 784111777, R"(t && *t == 784111777)");
+  t = clask::parse_http_date("Thu, 29 Feb 2024 00:00:00 GMT");
+  _ok(t && *t == 1709164800, R"(t && *t == 1709164800)");
+  _ok(!clask::parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT"), R"(RFC 850 dates are not parsed)");
+  _ok(!clask::parse_http_date("Sun, 06 Xyz 1994 08:49:37 GMT"), R"(bad month is rejected)");
+  _ok(!clask::parse_http_date("Sun, 99 Dec 2099 99:99:99 GMT"), R"(out-of-range fields are rejected)");
+  _ok(!clask::parse_http_date("Tue, 30 Feb 2024 00:00:00 GMT"), R"(day past the end of the month is rejected)");
+  _ok(!clask::parse_http_date("Thu, 29 Feb 2023 00:00:00 GMT"), R"(Feb 29 outside a leap year is rejected)");
+  _ok(!clask::parse_http_date("Sun,-06 Nov 1994 08:49:37 GMT"), R"(bad separator is rejected)");
+  _ok(!clask::parse_http_date("Sun, 06 Nov 1994 08.49.37 GMT"), R"(bad time separator is rejected)");
+  _ok(clask::format_http_date(1709164800) == "Thu, 29 Feb 2024 00:00:00 GMT", R"(clask::format_http_date(1709164800) == "Thu, 29 Feb 2024 00:00:00 GMT")");
+
+  int fds[2];
+  _ok(make_socket_pair(fds) == true, R"(make_socket_pair(fds) == true)");
+  clask::send_service_unavailable_response(fds[1]);
+  closesocket(fds[1]);
+  std::string out;
+  char buf[512];
+  ssize_t n;
+  while ((n = recv(fds[0], buf, sizeof(buf), 0)) > 0) {
+    out.append(buf, (size_t) n);
+  }
+  closesocket(fds[0]);
+  _ok(out.find("HTTP/1.1 503") == 0, R"(out.find("HTTP/1.1 503") == 0)");
+  _ok(out.find("\r\nDate: ") != std::string::npos, R"(503 carries a Date header)");
+}
+
+void test_clask_serve_file_etag() {
+  const std::string path = "./test_etag.txt";
+  {
+    std::ofstream ofs(path, std::ios::binary);
+    ofs << "hello";
+  }
+  _ok(clask::etag_matches("\"a\", W/\"b\"", "\"b\""), R"(weak comparison ignores W/)");
+  _ok(clask::etag_matches("*", "\"b\""), R"(* matches any tag)");
+  _ok(!clask::etag_matches("\"a\"", "\"b\""), R"(different tags do not match)");
+
+  auto out = serve_file_with_headers(path, {});
+  auto pos = out.find("Etag: \"");
+  _ok(pos != std::string::npos, R"(files get an ETag)");
+  auto etag = out.substr(pos + 6, out.find("\r\n", pos) - pos - 6);
+
+  out = serve_file_with_headers(path, {{"If-None-Match", etag}});
+  _ok(out.find("HTTP/1.1 304") == 0, R"(out.find("HTTP/1.1 304") == 0)");
+  _ok(out.find("Etag: " + etag + "\r\n") != std::string::npos, R"(304 repeats the ETag)");
+
+  // If-None-Match wins over If-Modified-Since.
+  out = serve_file_with_headers(path, {{"If-None-Match", "\"stale\""}, {"If-Modified-Since", "Fri, 01 Jan 2100 00:00:00 GMT"}});
+  _ok(out.find("HTTP/1.1 200") == 0, R"(out.find("HTTP/1.1 200") == 0)");
+
+  out = serve_file_with_headers(path, {{"Range", "bytes=1-2"}, {"If-Range", etag}});
+  _ok(out.find("HTTP/1.1 206") == 0, R"(If-Range accepts the ETag)");
+
+  remove(path.c_str());
+}
+
 void test_clask_serve_file_csv_content_type() {
   const std::string path = "./test_content_type.csv";
   {
@@ -795,12 +1888,12 @@ void test_clask_head_route_match() {
     return "hello";
   });
 
-  auto matched = s.test_match("HEAD", "/hello", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
+  auto matched = s.test_match("HEAD", "/hello", [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
     _ok(args.empty() == true, R"(args.empty() == true)");
   });
   _ok(matched == true, R"(matched == true)");
 
-  auto miss = s.test_match("HEAD", "/nothing", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& /*args*/) {
+  auto miss = s.test_match("HEAD", "/nothing", [&](const clask::func_t& /*fn*/, const clask::route_args& /*args*/) {
   });
   _ok(miss == false, R"(miss == false)");
 }
@@ -895,16 +1988,324 @@ void test_clask_response_writer_end_keeps_socket_open() {
   closesocket(fds[1]);
 }
 
-static std::string run_static_handler(clask::server_t& s, const std::string& uri) {
+void test_clask_response_writer_buffering() {
+  int fds[2];
+  _ok(make_socket_pair(fds) == true, R"(make_socket_pair(fds) == true)");
+
+  char buf[4096];
+  clask::response_writer resp(fds[1], 200, 64);
+  resp.set_header("Content-Type", "text/plain");
+  resp.write("hello");
+  resp.write(" world");
+  auto early = recv(fds[0], buf, sizeof(buf), MSG_DONTWAIT);
+  _ok(early < 0, R"(early < 0)");
+
+  resp.flush();
+  std::string out;
+  auto n = recv(fds[0], buf, sizeof(buf), 0);
+  if (n > 0) out.append(buf, (size_t) n);
+  _ok(out.find("HTTP/1.1 200 OK\r\n") == 0, R"(out.find("HTTP/1.1 200 OK\r\n") == 0)");
+  _ok(out.find("\r\n\r\nhello world") != std::string::npos, R"(out.find("\r\n\r\nhello world") != std::string::npos)");
+
+  // Writes that would overflow the threshold go out together with what is
+  // already buffered.
+  resp.write("abc");
+  resp.write(std::string(100, 'x'));
+  out.clear();
+  while (out.size() < 103 && (n = recv(fds[0], buf, sizeof(buf), 0)) > 0) {
+    out.append(buf, (size_t) n);
+  }
+  _ok(out == "abc" + std::string(100, 'x'), R"(out == "abc" + std::string(100, 'x'))");
+
+  closesocket(fds[0]);
+  closesocket(fds[1]);
+}
+
+static std::string run_writer_handler(
+    const clask::functor_writer& f,
+    int minor_version,
+    size_t output_buffer_size,
+    bool& keep_alive,
+    const std::vector<clask::header>& headers = {},
+    bool compress = false,
+    const std::string& method = "GET") {
   int fds[2];
   if (!make_socket_pair(fds)) {
     return "";
   }
-  s.test_match("GET", uri, [&](const clask::func_t& fn, const std::vector<std::string>& args) {
-    clask::response_writer resp(fds[1], 200);
-    clask::request req("GET", uri, uri, {}, {}, "");
-    req.args = args;
-    fn.f_writer(resp, req);
+  clask::func_t fn(f);
+  clask::request req(method, "/", "/", {}, headers, "");
+  req.minor_version = minor_version;
+  keep_alive = minor_version == 1;
+  clask::response_write_config config{
+    .output_buffer_size = output_buffer_size,
+    .compress = compress,
+    .compression_level = clask::default_compression_level,
+    .compression_min_size = 64,
+  };
+  fn.handle(fds[1], req, keep_alive, config);
+  closesocket(fds[1]);
+  std::string out;
+  char buf[4096];
+  ssize_t n;
+  while ((n = recv(fds[0], buf, sizeof(buf), 0)) > 0) {
+    out.append(buf, (size_t) n);
+  }
+  closesocket(fds[0]);
+  return out;
+}
+
+void test_clask_writer_handler_keep_alive() {
+  auto small = [](clask::response_writer& resp, clask::request&) {
+    resp.write("hello");
+    resp.write(" world");
+  };
+  auto large = [](clask::response_writer& resp, clask::request&) {
+    resp.write(std::string(40, 'a'));
+    resp.write(std::string(40, 'b'));
+  };
+  bool keep_alive = false;
+
+  auto out = run_writer_handler(small, 1, 1024, keep_alive);
+  _ok(keep_alive == true, R"(keep_alive == true)");
+  _ok(out.find("Content-Length: 11\r\n") != std::string::npos, R"(out.find("Content-Length: 11\r\n") != std::string::npos)");
+  _ok(out.find("Connection: Keep-Alive\r\n") != std::string::npos, R"(out.find("Connection: Keep-Alive\r\n") != std::string::npos)");
+  _ok(out.find("\r\nDate: ") != std::string::npos, R"(out.find("\r\nDate: ") != std::string::npos)");
+  _ok(out.find("\r\n\r\nhello world") != std::string::npos, R"(out.find("\r\n\r\nhello world") != std::string::npos)");
+
+  // Bodies that outgrow the buffer switch to chunked encoding.
+  out = run_writer_handler(large, 1, 64, keep_alive);
+  _ok(keep_alive == true, R"(keep_alive == true)");
+  _ok(out.find("Transfer-Encoding: chunked\r\n") != std::string::npos, R"(out.find("Transfer-Encoding: chunked\r\n") != std::string::npos)");
+  _ok(
+      out.find("\r\n\r\n28\r\n" + std::string(40, 'a') + "\r\n28\r\n" + std::string(40, 'b') + "\r\n0\r\n\r\n") != std::string::npos,
+      R"(chunked body is framed and terminated)");
+
+  // HTTP/1.0 clients cannot parse chunked encoding; close instead.
+  out = run_writer_handler(large, 0, 64, keep_alive);
+  _ok(keep_alive == false, R"(keep_alive == false)");
+  _ok(out.find("Transfer-Encoding") == std::string::npos, R"(out.find("Transfer-Encoding") == std::string::npos)");
+  _ok(out.find("Connection: Close\r\n") != std::string::npos, R"(out.find("Connection: Close\r\n") != std::string::npos)");
+
+  // A Content-Length set by the handler is kept and checked.
+  out = run_writer_handler([](clask::response_writer& resp, clask::request&) {
+    resp.set_header("Content-Length", "80");
+    resp.write(std::string(80, 'c'));
+  }, 1, 64, keep_alive);
+  _ok(keep_alive == true, R"(keep_alive == true)");
+  _ok(out.find("Transfer-Encoding") == std::string::npos, R"(out.find("Transfer-Encoding") == std::string::npos)");
+  out = run_writer_handler([](clask::response_writer& resp, clask::request&) {
+    resp.set_header("Content-Length", "80");
+    resp.write(std::string(10, 'c'));
+  }, 1, 64, keep_alive);
+  _ok(keep_alive == false, R"(keep_alive == false)");
+
+  // end() shuts the socket down, so the connection cannot be reused.
+  out = run_writer_handler([](clask::response_writer& resp, clask::request&) {
+    resp.write("bye");
+    resp.end();
+  }, 1, 64, keep_alive);
+  _ok(keep_alive == false, R"(keep_alive == false)");
+  _ok(out.find("Content-Length: 3\r\n") != std::string::npos, R"(out.find("Content-Length: 3\r\n") != std::string::npos)");
+  _ok(out.find("Connection: Close\r\n") != std::string::npos, R"(out.find("Connection: Close\r\n") != std::string::npos)");
+}
+
+static std::string run_response_handler(
+    const clask::functor_response& f,
+    const std::vector<clask::header>& headers = {},
+    const clask::response_write_config& config = {}) {
+  int fds[2];
+  if (!make_socket_pair(fds)) {
+    return "";
+  }
+  clask::func_t fn(f);
+  clask::request req("GET", "/", "/", {}, headers, "");
+  bool keep_alive = true;
+  std::string out;
+  std::thread reader([&] {
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fds[0], buf, sizeof(buf), 0)) > 0) {
+      out.append(buf, (size_t) n);
+    }
+  });
+  fn.handle(fds[1], req, keep_alive, config);
+  shutdown(fds[1], SHUT_WR);
+  reader.join();
+  closesocket(fds[0]);
+  closesocket(fds[1]);
+  return out;
+}
+
+void test_clask_response_body_kinds() {
+  static const char greeting[] = "static hello";
+  auto out = run_response_handler([](clask::request&) {
+    return clask::response{.code = 200, .content = std::string_view(greeting)};
+  });
+  _ok(response_payload(out) == "static hello", R"(response_payload(out) == "static hello")");
+  _ok(out.find("Content-Length: 12\r\n") != std::string::npos, R"(out.find("Content-Length: 12\r\n") != std::string::npos)");
+
+  auto shared = std::make_shared<const std::string>("shared hello");
+  out = run_response_handler([&](clask::request&) {
+    return clask::response{.code = 200, .content = shared};
+  });
+  _ok(response_payload(out) == "shared hello", R"(response_payload(out) == "shared hello")");
+  _ok(shared.use_count() == 1, R"(shared.use_count() == 1)");
+
+  const std::string path = "./test_response_body.bin";
+  std::string data;
+  for (size_t i = 0; i < 100000; i++) {
+    data += (char) ('a' + i % 26);
+  }
+  {
+    std::ofstream os(path, std::ios::binary);
+    os << data;
+  }
+  auto file = std::make_shared<clask::file_handle>(open(path.c_str(), O_RDONLY));
+  _ok(file->fd() >= 0, R"(file->fd() >= 0)");
+
+  // Small ranges ride along with the head; large ones use sendfile.
+  out = run_response_handler([&](clask::request&) {
+    return clask::response{.code = 200, .content = clask::response_body::file(file, 10, 5)};
+  });
+  _ok(response_payload(out) == data.substr(10, 5), R"(response_payload(out) == data.substr(10, 5))");
+  out = run_response_handler([&](clask::request&) {
+    return clask::response{.code = 200, .content = clask::response_body::file(file, 7, 90000)};
+  });
+  _ok(response_payload(out) == data.substr(7, 90000), R"(response_payload(out) == data.substr(7, 90000))");
+  _ok(out.find("Content-Length: 90000\r\n") != std::string::npos, R"(out.find("Content-Length: 90000\r\n") != std::string::npos)");
+
+  remove(path.c_str());
+}
+
+void test_clask_response_etag() {
+  auto handler = [](clask::request&) {
+    return clask::response{.code = 200, .content = "polled state", .headers = {{"Content-Type", "application/json"}}};
+  };
+  auto config = clask::response_write_config{.output_buffer_size = 0, .etag_responses = true};
+  auto etag = clask::content_etag("polled state");
+
+  auto out = run_response_handler(handler, {}, config);
+  _ok(out.find("Etag: " + etag + "\r\n") != std::string::npos, R"(out.find("Etag: " + etag + "\r\n") != std::string::npos)");
+  out = run_response_handler(handler);
+  _ok(out.find("Etag:") == std::string::npos, R"(ETag is opt-in)");
+
+  out = run_response_handler(handler, {{"If-None-Match", etag}}, config);
+  _ok(out.find("HTTP/1.1 304") == 0, R"(out.find("HTTP/1.1 304") == 0)");
+  _ok(out.find("Content-Type") == std::string::npos, R"(304 has no Content-Type)");
+  _ok(out.size() >= 4 && out.compare(out.size() - 4, 4, "\r\n\r\n") == 0, R"(304 response has no body)");
+
+  out = run_response_handler(handler, {{"If-None-Match", "\"other\""}}, config);
+  _ok(out.find("HTTP/1.1 200") == 0, R"(out.find("HTTP/1.1 200") == 0)");
+
+  // A handler-provided ETag is validated even without hashing.
+  out = run_response_handler([](clask::request&) {
+    return clask::response{.code = 200, .content = "x", .headers = {{"ETag", "\"v1\""}}};
+  }, {{"If-None-Match", "W/\"v0\", W/\"v1\""}});
+  _ok(out.find("HTTP/1.1 304") == 0, R"(out.find("HTTP/1.1 304") == 0)");
+
+  out = run_response_handler([](clask::request&) {
+    return clask::response{.code = 204, .content = "ignored"};
+  });
+  _ok(out.find("HTTP/1.1 204") == 0, R"(out.find("HTTP/1.1 204") == 0)");
+  _ok(out.find("Content-Length") == std::string::npos, R"(204 has no Content-Length)");
+  _ok(out.size() >= 4 && out.compare(out.size() - 4, 4, "\r\n\r\n") == 0, R"(204 response has no body)");
+}
+
+void test_clask_writer_write_file() {
+  const std::string path = "./test_write_file.bin";
+  std::string data;
+  for (size_t i = 0; i < 200000; i++) {
+    data += (char) ('0' + i % 10);
+  }
+  {
+    std::ofstream os(path, std::ios::binary);
+    os << data;
+  }
+  clask::file_info info{};
+  auto file = clask::open_regular_file(path, info);
+  _ok(file != nullptr, R"(file != nullptr)");
+  _ok(info.size == data.size(), R"(info.size == data.size())");
+  _ok(clask::open_regular_file(".", info) == nullptr, R"(clask::open_regular_file(".", info) == nullptr)");
+
+  bool keep_alive = false;
+  // A range that fits the output buffer is sent with an exact length.
+  auto out = run_writer_handler([&](clask::response_writer& resp, clask::request&) {
+    resp.write_file(file->fd(), 100, 50);
+  }, 1, 1024, keep_alive);
+  _ok(keep_alive == true, R"(keep_alive == true)");
+  _ok(out.find("Content-Length: 50\r\n") != std::string::npos, R"(out.find("Content-Length: 50\r\n") != std::string::npos)");
+  _ok(response_payload(out) == data.substr(100, 50), R"(response_payload(out) == data.substr(100, 50))");
+
+  // Larger ranges without a declared length are streamed as one chunk.
+  std::string streamed;
+  std::thread reader;
+  {
+    int fds[2];
+    _ok(make_socket_pair(fds) == true, R"(make_socket_pair(fds) == true)");
+    reader = std::thread([&, fd = fds[0]] {
+      char buf[4096];
+      ssize_t n;
+      while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        streamed.append(buf, (size_t) n);
+      }
+      closesocket(fd);
+    });
+    clask::response_writer resp(fds[1], 200, 1024);
+    resp.auto_frame(true, true);
+    resp.write("head:");
+    resp.write_file(file->fd(), 0, data.size());
+    keep_alive = resp.finish();
+    shutdown(fds[1], SHUT_WR);
+    reader.join();
+    closesocket(fds[1]);
+  }
+  _ok(keep_alive == true, R"(keep_alive == true)");
+  _ok(streamed.find("Transfer-Encoding: chunked\r\n") != std::string::npos, R"(streamed.find("Transfer-Encoding: chunked\r\n") != std::string::npos)");
+  _ok(
+      response_payload(streamed) == "5\r\nhead:\r\n30d40\r\n" + data + "\r\n0\r\n\r\n",
+      R"(response_payload(streamed) == "5\r\nhead:\r\n30d40\r\n" + data + "\r\n0\r\n\r\n")");
+
+  // A file that ends before the range does fails the send and closes.
+  run_writer_handler([&](clask::response_writer& resp, clask::request&) {
+    resp.write_file(file->fd(), data.size() - 10, 100000);
+  }, 1, 1024, keep_alive);
+  _ok(keep_alive == false, R"(short file range closes the connection)");
+
+  remove(path.c_str());
+}
+
+void test_clask_status_line_table() {
+  static_assert(clask::status_line(200) == "HTTP/1.1 200 OK\r\n");
+  static_assert(clask::status_reason(404) == "Not Found");
+  _ok(clask::status_line(431) == "HTTP/1.1 431 Request Header Fields Too Large\r\n", R"(clask::status_line(431) == "HTTP/1.1 431 Request Header Fields Too Large\r\n")");
+  _ok(clask::status_line(299).empty(), R"(clask::status_line(299).empty())");
+  _ok(clask::status_line(42).empty(), R"(clask::status_line(42).empty())");
+  _ok(clask::status_codes[404] == "Not Found", R"(clask::status_codes[404] == "Not Found")");
+
+  std::string head;
+  clask::append_status_line(head, 299);
+  _ok(head == "HTTP/1.1 299 \r\n", R"(head == "HTTP/1.1 299 \r\n")");
+
+  auto date = clask::http_date::header();
+  _ok(date.substr(0, 6) == "Date: ", R"(date.substr(0, 6) == "Date: ")");
+  _ok(date.size() == 37, R"(date.size() == 37)");
+  _ok(date.substr(date.size() - 6) == " GMT\r\n", R"(date.substr(date.size() - 6) == " GMT\r\n")");
+}
+
+static std::string run_static_handler(
+    clask::server_t& s,
+    const std::string& uri,
+    const std::vector<clask::header>& headers = {}) {
+  int fds[2];
+  if (!make_socket_pair(fds)) {
+    return "";
+  }
+  s.test_match("GET", uri, [&](const clask::func_t& fn, const clask::route_args& args) {
+    clask::request req("GET", uri, uri, {}, headers, "");
+    req.args = args.decode();
+    bool keep_alive = false;
+    fn.handle(fds[1], req, keep_alive);
   });
   closesocket(fds[1]);
   std::string out;
@@ -961,6 +2362,272 @@ void test_clask_static_dir_custom_404_page() {
   std::filesystem::remove_all(dir);
 }
 
+void test_clask_static_file_cache() {
+  const std::string dir = "./test_static_cache";
+  std::filesystem::create_directory(dir);
+  {
+    std::ofstream ofs(dir + "/a.txt", std::ios::binary);
+    ofs << "first";
+  }
+  {
+    std::ofstream ofs(dir + "/big.txt", std::ios::binary);
+    ofs << std::string(100, 'b');
+  }
+
+  auto s = clask::server().static_cache_size(4096).static_cache_max_file_size(64);
+  s.static_dir("/", dir, false, {{"Cache-Control", "no-cache"}});
+
+  auto uncached = serve_file_with_headers(dir + "/a.txt", {}, {{"Cache-Control", "no-cache"}});
+  auto out = run_static_handler(s, "/a.txt");
+  // The route adds Connection and Date on top of what serve_file writes.
+  auto strip_date = [](std::string v) {
+    for (auto name : {"Connection: ", "Date: "}) {
+      auto pos = v.find(name);
+      if (pos != std::string::npos) {
+        v.erase(pos, v.find("\r\n", pos) + 2 - pos);
+      }
+    }
+    return v;
+  };
+  _ok(strip_date(out) == strip_date(uncached), R"(cached response matches serve_file)");
+  out = run_static_handler(s, "/a.txt");
+  _ok(strip_date(out) == strip_date(uncached), R"(cache hit matches serve_file)");
+
+  auto pos = out.find("Etag: ");
+  auto etag = out.substr(pos + 6, out.find("\r\n", pos) - pos - 6);
+  out = run_static_handler(s, "/a.txt", {{"If-None-Match", etag}});
+  _ok(out.find("HTTP/1.1 304") == 0, R"(out.find("HTTP/1.1 304") == 0)");
+  _ok(out.find("Cache-Control: no-cache\r\n") != std::string::npos, R"(304 keeps extra headers)");
+
+  // Files over the per-file limit are never cached.
+  out = run_static_handler(s, "/big.txt");
+  _ok(out.find(std::string(100, 'b')) != std::string::npos, R"(large file is served)");
+
+  // Entries are revalidated against the file at most once per second.
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  {
+    std::ofstream ofs(dir + "/a.txt", std::ios::binary);
+    ofs << "second!";
+  }
+  out = run_static_handler(s, "/a.txt");
+  _ok(out.find("\r\n\r\nsecond!") != std::string::npos, R"(changed file is reloaded)");
+
+  // Mounts serving the same file keep their own headers.
+  s.static_dir("/other", dir, false, {{"Cache-Control", "max-age=60"}});
+  run_static_handler(s, "/other/a.txt");
+  out = run_static_handler(s, "/other/a.txt");
+  _ok(out.find("Cache-Control: max-age=60\r\n") != std::string::npos, R"(second mount's headers)");
+  out = run_static_handler(s, "/a.txt");
+  _ok(out.find("Cache-Control: no-cache\r\n") != std::string::npos, R"(first mount's headers)");
+
+  std::filesystem::remove_all(dir);
+}
+
+void test_clask_static_file_cache_lru() {
+  clask::static_file_cache cache;
+  auto make = [](size_t n) {
+    auto e = std::make_shared<clask::cached_file>();
+    e->body.assign(n, 'x');
+    return e;
+  };
+  cache.capacity(250);
+  cache.insert("a", make(100));
+  cache.insert("b", make(100));
+  _ok(cache.find("a") != nullptr, R"(cache.find("a") != nullptr)");
+  cache.insert("c", make(100));
+  _ok(cache.find("b") == nullptr, R"(least recently used entry is evicted)");
+  _ok(cache.find("a") != nullptr && cache.find("c") != nullptr, R"(recent entries stay)");
+  _ok(cache.size() == 200, R"(cache.size() == 200)");
+  cache.insert("huge", make(1000));
+  _ok(cache.find("huge") == nullptr, R"(entries larger than the cache are skipped)");
+  cache.capacity(0);
+  _ok(cache.size() == 0, R"(cache.size() == 0)");
+}
+
+void test_clask_accept_encoding() {
+  _ok(clask::accept_encoding_quality("gzip, br", "br") == 1000, R"(listed coding has q=1)");
+  _ok(clask::accept_encoding_quality("gzip;q=0.5, br;q=0", "gzip") == 500, R"(q=0.5 is 500)");
+  _ok(clask::accept_encoding_quality("gzip;q=0.5, br;q=0", "br") == 0, R"(q=0 is refused)");
+  _ok(clask::accept_encoding_quality("GZIP", "gzip") == 1000, R"(codings are case-insensitive)");
+  _ok(clask::accept_encoding_quality("*;q=0.1", "zstd") == 100, R"(* covers unlisted codings)");
+  _ok(clask::accept_encoding_quality("gzip", "br") == -1, R"(unlisted coding is -1)");
+
+  auto v = clask::negotiate_precompressed("gzip, deflate, br, zstd");
+  _ok(v.size() == 3 && std::string(v[0].coding) == "br" && std::string(v[2].coding) == "gzip", R"(server order breaks ties)");
+  v = clask::negotiate_precompressed("br;q=0.2, gzip");
+  _ok(v.size() == 2 && std::string(v[0].coding) == "gzip", R"(higher q wins)");
+  _ok(clask::negotiate_precompressed("identity").empty(), R"(identity only)");
+}
+
+void test_clask_static_precompressed() {
+  const std::string dir = "./test_precompressed";
+  std::filesystem::create_directory(dir);
+  {
+    std::ofstream ofs(dir + "/app.js", std::ios::binary);
+    ofs << "plain";
+  }
+  {
+    std::ofstream ofs(dir + "/app.js.gz", std::ios::binary);
+    ofs << "gzipped";
+  }
+  {
+    std::ofstream ofs(dir + "/app.js.br", std::ios::binary);
+    ofs << "brotli";
+  }
+
+  for (size_t cache_size : {(size_t) 0, (size_t) 4096}) {
+    auto s = clask::server().static_precompressed(true).static_cache_size(cache_size);
+    s.static_dir("/", dir);
+
+    auto out = run_static_handler(s, "/app.js", {{"Accept-Encoding", "gzip, br"}});
+    _ok(out.find("\r\n\r\nbrotli") != std::string::npos, R"(br sibling is preferred)");
+    _ok(out.find("Content-Encoding: br\r\n") != std::string::npos, R"(out.find("Content-Encoding: br\r\n") != std::string::npos)");
+    _ok(out.find("Content-Type: text/javascript\r\n") != std::string::npos, R"(type follows the original extension)");
+    _ok(out.find("Vary: Accept-Encoding\r\n") != std::string::npos, R"(out.find("Vary: Accept-Encoding\r\n") != std::string::npos)");
+
+    out = run_static_handler(s, "/app.js", {{"Accept-Encoding", "gzip, zstd"}});
+    _ok(out.find("\r\n\r\ngzipped") != std::string::npos, R"(missing zst sibling falls back to gzip)");
+
+    out = run_static_handler(s, "/app.js");
+    _ok(out.find("\r\n\r\nplain") != std::string::npos, R"(identity without Accept-Encoding)");
+    _ok(out.find("Content-Encoding") == std::string::npos, R"(out.find("Content-Encoding") == std::string::npos)");
+    _ok(out.find("Vary: Accept-Encoding\r\n") != std::string::npos, R"(identity response also varies)");
+  }
+
+  auto s = clask::server();
+  s.static_dir("/", dir);
+  auto out = run_static_handler(s, "/app.js", {{"Accept-Encoding", "br"}});
+  _ok(out.find("\r\n\r\nplain") != std::string::npos, R"(siblings are opt-in)");
+
+  std::filesystem::remove_all(dir);
+}
+
+#ifdef CLASK_USE_ZLIB
+static std::string zlib_decompress(const std::string& data) {
+  z_stream zs{};
+  // 32 detects either a gzip or a zlib header.
+  inflateInit2(&zs, 15 + 32);
+  zs.next_in = (Bytef*) data.data();
+  zs.avail_in = (uInt) data.size();
+  std::string out;
+  char buf[4096];
+  int ret;
+  do {
+    zs.next_out = (Bytef*) buf;
+    zs.avail_out = sizeof(buf);
+    ret = inflate(&zs, Z_NO_FLUSH);
+    out.append(buf, sizeof(buf) - zs.avail_out);
+  } while (ret == Z_OK);
+  inflateEnd(&zs);
+  return ret == Z_STREAM_END ? out : "";
+}
+
+static std::string dechunk(const std::string& body) {
+  std::string out;
+  size_t pos = 0;
+  while (pos < body.size()) {
+    auto eol = body.find("\r\n", pos);
+    if (eol == std::string::npos) {
+      break;
+    }
+    auto n = std::stoul(body.substr(pos, eol - pos), nullptr, 16);
+    if (n == 0) {
+      break;
+    }
+    out += body.substr(eol + 2, n);
+    pos = eol + 2 + n + 2;
+  }
+  return out;
+}
+
+void test_clask_response_compression() {
+  _ok(std::string(clask::negotiate_response_encoding("deflate, gzip")) == "gzip", R"(gzip wins ties)");
+  _ok(std::string(clask::negotiate_response_encoding("gzip;q=0.5, deflate")) == "deflate", R"(higher q wins)");
+  _ok(clask::negotiate_response_encoding("br, gzip;q=0") == nullptr, R"(q=0 is refused)");
+  _ok(clask::is_compressible_type("text/html; charset=utf-8"), R"(text is compressible)");
+  _ok(clask::is_compressible_type("application/problem+json"), R"(+json is compressible)");
+  _ok(!clask::is_compressible_type("image/png"), R"(images are already compressed)");
+  _ok(!clask::is_compressible_type("text/event-stream"), R"(event streams are left alone)");
+
+  std::string text;
+  for (int i = 0; i < 200; i++) {
+    text += "{\"id\":" + std::to_string(i) + ",\"name\":\"item\"},";
+  }
+  clask::response_write_config config{
+    .output_buffer_size = clask::default_output_buffer_size,
+    .compress = true,
+    .compression_level = clask::default_compression_level,
+    .compression_min_size = 1024,
+  };
+  auto handler = [&](const std::string& type, const std::string& body) {
+    return [=](clask::request&) {
+      return clask::response{
+        .code = 200,
+        .content = body,
+        .headers = {{"Content-Type", type}, {"ETag", "\"v1\""}},
+      };
+    };
+  };
+
+  auto out = run_response_handler(handler("application/json", text), {{"Accept-Encoding", "gzip, deflate"}}, config);
+  auto payload = response_payload(out);
+  _ok(out.find("Content-Encoding: gzip\r\n") != std::string::npos, R"(out.find("Content-Encoding: gzip\r\n") != std::string::npos)");
+  _ok(out.find("Vary: Accept-Encoding\r\n") != std::string::npos, R"(out.find("Vary: Accept-Encoding\r\n") != std::string::npos)");
+  _ok(out.find("Etag: W/\"v1\"\r\n") != std::string::npos, R"(strong ETag is weakened)");
+  _ok(out.find("Content-Length: " + std::to_string(payload.size()) + "\r\n") != std::string::npos, R"(Content-Length is the compressed size)");
+  _ok(payload.size() < text.size() && zlib_decompress(payload) == text, R"(gzip body round-trips)");
+
+  out = run_response_handler(handler("application/json", text), {{"Accept-Encoding", "deflate"}}, config);
+  _ok(out.find("Content-Encoding: deflate\r\n") != std::string::npos, R"(out.find("Content-Encoding: deflate\r\n") != std::string::npos)");
+  _ok(zlib_decompress(response_payload(out)) == text, R"(deflate body round-trips)");
+
+  out = run_response_handler(handler("application/json", text), {}, config);
+  _ok(response_payload(out) == text, R"(identity without Accept-Encoding)");
+  _ok(out.find("Vary: Accept-Encoding\r\n") != std::string::npos, R"(identity response also varies)");
+
+  out = run_response_handler(handler("application/json", "{}"), {{"Accept-Encoding", "gzip"}}, config);
+  _ok(response_payload(out) == "{}", R"(small bodies are not compressed)");
+  out = run_response_handler(handler("image/png", text), {{"Accept-Encoding", "gzip"}}, config);
+  _ok(response_payload(out) == text, R"(incompressible types are not compressed)");
+  _ok(out.find("Vary") == std::string::npos, R"(out.find("Vary") == std::string::npos)");
+
+  // Writer handlers compress a buffered body whole, and stream longer ones
+  // through chunked encoding.
+  auto writer = [&](clask::response_writer& resp, clask::request&) {
+    resp.set_header("Content-Type", "text/plain");
+    resp.write(text);
+    resp.flush();
+    resp.write(text);
+  };
+  bool keep_alive = false;
+  out = run_writer_handler(writer, 1, 256, keep_alive, {{"Accept-Encoding", "gzip"}}, true);
+  _ok(keep_alive == true, R"(keep_alive == true)");
+  _ok(out.find("Transfer-Encoding: chunked\r\n") != std::string::npos, R"(out.find("Transfer-Encoding: chunked\r\n") != std::string::npos)");
+  _ok(out.find("Content-Encoding: gzip\r\n") != std::string::npos, R"(out.find("Content-Encoding: gzip\r\n") != std::string::npos)");
+  _ok(zlib_decompress(dechunk(response_payload(out))) == text + text, R"(streamed body round-trips)");
+
+  auto buffered = [&](clask::response_writer& resp, clask::request&) {
+    resp.set_header("Content-Type", "text/plain");
+    resp.write(text);
+  };
+  out = run_writer_handler(buffered, 1, 16384, keep_alive, {{"Accept-Encoding", "gzip"}}, true);
+  payload = response_payload(out);
+  _ok(out.find("Content-Length: " + std::to_string(payload.size()) + "\r\n") != std::string::npos, R"(buffered body gets the compressed length)");
+  _ok(zlib_decompress(payload) == text, R"(buffered body round-trips)");
+
+  // HEAD negotiates the encoding like GET, so its headers describe the
+  // body GET would send.
+  auto head = run_writer_handler(buffered, 1, 16384, keep_alive, {{"Accept-Encoding", "gzip"}}, true, "HEAD");
+  _ok(head.find("Content-Encoding: gzip\r\n") != std::string::npos, R"(HEAD is compressed like GET)");
+  _ok(head.find("Content-Length: " + std::to_string(payload.size()) + "\r\n") != std::string::npos, R"(HEAD has the compressed length)");
+  _ok(response_payload(head).empty(), R"(HEAD sends no body)");
+  head = run_writer_handler(writer, 1, 256, keep_alive, {{"Accept-Encoding", "gzip"}}, true, "HEAD");
+  _ok(keep_alive == true, R"(keep_alive == true)");
+  _ok(head.find("Content-Encoding: gzip\r\n") != std::string::npos && head.find("Transfer-Encoding: chunked\r\n") != std::string::npos, R"(streamed HEAD matches GET's framing)");
+  _ok(response_payload(head).empty(), R"(streamed HEAD sends no body)");
+}
+#endif
+
 void test_clask_static_dir_plain_404_without_page() {
   const std::string dir = "./test_404_plain";
   std::filesystem::create_directory(dir);
@@ -1086,8 +2753,8 @@ void test_clask_fluent_server_setup() {
   });
 
   std::vector<std::string> req_args;
-  auto result = s.test_match("GET", "/chain/fluent", [&](const clask::func_t& /*fn*/, const std::vector<std::string>& args) {
-    req_args = args;
+  auto result = s.test_match("GET", "/chain/fluent", [&](const clask::func_t& /*fn*/, const clask::route_args& args) {
+    req_args = args.decode();
   });
   _ok(result == true, R"(result == true)");
   _ok(req_args.size() == 1, R"(req_args.size() == 1)");
@@ -1155,6 +2822,10 @@ int main() {
   subtest("test_clask_request_parse_multipart5", test_clask_request_parse_multipart5);
   subtest("test_clask_request_parse_multipart6", test_clask_request_parse_multipart6);
   subtest("test_clask_part_unquoted_last_param", test_clask_part_unquoted_last_param);
+  subtest("test_clask_multipart_parser_chunked_input", test_clask_multipart_parser_chunked_input);
+  subtest("test_clask_multipart_parser_unterminated", test_clask_multipart_parser_unterminated);
+  subtest("test_clask_multipart_fd_part_sink", test_clask_multipart_fd_part_sink);
+  subtest("test_clask_multipart_streamed_body", test_clask_multipart_streamed_body);
   subtest("test_clask_to_wstring", test_clask_to_wstring);
   subtest("test_clask_trim_string", test_clask_trim_string);
   subtest("test_clask_url_encode", test_clask_url_encode);
@@ -1168,21 +2839,54 @@ int main() {
   subtest("test_clask_route_register_after_child", test_clask_route_register_after_child);
   subtest("test_clask_static_dir_route_match", test_clask_static_dir_route_match);
   subtest("test_clask_non_root_static_dir_route_match", test_clask_non_root_static_dir_route_match);
+  subtest("test_clask_route_table", test_clask_route_table);
+  subtest("test_clask_func_t", test_clask_func_t);
+  subtest("test_clask_route_dsl", test_clask_route_dsl);
+  subtest("test_clask_middleware", test_clask_middleware);
+  subtest("test_clask_route_registry", test_clask_route_registry);
+  subtest("test_clask_route_methods", test_clask_route_methods);
+  subtest("test_clask_route_constraints", test_clask_route_constraints);
+  subtest("test_clask_reactor_inline", test_clask_reactor_inline);
+  subtest("test_clask_constant_response", test_clask_constant_response);
+  subtest("test_clask_access_log", test_clask_access_log);
+  subtest("test_clask_static_route_index", test_clask_static_route_index);
   subtest("test_clask_parse_listen_address", test_clask_parse_listen_address);
   subtest("test_clask_parse_route_method", test_clask_parse_route_method);
-  subtest("test_clask_parse_path_segment", test_clask_parse_path_segment);
   subtest("test_clask_request_read_result_helpers", test_clask_request_read_result_helpers);
   subtest("test_clask_parse_content_length", test_clask_parse_content_length);
   subtest("test_clask_read_request_invalid_content_length", test_clask_read_request_invalid_content_length);
   subtest("test_clask_read_request_conflicting_content_length", test_clask_read_request_conflicting_content_length);
   subtest("test_clask_read_request_content_length_bounds_body", test_clask_read_request_content_length_bounds_body);
+  subtest("test_clask_read_request_body_limits", test_clask_read_request_body_limits);
+  subtest("test_clask_read_request_body_spill", test_clask_read_request_body_spill);
+  subtest("test_clask_read_request_header_limits", test_clask_read_request_header_limits);
+#ifdef CLASK_USE_ZLIB
+  subtest("test_clask_read_request_content_encoding", test_clask_read_request_content_encoding);
+#endif
   subtest("test_clask_serve_file_if_modified_since", test_clask_serve_file_if_modified_since);
+  subtest("test_clask_parse_range_header", test_clask_parse_range_header);
+  subtest("test_clask_serve_file_range", test_clask_serve_file_range);
+  subtest("test_clask_http_date", test_clask_http_date);
+  subtest("test_clask_serve_file_etag", test_clask_serve_file_etag);
   subtest("test_clask_serve_file_csv_content_type", test_clask_serve_file_csv_content_type);
   subtest("test_clask_head_route_match", test_clask_head_route_match);
   subtest("test_clask_serve_file_head_request", test_clask_serve_file_head_request);
   subtest("test_clask_sse_writer_output", test_clask_sse_writer_output);
   subtest("test_clask_response_writer_end_keeps_socket_open", test_clask_response_writer_end_keeps_socket_open);
+  subtest("test_clask_response_writer_buffering", test_clask_response_writer_buffering);
+  subtest("test_clask_writer_handler_keep_alive", test_clask_writer_handler_keep_alive);
+  subtest("test_clask_status_line_table", test_clask_status_line_table);
+  subtest("test_clask_response_body_kinds", test_clask_response_body_kinds);
+  subtest("test_clask_response_etag", test_clask_response_etag);
+  subtest("test_clask_writer_write_file", test_clask_writer_write_file);
   subtest("test_clask_static_dir_custom_404_page", test_clask_static_dir_custom_404_page);
+  subtest("test_clask_static_file_cache", test_clask_static_file_cache);
+  subtest("test_clask_static_file_cache_lru", test_clask_static_file_cache_lru);
+  subtest("test_clask_accept_encoding", test_clask_accept_encoding);
+  subtest("test_clask_static_precompressed", test_clask_static_precompressed);
+#ifdef CLASK_USE_ZLIB
+  subtest("test_clask_response_compression", test_clask_response_compression);
+#endif
   subtest("test_clask_static_dir_plain_404_without_page", test_clask_static_dir_plain_404_without_page);
   subtest("test_clask_static_extra_headers", test_clask_static_extra_headers);
   subtest("test_clask_parent_reference_guard", test_clask_parent_reference_guard);